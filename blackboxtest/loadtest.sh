@@ -12,11 +12,20 @@ K2FDIR=$DATADIR/data/kafka2file
 test -f $BINDIR/../ENV.sh && source $BINDIR/../ENV.sh
 KAFKASERVER=${KAFKASERVER:-"localhost:9092"}
 ACK=${ACK:-1}
+BACKFILL_RATE=${BACKFILL_RATE:-0}
+# null or file measures tail2kafka alone, without kafka and kafka2file
+SINK=${SINK:-kafka}
 cp $CFGDIR/main.lua $CFGDIR/main.lua.backup
 cp $CFGDIR/linecopy.lua $CFGDIR/linecopy.lua.backup
 sed -i -E "s|localhost:9092|$KAFKASERVER|g" $CFGDIR/main.lua
 sed -i -E "s|_ACK_|$ACK|g" $CFGDIR/main.lua
+sed -i -E "s|_BACKFILL_RATE_|$BACKFILL_RATE|g" $CFGDIR/main.lua
 sed -i -E "s|BIGLOG|$T2KDIR/big.log|g" $CFGDIR/linecopy.lua
+if [ "$SINK" != "kafka" ]; then
+  echo "sink = \"$SINK\"" >> $CFGDIR/main.lua
+  echo "sinkfile = \"$T2KDIR/sink.out\"" >> $CFGDIR/main.lua
+  rm -f $T2KDIR/sink.out
+fi
 
 mkdir -p $K2FDIR
 find $K2FDIR -type f -delete
@@ -45,6 +54,7 @@ for suffix in 2 1; do
   echo "$T2KDIR/big.log.history.$suffix" >> $LIBDIR/biglog.history
   SIZE=$((SIZE + $(stat -c %s $T2KDIR/big.log.history.$suffix)))
 done
+HSIZE=$SIZE
 
 echo "history file"
 cat $LIBDIR/biglog.history
@@ -52,11 +62,13 @@ cat $LIBDIR/biglog.history
 export BLACKBOXTEST_OUTFILE_TPL=$K2FDIR/catnull
 
 find $K2FDIR -type f -delete
-$BINDIR/../build/kafka2file $KAFKASERVER $TOPIC 0 offset-end $K2FDIR $BINDIR/../scripts/catnull.sh &
-sleep 1
-if [ ! -f $K2FPID ] || [ ! -d /proc/$(cat $K2FPID) ]; then
-  echo "start kafka2file failed"
-  exit 1
+if [ "$SINK" = "kafka" ]; then
+  $BINDIR/../build/kafka2file $KAFKASERVER $TOPIC 0 offset-end $K2FDIR $BINDIR/../scripts/catnull.sh &
+  sleep 1
+  if [ ! -f $K2FPID ] || [ ! -d /proc/$(cat $K2FPID) ]; then
+    echo "start kafka2file failed"
+    exit 1
+  fi
 fi
 
 START=$(date +%s)
@@ -68,6 +80,13 @@ fi
 mv $CFGDIR/main.lua.backup $CFGDIR/main.lua
 mv $CFGDIR/linecopy.lua.backup $CFGDIR/linecopy.lua
 
+# the prepared files leave biglog.history when they are sent
+(
+  while grep -q "big.log.history" $LIBDIR/biglog.history 2>/dev/null; do sleep 1; done
+  echo "history size $HSIZE, backfill rate ${BACKFILL_RATE}MB/s, catch-up time consumption $(($(date +%s) - START - 2))s"
+) &
+HISTORYPID=$!
+
 gen_bigdata "current" $N 4096 $T2KDIR/big.log
 SIZE=$((SIZE + $(stat -c %s $T2KDIR/big.log)))
 mv $T2KDIR/big.log $T2KDIR/big.log.2
@@ -85,9 +104,11 @@ while [ true ]; do
 done
 
 SPAN=$(($(date +%s) - START - 2))
+wait $HISTORYPID
 echo "tail size $SIZE, time consumption ${SPAN}s"
 
 for f in "big.log.history.2" "big.log.history.1" "big.log.2"; do
+  [ "$SINK" = "kafka" ] || break
   test -f $BLACKBOXTEST_OUTFILE_TPL.$f || {
     echo "$f catnull notfound"
     exit 1
@@ -114,7 +135,15 @@ for block in 4096 2048 1024 512; do
   ROTATESPAN=$(($(date +%s) - START - 2))
 
   while [ true ]; do
-    if [ -f $BLACKBOXTEST_OUTFILE_TPL.big.log.$block ]; then
+    if [ "$SINK" != "kafka" ]; then
+      # the rotated file is closed when it is read to the end
+      if ! ls -l /proc/$CHILDPID/fd | grep -q "big.log.$block\$"; then
+        T2KSPAN=$(($(date +%s) - START - 2))
+        READSPAN=-
+        break
+      fi
+      sleep 1
+    elif [ -f $BLACKBOXTEST_OUTFILE_TPL.big.log.$block ]; then
       T2KSPAN=$(($(date +%s) - START - 2))
       READSPAN=$(/usr/bin/time -f %e cp /root/data/big.log.$block /dev/null 2>&1)   # put it in before md5 to avoid read cache
 
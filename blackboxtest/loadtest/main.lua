@@ -6,6 +6,7 @@ polllimit = 50
 brokers   = "localhost:9092"
 
 rotatedelay = 10
+backfill_rate = _BACKFILL_RATE_
 -- optional
 pingbackurl = "http://localhost/pingback/tail2kafka"
 
@@ -1,9 +1,13 @@
 #include <memory>
+#include <algorithm>
 
 #include "logger.h"
 #include "sys.h"
 #include "luahelper.h"
 #include "luactx.h"
+#include "filerecord.h"
+#include "filereader.h"
+#include "globsource.h"
 #include "cnfctx.h"
 
 CnfCtx *CnfCtx::loadCnf(const char *dir, char *errbuf)
@@ -30,24 +34,6 @@ CnfCtx *CnfCtx::loadCnf(const char *dir, char *errbuf)
   return cnf;
 }
 
-inline bool initPipe(int *accept, int *server, char *errbuf)
-{
-  if (*accept != -1) close(*accept);
-  if (*server != -1) close(*server);
-
-  *accept = *server = -1;
-
-  int fd[2];
-  if (pipe(fd) == -1) {
-    snprintf(errbuf, MAX_ERR_LEN, "pipe error");
-    return false;
-  }
-
-  *accept = fd[0];
-  *server = fd[1];
-  return true;
-}
-
 bool CnfCtx::reset()
 {
   for (std::vector<LuaCtx *>::iterator ite = luaCtxs_.begin(); ite != luaCtxs_.end(); ++ite) {
@@ -56,7 +42,18 @@ bool CnfCtx::reset()
     if (!ctx->loadHistoryFile()) return false;
   }
 
-  if (!initPipe(&accept, &server, errbuf_)) return false;
+  if (!initQueues(errbuf_)) return false;
+  return true;
+}
+
+bool CnfCtx::initQueues(char *errbuf)
+{
+  size_t n = tailWorkers_ > 0 ? tailWorkers_ : 1;
+  while (queues_.size() < n) queues_.push_back(new util::SpscRing);
+
+  for (std::vector<util::SpscRing *>::iterator ite = queues_.begin(); ite != queues_.end(); ++ite) {
+    if (!(*ite)->init(QUEUE_RING_SIZE, errbuf)) return false;
+  }
   return true;
 }
 
@@ -85,17 +82,64 @@ CnfCtx *CnfCtx::loadFile(const char *file, char *errbuf)
 
   if (!helper->getInt("partition", &cnf->partition_, -1)) return 0;
   if (!helper->getInt("polllimit", &cnf->pollLimit_, 100)) return 0;
+  if (!helper->getInt("coalescems", &cnf->coalesceMs_, 0)) return 0;
+  if (cnf->coalesceMs_ < 0 || cnf->coalesceMs_ > MAX_COALESCE_MS) {
+    snprintf(errbuf, MAX_ERR_LEN, "coalescems must be in [0, %d]", MAX_COALESCE_MS);
+    return 0;
+  }
+  if (!helper->getInt("tailworkers", &cnf->tailWorkers_, 0)) return 0;
+  if (cnf->tailWorkers_ < 0 || cnf->tailWorkers_ > MAX_TAIL_WORKERS) {
+    snprintf(errbuf, MAX_ERR_LEN, "tailworkers must be in [0, %d]", MAX_TAIL_WORKERS);
+    return 0;
+  }
+  if (!helper->getBool("iouring", &cnf->ioUring_, false)) return 0;
+  if (!helper->getInt("backfill_rate", &cnf->backfillRate_, 0)) return 0;
+  if (cnf->backfillRate_ < 0) {
+    snprintf(errbuf, MAX_ERR_LEN, "backfill_rate must >= 0");
+    return 0;
+  }
+
+  if (!helper->getInt("fileoff_sync_interval", &cnf->fileOffSyncInterval_, 1000)) return 0;
+  if (cnf->fileOffSyncInterval_ < 10 || cnf->fileOffSyncInterval_ > 60000) {
+    snprintf(errbuf, MAX_ERR_LEN, "fileoff_sync_interval must be in [10, 60000]");
+    return 0;
+  }
+
+  if (!helper->getInt("globmaxfds", &cnf->globMaxFds_, 1024)) return 0;
+  if (!helper->getInt("globmaxfiles", &cnf->globMaxFiles_, 8192)) return 0;
+  if (cnf->globMaxFds_ < 1 || cnf->globMaxFiles_ < 1) {
+    snprintf(errbuf, MAX_ERR_LEN, "globmaxfds and globmaxfiles must > 0");
+    return 0;
+  }
 
   if (!helper->getString("pingbackurl", &cnf->pingbackUrl_, "")) return 0;
 
-  if (!cnf->brokers_.empty()) {
+  if (!helper->getString("sink", &cnf->sinkType_, "")) return 0;
+  if (cnf->sinkType_.empty()) {
+    if (!cnf->brokers_.empty()) cnf->sinkType_ = "kafka";
+    else if (!cnf->esNodes_.empty()) cnf->sinkType_ = "es";
+  }
+
+  if (cnf->sinkType_ == "kafka" && !cnf->brokers_.empty()) {
     if (!helper->getTable("kafka_global", &cnf->kafkaGlobal_)) return 0;
     if (!helper->getTable("kafka_topic", &cnf->kafkaTopic_)) return 0;
-  } else if (!cnf->esNodes_.empty()) {
+    if (!helper->getInt("spool_size", &cnf->spoolSize_, 0)) return 0;
+    if (cnf->spoolSize_ < 0) {
+      snprintf(errbuf, MAX_ERR_LEN, "spool_size must >= 0");
+      return 0;
+    }
+    if (!helper->getInt("kafka_producers", &cnf->kafkaProducers_, 1)) return 0;
+    if (cnf->kafkaProducers_ < 1 || cnf->kafkaProducers_ > MAX_KAFKA_PRODUCERS) {
+      snprintf(errbuf, MAX_ERR_LEN, "kafka_producers must be in [1, %d]", MAX_KAFKA_PRODUCERS);
+      return 0;
+    }
+  } else if (cnf->sinkType_ == "es" && !cnf->esNodes_.empty()) {
     if (!helper->getInt("es_max_conns", &cnf->esMaxConns_, 1000)) return 0;
     if (!helper->getString("es_userpass", &cnf->esUserPass_, "")) return 0;
-  } else {
-    snprintf(errbuf, MAX_ERR_LEN, "brokers or esnodes is required");
+  } else if (cnf->sinkType_ == "file") {
+    if (!helper->getString("sinkfile", &cnf->sinkFile_)) return 0;
+  } else if (cnf->sinkType_ != "null") {
+    snprintf(errbuf, MAX_ERR_LEN, "brokers or esnodes is required, or sink null or file");
     return 0;
   }
 
@@ -107,7 +151,7 @@ CnfCtx *CnfCtx::loadFile(const char *file, char *errbuf)
 
   cnf->helper_ = helper.release();
 
-  if (!initPipe(&cnf->accept, &cnf->server, errbuf)) return 0;
+  if (!cnf->initQueues(errbuf)) return 0;
 
   cnf->errbuf_ = errbuf;
   return cnf.release();
@@ -135,7 +179,7 @@ bool CnfCtx::initKafka()
 
   std::auto_ptr<KafkaCtx> kafka(new KafkaCtx());
   if (!kafka->init(this, errbuf_)) return false;
-  kafka_ = kafka.release();
+  sink_ = kafka_ = kafka.release();
   return true;
 }
 
@@ -144,7 +188,24 @@ bool CnfCtx::initEs()
   assert(!esNodes_.empty());
   std::auto_ptr<EsCtx> es(new EsCtx());
   if (!es->init(this)) return false;
-  es_ = es.release();
+  sink_ = es_ = es.release();
+  return true;
+}
+
+bool CnfCtx::initSink()
+{
+  assert(sink_ == 0);
+
+  if (sinkType_ == "kafka") return initKafka();
+  if (sinkType_ == "es") return initEs();
+
+  if (sinkType_ == "null") {
+    sink_ = new NullSink(this);
+  } else {
+    std::auto_ptr<FileSink> sink(new FileSink(this));
+    if (!sink->init(sinkFile_, errbuf_)) return false;
+    sink_ = sink.release();
+  }
   return true;
 }
 
@@ -164,7 +225,17 @@ bool CnfCtx::initFileReader()
   for (std::vector<LuaCtx *>::iterator ite = luaCtxs_.begin(); ite != luaCtxs_.end(); ++ite) {
     LuaCtx *ctx = *ite;
     FileReader *reader = 0;
+
+    /* a file and all its topics are tailed by one thread */
+    int shard = (ite - luaCtxs_.begin()) % queues_.size();
+    if (ctx->glob()) {
+      for (LuaCtx *c = ctx; c; c = c->next()) c->shard(shard);
+      if (!ctx->glob()->init(ctx, errbuf_)) return false;
+      continue;
+    }
+
     while (ctx) {
+      ctx->shard(shard);
       if (!ctx->initFileReader(reader, errbuf_)) return false;
       if (!reader) reader = ctx->getFileReader();
       ctx = ctx->next();
@@ -173,6 +244,31 @@ bool CnfCtx::initFileReader()
   return true;
 }
 
+bool CnfCtx::hasGlob() const
+{
+  for (std::vector<LuaCtx *>::const_iterator ite = luaCtxs_.begin(); ite != luaCtxs_.end(); ++ite) {
+    if ((*ite)->glob()) return true;
+  }
+  return false;
+}
+
+off_t CnfCtx::backfillQuota(off_t want)
+{
+  if (backfillRate_ == 0) return want;
+
+  off_t limit = (off_t) backfillRate_ * 1024 * 1024;
+  pthread_mutex_lock(&backfillMutex_);
+  if (fasttime() != backfillSecond_) {
+    backfillSecond_ = fasttime();
+    backfillUsed_ = 0;
+  }
+
+  off_t n = std::min(want, limit - backfillUsed_);
+  backfillUsed_ += n;
+  pthread_mutex_unlock(&backfillMutex_);
+  return n;
+}
+
 void CnfCtx::logStats()
 {
   if (fasttime() <= lastLog_ + 5) return;
@@ -181,9 +277,24 @@ void CnfCtx::logStats()
 
   TailStats s;
   stats_.get(&s);
-  log_info(0, "kafka/es status %s, TailStatus,fileRead=%ld,logRead=%ld,logWrite=%ld,logSend=%ld,logRecv=%ld,logError=%ld,queueSize=%ld",
+
+  FileRecordStats r;
+  FileRecord::stats(&r);
+  log_info(0, "kafka/es status %s, TailStatus,fileRead=%ld,logRead=%ld,logWrite=%ld,logSend=%ld,logRecv=%ld,logError=%ld,queueSize=%ld,"
+           "recordSlabs=%ld,recordLive=%ld,recordRecycled=%ld",
            block ? "block" : "ok", s.fileRead(), s.logRead(), s.logWrite(),
-           s.logSend(), s.logRecv(), s.logError(), s.queueSize());
+           s.logSend(), s.logRecv(), s.logError(), s.queueSize(),
+           r.slabs, r.live, r.recycled);
+  if (kafka_) kafka_->logStats();
+
+  for (std::vector<LuaCtx *>::iterator ite = luaCtxs_.begin(); ite != luaCtxs_.end(); ++ite) {
+    int64_t rounds, total, max;
+    FileReader *reader = (*ite)->getFileReader();
+    if (reader && reader->waitStats(&rounds, &total, &max)) {
+      log_info(0, "%s tail wait rounds=%ld,avg=%ldms,max=%ldms", (*ite)->file().c_str(),
+               (long) rounds, (long) (total / rounds), (long) max);
+    }
+  }
   lastLog_ = fasttime();
 }
 
@@ -194,10 +305,23 @@ CnfCtx::CnfCtx() {
   helper_  = 0;
   kafka_   = 0;
   es_      = 0;
+  sink_    = 0;
   fileOff_ = 0;
 
-  accept = server = -1;
   count_  = 0;
+  coalesceMs_ = 0;
+  tailWorkers_ = 0;
+  ioUring_ = false;
+  pthread_mutex_init(&luaMutex_, 0);
+
+  backfillRate_ = 0;
+  globMaxFds_ = globMaxFiles_ = globFiles_ = 0;
+  fileOffSyncInterval_ = 1000;
+  spoolSize_ = 0;
+  kafkaProducers_ = 1;
+  backfillSecond_ = 0;
+  backfillUsed_ = 0;
+  pthread_mutex_init(&backfillMutex_, 0);
   gettimeofday(&timeval_, 0);
 
   tailLimit_ = false;
@@ -216,10 +340,12 @@ CnfCtx::~CnfCtx()
   }
 
   if (helper_)  delete helper_;
-  if (kafka_)   delete kafka_;
-  if (es_)      delete es_;
+  if (sink_)    delete sink_;
   if (fileOff_) delete fileOff_;
 
-  if (accept != -1) close(accept);
-  if (server != -1) close(server);
+  for (std::vector<util::SpscRing *>::iterator ite = queues_.begin(); ite != queues_.end(); ++ite) {
+    delete *ite;
+  }
+  pthread_mutex_destroy(&luaMutex_);
+  pthread_mutex_destroy(&backfillMutex_);
 }
@@ -5,8 +5,11 @@
 #include <vector>
 #include <map>
 #include <sys/time.h>
+#include <pthread.h>
 
 #include "gnuatomic.h"
+#include "spscring.h"
+#include "readchunk.h"
 #include "fileoff.h"
 #include "luahelper.h"
 #include "esctx.h"
@@ -16,7 +19,12 @@
 #define VERSION "2.3.2"
 
 #define QUEUE_ERROR_TIMEOUT 60
+#define MAX_KAFKA_PRODUCERS 16
 #define MAX_FILE_QUEUE_SIZE 50000
+#define MAX_PINNED_CHUNK_SIZE (256 * 1024 * 1024)
+#define QUEUE_RING_SIZE     8192
+#define MAX_TAIL_WORKERS    64
+#define MAX_COALESCE_MS     100
 
 class TailStats {
 public:
@@ -78,10 +86,6 @@ enum TimeUnit {
 
 class CnfCtx {
   template<class T> friend class UNITTEST_HELPER;
-public:
-  int                    accept;
-  int                    server;
-
 public:
   static CnfCtx *loadCnf(const char *dir, char *errbuf);
   bool reset();
@@ -90,15 +94,20 @@ public:
   ~CnfCtx();
   void addLuaCtx(LuaCtx *ctx);
 
-  bool enableKafka() const { return !brokers_.empty(); }
+  bool enableKafka() const { return sinkType_ == "kafka"; }
   bool initKafka();
   KafkaCtx *getKafka() { return kafka_; }
 
-  bool enableEs() const { return !esNodes_.empty(); }
+  bool enableEs() const { return sinkType_ == "es"; }
 
   bool initEs();
   EsCtx *getEs() { return es_; }
 
+  /* kafka, es, or null and file for benchmarks, see sink */
+  bool initSink();
+  Sink *getSink() { return sink_; }
+  const std::string &sinkType() const { return sinkType_; }
+
   bool initFileOff();
   FileOff *getFileOff() { return fileOff_; }
 
@@ -128,6 +137,34 @@ public:
   std::vector<LuaCtx *> &getLuaCtxs() { return luaCtxs_; }
 
   int getPollLimit() const { return pollLimit_; }
+  int coalesceMs() const { return coalesceMs_; }
+  int tailWorkers() const { return tailWorkers_; }
+  bool ioUring() const { return ioUring_; }
+
+  /* ms between two checkpoints of fileoff */
+  int fileOffSyncInterval() const { return fileOffSyncInterval_; }
+  int spoolSize() const { return spoolSize_; }
+  int kafkaProducers() const { return kafkaProducers_; }
+
+  /* open files and files of all glob patterns */
+  int globMaxFds() const { return globMaxFds_; }
+  int globMaxFiles() const { return globMaxFiles_; }
+  bool hasGlob() const;
+  bool addGlobFile() {
+    if (globFiles_ >= globMaxFiles_) return false;
+    globFiles_++;
+    return true;
+  }
+
+  /* bytes the history files may read now, backfill_rate is shared by all files */
+  off_t backfillQuota(off_t want);
+
+  /* record batches to routine, one ring for each tail thread */
+  util::SpscRing *queue(int shard) { return queues_[shard]; }
+  std::vector<util::SpscRing *> &queues() { return queues_; }
+
+  /* functions of main.lua are shared by the files of all tail threads */
+  pthread_mutex_t *luaMutex() { return &luaMutex_; }
   const std::string &pingbackUrl() const { return pingbackUrl_; }
 
   uint32_t addr() const { return addr_; }
@@ -155,12 +192,21 @@ public:
   void flowControl(bool block) { util::atomic_set(&flowControl_, block ? 1 : 0); }
 
   bool flowControlOn() const {
-    return util::atomic_get((int *) &flowControl_) ||
-      stats_.queueSize() > MAX_FILE_QUEUE_SIZE;
+    if (util::atomic_get((int *) &flowControl_) ||
+        stats_.queueSize() > MAX_FILE_QUEUE_SIZE) return true;
+
+    /* the records count the lines, not the read chunks they hold */
+    if (ReadChunk::pinnedBytes() > MAX_PINNED_CHUNK_SIZE) return true;
+
+    for (std::vector<util::SpscRing *>::const_iterator ite = queues_.begin(); ite != queues_.end(); ++ite) {
+      if ((*ite)->size() > (*ite)->capacity() / 4 * 3) return true;
+    }
+    return false;
   }
 
 private:
   CnfCtx();
+  bool initQueues(char *errbuf);
 
   long lastLog_;
   TailStats stats_;
@@ -170,6 +216,14 @@ private:
   uint32_t    addr_;
   int         partition_;
   int         pollLimit_;
+  int         coalesceMs_;     // wait for more events after the first one
+  int         tailWorkers_;
+  bool        ioUring_;
+  int         backfillRate_;   // MB/s, 0 no limit
+  int         fileOffSyncInterval_;
+  int         globMaxFds_;
+  int         globMaxFiles_;
+  int         globFiles_;
   std::string pingbackUrl_;
   std::string logdir_;
   std::string libdir_;
@@ -181,6 +235,8 @@ private:
   std::string                         brokers_;
   std::map<std::string, std::string>  kafkaGlobal_;
   std::map<std::string, std::string>  kafkaTopic_;
+  int                                 spoolSize_;   // MB, 0 no spool
+  int                                 kafkaProducers_;
   KafkaCtx                           *kafka_;
 
   std::vector<std::string> esNodes_;
@@ -188,12 +244,23 @@ private:
   int          esMaxConns_;
   EsCtx       *es_;
 
+  std::string  sinkType_;
+  std::string  sinkFile_;
+  Sink        *sink_;      // owns kafka_ or es_
+
   struct timeval timeval_;
   char        *errbuf_;
   RunStatus   *runStatus_;
 
-  LuaHelper  *helper_;
-  FileOff    *fileOff_;
+  LuaHelper       *helper_;
+  pthread_mutex_t  luaMutex_;
+
+  pthread_mutex_t  backfillMutex_;
+  int64_t          backfillSecond_;
+  off_t            backfillUsed_;
+  FileOff         *fileOff_;
+
+  std::vector<util::SpscRing *> queues_;
 
   bool tailLimit_;
   int flowControl_;
@@ -93,6 +93,62 @@ void split(const char *line, size_t nline, std::vector<std::string> *items)
   if (pos < nline) items->push_back(std::string(line + pos, nline - pos));
 }
 
+/* the same rules as split, a positive idx stops at the field, only a
+ * negative one keeps the fields
+ */
+bool splitField(const char *line, size_t nline, int idx, const char **field, size_t *len)
+{
+  std::vector<std::pair<size_t, size_t> > spans;
+  int count = 0;
+  bool esc = false;
+  char want = '\0';
+  size_t pos = 0;
+
+#define FOUND_FIELD(start, n) do {                          \
+    if (idx > 0 && ++count == idx) {                        \
+      *field = line + (start);                              \
+      *len   = (n);                                         \
+      return true;                                          \
+    } else if (idx < 0) {                                   \
+      spans.push_back(std::make_pair(start, n));            \
+    }                                                       \
+  } while (0)
+
+  for (size_t i = 0; i < nline; ++i) {
+    if (esc) {
+      esc = false;
+    } else if (line[i] == '\\') {
+      esc = true;
+    } else if (want != '\0') {
+      if (line[i] == want) {
+        want = '\0';
+        FOUND_FIELD(pos, i-pos);
+        pos = i+1;
+      }
+    } else {
+      if (line[i] == '"') {
+        want = line[i];
+        pos++;
+      } else if (line[i] == '[') {
+        want = ']';
+        pos++;
+      } else if (line[i] == ' ') {
+        if (i != pos) FOUND_FIELD(pos, i-pos);
+        pos = i+1;
+      }
+    }
+  }
+  if (pos < nline) FOUND_FIELD(pos, nline-pos);
+#undef FOUND_FIELD
+
+  if (idx >= 0 || (size_t) -idx > spans.size()) return false;
+
+  size_t i = spans.size() + idx;
+  *field = line + spans[i].first;
+  *len   = spans[i].second;
+  return true;
+}
+
 void splitn(const char *line, size_t nline, std::vector<std::string> *items, int limit, char delimiter)
 {
   bool esc = false;
@@ -17,11 +17,22 @@ typedef std::vector<LuaCtx *>              LuaCtxPtrList;
 
 #define MAX_ERR_LEN    512
 
+/* the kafka headers of a kafkaheaders topic instead of the *host@off prefix,
+ * host is a string, the others are 8 bytes big endian, time is in ms
+ */
+#define KAFKA_HEADERS_VERSION  0x000b0400   // librdkafka 0.11.4
+#define KAFKA_HEADER_HOST      "host"
+#define KAFKA_HEADER_INODE     "inode"
+#define KAFKA_HEADER_OFFSET    "offset"
+#define KAFKA_HEADER_TIME      "time"
+
 bool shell(const char *cmd, std::string *output, char *errbuf);
 bool hostAddr(const std::string &host, uint32_t *addr, char *errbuf);
 void split(const char *line, size_t nline, std::vector<std::string> *items);
 void splitn(const char *line, size_t nline, std::vector<std::string> *items,
             int limit = -1, char delimiter = ' ');
+/* the field idx of split, 1 based or from the end if negative, without copy */
+bool splitField(const char *line, size_t nline, int idx, const char **field, size_t *len);
 bool timeLocalToIso8601(const std::string &t, std::string *iso, time_t *timestamp = 0);
 bool parseIso8601(const std::string &t, time_t *timestamp);
 
@@ -41,8 +41,8 @@ void EsUrl::reinit(FileRecord *record, bool move)
     timeoutRetry_ = 0;
   }
 
-  body_ = record->data->c_str();
-  nbody_ = record->data->size();
+  body_ = record->ptr();
+  nbody_ = record->len();
 
   std::string docIndex = *(record->esIndex);
   // docIndex = "debug";
@@ -738,6 +738,7 @@ bool EsCtx::produce(std::vector<FileRecord *> *records)
   for (std::vector<FileRecord *>::iterator ite = records->begin(), end = records->end();
        ite != end; ++ite) {
     if ((*ite)->off == (off_t) -1) {
+      (*ite)->ctx->getFileReader()->dropFileRecord(*ite);
       FileRecord::destroy(*ite);
       continue;
     }
@@ -9,6 +9,7 @@
 
 #include "gnuatomic.h"
 #include "filerecord.h"
+#include "sink.h"
 class CnfCtx;
 
 #define MAX_HTTP_HEADER_LEN 8192
@@ -186,12 +187,13 @@ private:
   pthread_t tid_;
 };
 
-class EsCtx {
+class EsCtx : public Sink {
   template<class T> friend class UNITTEST_HELPER;
 public:
   ~EsCtx();
   bool init(CnfCtx *cnf);
   bool produce(std::vector<FileRecord *> *datas);
+  const char *name() const { return "es"; }
 
 private:
   CnfCtx *cnf_;
@@ -1,98 +1,394 @@
 #include <cstdio>
 #include <cstring>
+#include <algorithm>
 #include <errno.h>
-#include <sys/mman.h>
+#include <zlib.h>
+#include <time.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 
+#include "logger.h"
 #include "cnfctx.h"
 #include "luactx.h"
 #include "filereader.h"
+#include "globsource.h"
 #include "fileoff.h"
 
 const size_t FileOff::MAX_FILENAME_LENGTH = 256;
 
+static const char FILEOFF_MAGIC[8] = {'T', '2', 'K', 'O', 'F', 'F', '0', '2'};
+
+struct FileOffHeader {
+  char     magic[8];
+  uint64_t seq;
+  uint64_t time;
+  uint32_t count;
+  uint32_t crc;     // of the header with crc 0
+};
+
+struct FileOffDiskRecord {
+  uint64_t inode;
+  int64_t  off;
+  uint32_t crc;     // of seq, inode and off, a stale record of an older checkpoint is bad too
+  uint32_t pad;
+};
+
+/* the flat array of the old versions */
+struct FileOffLegacyRecord {
+  uint64_t inode;
+  int64_t  off;
+};
+
+static uint32_t recordCrc(uint64_t seq, const FileOffDiskRecord *record)
+{
+  uint32_t crc = crc32(0, (const Bytef *) &seq, sizeof(seq));
+  crc = crc32(crc, (const Bytef *) &record->inode, sizeof(record->inode));
+  return crc32(crc, (const Bytef *) &record->off, sizeof(record->off));
+}
+
+static uint32_t headerCrc(FileOffHeader header)
+{
+  header.crc = 0;
+  return crc32(0, (const Bytef *) &header, sizeof(header));
+}
+
 FileOff::FileOff()
 {
   cnf_  = 0;
-  addr_ = MAP_FAILED;
+  records_ = 0;
+  slots_ = 0;
+  reserved_ = 0;
+
+  fd_ = -1;
+  copySize_ = 0;
+  seq_ = 0;
+
+  started_ = quit_ = false;
+  pthread_mutex_init(&mutex_, 0);
+  pthread_cond_init(&cond_, 0);
 }
 
 FileOff::~FileOff()
 {
-  if (addr_ != MAP_FAILED) munmap(addr_, length_);
+  stop();
+  if (fd_ != -1) close(fd_);
+  if (records_) delete[] records_;
+
+  pthread_mutex_destroy(&mutex_);
+  pthread_cond_destroy(&cond_);
 }
 
-bool FileOff::loadFromFile(char *errbuf)
+bool FileOff::read(const std::string &file, std::vector<FileOffCheckpoint> *copies, char *errbuf)
 {
-  FILE *fp = fopen(file_.c_str(), "r");
+  FILE *fp = fopen(file.c_str(), "r");
   if (!fp) {
-    if (errno != ENOENT) {
-      snprintf(errbuf, MAX_ERR_LEN, "FileOff load error %s", strerror(errno));
-      return false;
-    } else {
-      return true;
+    if (errno == ENOENT) return true;
+    snprintf(errbuf, MAX_ERR_LEN, "FileOff load %s error %s", file.c_str(), strerror(errno));
+    return false;
+  }
+
+  std::string data;
+  char buffer[8192];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) data.append(buffer, n);
+  fclose(fp);
+
+  /* the magic of one copy may be torn, the other one tells the format */
+  size_t copySize = data.size() / 2;
+  bool current = data.size() >= sizeof(FILEOFF_MAGIC) * 2 &&
+    (memcmp(data.data(), FILEOFF_MAGIC, sizeof(FILEOFF_MAGIC)) == 0 ||
+     memcmp(data.data() + copySize, FILEOFF_MAGIC, sizeof(FILEOFF_MAGIC)) == 0);
+
+  if (!current) {
+    FileOffCheckpoint copy;
+    copy.valid = copy.legacy = true;
+
+    const FileOffLegacyRecord *record = (const FileOffLegacyRecord *) data.data();
+    for (size_t i = 0; i < data.size() / sizeof(FileOffLegacyRecord); ++i, ++record) {
+      if (record->inode == 0 && record->off == 0) continue;
+      copy.records.push_back(FileOffRecord(record->inode, record->off));
+    }
+    if (!data.empty()) copies->push_back(copy);
+    return true;
+  }
+
+  for (int i = 0; i < 2; ++i) {
+    FileOffCheckpoint copy;
+    const char *ptr = data.data() + i * copySize;
+
+    FileOffHeader header;
+    if (copySize < sizeof(header)) break;
+    memcpy(&header, ptr, sizeof(header));
+
+    copy.valid = memcmp(header.magic, FILEOFF_MAGIC, sizeof(FILEOFF_MAGIC)) == 0 && headerCrc(header) == header.crc &&
+      header.count <= (copySize - sizeof(header)) / sizeof(FileOffDiskRecord);
+    copy.seq  = header.seq;
+    copy.time = header.time;
+
+    for (uint32_t j = 0; copy.valid && j < header.count; ++j) {
+      FileOffDiskRecord record;
+      memcpy(&record, ptr + sizeof(header) + j * sizeof(record), sizeof(record));
+      if (recordCrc(header.seq, &record) != record.crc) {
+        copy.bad++;
+      } else if (record.inode != 0 || record.off != 0) {
+        copy.records.push_back(FileOffRecord(record.inode, record.off));
+      }
     }
+    copies->push_back(copy);
   }
-  FileOffRecord record;
-  while (fread(&record, sizeof(record), 1, fp) == 1) {
-    if (record.inode == 0 && record.off == 0) continue;
-    map_.insert(std::make_pair(record.inode, record.off));
+  return true;
+}
+
+/* the newer copy wins, a bad record of it is taken from the older one */
+void FileOff::merge(const std::vector<FileOffCheckpoint> &copies, std::map<ino_t, off_t> *offs, uint64_t *seq)
+{
+  std::vector<const FileOffCheckpoint *> valid;
+  for (std::vector<FileOffCheckpoint>::const_iterator ite = copies.begin(); ite != copies.end(); ++ite) {
+    if (!ite->valid) continue;
+    if (!valid.empty() && ite->seq < valid.back()->seq) valid.insert(valid.begin(), &(*ite));
+    else valid.push_back(&(*ite));
   }
 
-  fclose(fp);
+  *seq = 0;
+  for (std::vector<const FileOffCheckpoint *>::iterator ite = valid.begin(); ite != valid.end(); ++ite) {
+    for (std::vector<FileOffRecord>::const_iterator jte = (*ite)->records.begin(); jte != (*ite)->records.end(); ++jte) {
+      (*offs)[jte->inode] = jte->off;
+    }
+    *seq = (*ite)->seq;
+  }
+}
+
+bool FileOff::loadFromFile(char *errbuf)
+{
+  std::vector<FileOffCheckpoint> copies;
+  if (!read(file_, &copies, errbuf)) return false;
+
+  for (std::vector<FileOffCheckpoint>::iterator ite = copies.begin(); ite != copies.end(); ++ite) {
+    if (!ite->valid) {
+      log_error(0, "%s a copy is invalid, seq %lu", file_.c_str(), (unsigned long) ite->seq);
+    } else if (ite->bad) {
+      log_error(0, "%s seq %lu has %d bad records", file_.c_str(), (unsigned long) ite->seq, (int) ite->bad);
+    }
+  }
+
+  merge(copies, &map_, &seq_);
   return true;
 }
 
 bool FileOff::init(CnfCtx *cnf, char *errbuf)
 {
   cnf_  = cnf;
-  addr_ = MAP_FAILED;
   file_ = cnf->libdir() + "/fileoff";
 
   if (!loadFromFile(errbuf)) return false;
   return true;
 }
 
-bool FileOff::reinit()
+/* a new file is renamed over the old one, a process which is being
+ * replaced after a reload writes its last checkpoints to the old inode
+ */
+bool FileOff::create(const std::string &file, size_t slots, int *fd, size_t *copySize, char *errbuf)
 {
-  length_ = sizeof(FileOffRecord) * cnf_->getLuaCtxs().size();
+  *copySize = sizeof(FileOffHeader) + slots * sizeof(FileOffDiskRecord);
+  *copySize = (*copySize + 4095) / 4096 * 4096;
 
-  if (addr_ != MAP_FAILED) {
-    munmap(addr_, length_);
-    addr_ = MAP_FAILED;
+  std::string tmp = file + ".tmp";
+  *fd = open(tmp.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+  if (*fd == -1) {
+    snprintf(errbuf, MAX_ERR_LEN, "open %s error %s", tmp.c_str(), strerror(errno));
+    return false;
   }
 
-  int fd = open(file_.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
-  if (fd == -1) {
-    snprintf(cnf_->errbuf(), MAX_ERR_LEN, "open %s error %s", file_.c_str(), strerror(errno));
+  if (ftruncate(*fd, *copySize * 2) == -1) {
+    snprintf(errbuf, MAX_ERR_LEN, "ftruncate %s error %s", tmp.c_str(), strerror(errno));
+    close(*fd);
+    *fd = -1;
     return false;
   }
+  return true;
+}
 
-  if (ftruncate(fd, length_) == -1) {
-    snprintf(cnf_->errbuf(), MAX_ERR_LEN, "ftruncate %s error %s", file_.c_str(), strerror(errno));
-    close(fd);
+static bool renameSync(const std::string &file, int fd, char *errbuf)
+{
+  std::string tmp = file + ".tmp";
+  if (fsync(fd) == -1 || rename(tmp.c_str(), file.c_str()) == -1) {
+    snprintf(errbuf, MAX_ERR_LEN, "sync and rename %s error %s", tmp.c_str(), strerror(errno));
     return false;
   }
 
-  addr_ = mmap(NULL, length_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  if (addr_ == MAP_FAILED) {
-    snprintf(cnf_->errbuf(), MAX_ERR_LEN, "mmap %s error %s", file_.c_str(), strerror(errno));
-    close(fd);
+  size_t slash = file.rfind('/');
+  std::string dir = slash == std::string::npos ? "." : file.substr(0, slash);
+  int dfd = open(dir.c_str(), O_RDONLY);
+  if (dfd != -1) {
+    fsync(dfd);
+    close(dfd);
+  }
+  return true;
+}
+
+bool FileOff::writeCopy(int fd, size_t copySize, uint64_t seq, const std::vector<FileOffRecord> &records, char *errbuf)
+{
+  std::string buffer(sizeof(FileOffHeader) + records.size() * sizeof(FileOffDiskRecord), '\0');
+
+  FileOffHeader header;
+  memcpy(header.magic, FILEOFF_MAGIC, sizeof(FILEOFF_MAGIC));
+  header.seq   = seq;
+  header.time  = time(0);
+  header.count = records.size();
+  header.crc   = headerCrc(header);
+  memcpy(&buffer[0], &header, sizeof(header));
+
+  for (size_t i = 0; i < records.size(); ++i) {
+    FileOffDiskRecord record;
+    record.inode = records[i].inode;
+    record.off   = records[i].off;
+    record.crc   = recordCrc(seq, &record);
+    record.pad   = 0;
+    memcpy(&buffer[sizeof(header) + i * sizeof(record)], &record, sizeof(record));
+  }
+
+  off_t off = (seq % 2) * copySize;
+  if (pwrite(fd, buffer.data(), buffer.size(), off) != (ssize_t) buffer.size() || fdatasync(fd) == -1) {
+    snprintf(errbuf, MAX_ERR_LEN, "write checkpoint %lu error %s", (unsigned long) seq, strerror(errno));
     return false;
   }
+  return true;
+}
+
+bool FileOff::write(const std::string &file, const std::map<ino_t, off_t> &offs, uint64_t seq, char *errbuf)
+{
+  std::vector<FileOffRecord> records;
+  for (std::map<ino_t, off_t>::const_iterator ite = offs.begin(); ite != offs.end(); ++ite) {
+    records.push_back(FileOffRecord(ite->first, ite->second));
+  }
+
+  int fd;
+  size_t copySize;
+  if (!create(file, records.size(), &fd, &copySize, errbuf)) return false;
+
+  bool rc = writeCopy(fd, copySize, seq, records, errbuf) && writeCopy(fd, copySize, seq + 1, records, errbuf) &&
+    renameSync(file, fd, errbuf);
+  close(fd);
+  return rc;
+}
+
+bool FileOff::reinit()
+{
+  /* every file of the glob patterns has its own slot, up to globmaxfiles */
+  slots_ = cnf_->getLuaCtxs().size() + (cnf_->hasGlob() ? cnf_->globMaxFiles() : 0);
+
+  if (records_) delete[] records_;
+  records_ = new FileOffRecord[slots_];
+
+  if (fd_ != -1) close(fd_);
+  if (!create(file_, slots_, &fd_, &copySize_, cnf_->errbuf())) return false;
+
+  FileOffRecord *ptr = records_;
+  for (std::vector<LuaCtx *>::iterator ite = cnf_->getLuaCtxs().begin(); ite != cnf_->getLuaCtxs().end(); ++ite) {
+    if (!(*ite)->glob()) (*ite)->getFileReader()->initFileOffRecord(ptr);
+    ptr++;
+  }
 
-  char *ptr = (char *) addr_;
   for (std::vector<LuaCtx *>::iterator ite = cnf_->getLuaCtxs().begin(); ite != cnf_->getLuaCtxs().end(); ++ite) {
-    (*ite)->getFileReader()->initFileOffRecord((FileOffRecord *) ptr);
-    ptr += sizeof(FileOffRecord);
+    if (!(*ite)->glob()) continue;
+
+    const std::vector<LuaCtx *> &files = (*ite)->glob()->files();
+    for (std::vector<LuaCtx *>::const_iterator jte = files.begin(); jte != files.end(); ++jte) {
+      (*jte)->setGlobOff(ptr);
+      ptr++;
+    }
   }
-  memset(ptr, 0x00, (length_ - (ptr - (char *) addr_)));
+
+  reserved_ = ptr - records_;
+  last_.clear();
+
+  /* both copies, a zeroed one would be reported invalid at every load */
+  return checkpoint(true, cnf_->errbuf()) && checkpoint(true, cnf_->errbuf()) &&
+    renameSync(file_, fd_, cnf_->errbuf());
+}
+
+/* called by the tail threads */
+FileOffRecord *FileOff::reserve()
+{
+  if (!records_) return 0;
+
+  size_t slot = util::atomic_inc(&reserved_) - 1;
+  if (slot >= slots_) return 0;
+  return records_ + slot;
+}
+
+bool FileOff::checkpoint(bool force, char *errbuf)
+{
+  if (fd_ == -1) return true;
+
+  size_t n = std::min(util::atomic_get(&reserved_), slots_);
+  std::vector<FileOffRecord> records(n);
+  bool changed = force || n != last_.size();
+  for (size_t i = 0; i < n; ++i) {
+    records[i] = records_[i].get();
+    if (!changed) changed = records[i].inode != last_[i].inode || records[i].off != last_[i].off;
+  }
+  if (!changed) return true;
+
+  if (!writeCopy(fd_, copySize_, seq_ + 1, records, errbuf)) return false;
+  seq_++;
+  last_.swap(records);
   return true;
 }
 
+void *FileOff::run(void *data)
+{
+  FileOff *fileOff = (FileOff *) data;
+  char errbuf[MAX_ERR_LEN];
+  int interval = fileOff->cnf_->fileOffSyncInterval();
+
+  pthread_mutex_lock(&fileOff->mutex_);
+  while (!fileOff->quit_) {
+    struct timeval now;
+    gettimeofday(&now, 0);
+    int64_t usec = now.tv_usec + (int64_t) interval * 1000;
+    struct timespec deadline = {now.tv_sec + (time_t) (usec / 1000000), (long) (usec % 1000000) * 1000};
+    pthread_cond_timedwait(&fileOff->cond_, &fileOff->mutex_, &deadline);
+    if (fileOff->quit_) break;
+
+    pthread_mutex_unlock(&fileOff->mutex_);
+    if (!fileOff->checkpoint(false, errbuf)) log_fatal(0, "fileoff %s", errbuf);
+    pthread_mutex_lock(&fileOff->mutex_);
+  }
+  pthread_mutex_unlock(&fileOff->mutex_);
+  return 0;
+}
+
+bool FileOff::start(char *errbuf)
+{
+  quit_ = false;
+  int rc = pthread_create(&tid_, 0, run, this);
+  if (rc != 0) {
+    snprintf(errbuf, MAX_ERR_LEN, "start fileoff thread error %s", strerror(rc));
+    return false;
+  }
+  started_ = true;
+  return true;
+}
+
+void FileOff::stop()
+{
+  if (!started_) return;
+
+  pthread_mutex_lock(&mutex_);
+  quit_ = true;
+  pthread_cond_signal(&cond_);
+  pthread_mutex_unlock(&mutex_);
+  pthread_join(tid_, 0);
+  started_ = false;
+
+  char errbuf[MAX_ERR_LEN];
+  if (!checkpoint(false, errbuf)) log_fatal(0, "fileoff %s", errbuf);
+}
+
 off_t FileOff::getOff(ino_t inode) const
 {
   std::map<ino_t, off_t>::const_iterator pos = map_.find(inode);
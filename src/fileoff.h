@@ -3,22 +3,61 @@
 
 #include <map>
 #include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "gnuatomic.h"
+
 class CnfCtx;
 
+/* written by the thread which gets the acks, read by the checkpoint
+ * thread, version is odd while the pair is written
+ */
 struct FileOffRecord {
   ino_t  inode;
   off_t  off;
+  int    version;
+
+  FileOffRecord() : inode(0), off(0), version(0) {}
+  FileOffRecord(ino_t inode_, off_t off_) : inode(inode_), off(off_), version(0) {}
+
+  void set(ino_t inode_, off_t off_) {
+    util::atomic_inc(&version);
+    inode = inode_;
+    off   = off_;
+    util::atomic_inc(&version);
+  }
 
-  FileOffRecord() {}
-  FileOffRecord(ino_t inode_, off_t off_) : inode(inode_), off(off_) {}
+  FileOffRecord get() const {
+    while (true) {
+      int v = util::atomic_get((int *) &version);
+      FileOffRecord record(inode, off);
+      if (!(v & 1) && util::atomic_get((int *) &version) == v) return record;
+    }
+  }
+};
+
+/* one copy of the checkpoint file as it is read back */
+struct FileOffCheckpoint {
+  bool     valid;   // the header crc is right
+  bool     legacy;  // the flat array before the checkpoints
+  uint64_t seq;
+  uint64_t time;
+  size_t   bad;     // records whose crc is wrong, they are left out
+  std::vector<FileOffRecord> records;
 
-//  char   file[FileOff::MAX_FILENAME_LENGTH];
+  FileOffCheckpoint() : valid(false), legacy(false), seq(0), time(0), bad(0) {}
 };
 
+/* the file has two copies of the checkpoint, a checkpoint overwrites the
+ * older one and is synced, a crash in the middle of it leaves the other
+ * one. every record has a crc, the records of both copies are merged in
+ * seq order when loaded, see fileoff_sync_interval
+ */
 class FileOff {
   template<class T> friend class UNITTEST_HELPER;
 public:
@@ -32,16 +71,46 @@ public:
   off_t getOff(ino_t inode) const;
   bool setOff(ino_t inode, off_t off);
 
+  /* a slot for a file of a glob pattern, 0 before reinit */
+  FileOffRecord *reserve();
+
+  /* write the records if any changed since the last checkpoint */
+  bool checkpoint(bool force, char *errbuf);
+  /* checkpoint every interval in a thread, and once more when stopped */
+  bool start(char *errbuf);
+  void stop();
+
+  /* for the fileoff tool, a missing file has no copy */
+  static bool read(const std::string &file, std::vector<FileOffCheckpoint> *copies, char *errbuf);
+  static void merge(const std::vector<FileOffCheckpoint> &copies, std::map<ino_t, off_t> *offs, uint64_t *seq);
+  static bool write(const std::string &file, const std::map<ino_t, off_t> &offs, uint64_t seq, char *errbuf);
+
 private:
   bool loadFromFile(char *errbuf);
   void deleteMallocPtr();
 
+  static void *run(void *data);
+  static bool create(const std::string &file, size_t slots, int *fd, size_t *copySize, char *errbuf);
+  static bool writeCopy(int fd, size_t copySize, uint64_t seq, const std::vector<FileOffRecord> &records, char *errbuf);
+
 private:
-  CnfCtx      *cnf_;
-  std::string  file_;
-  void        *addr_;
-  size_t      length_;
+  CnfCtx        *cnf_;
+  std::string    file_;
+  FileOffRecord *records_;
+  size_t         slots_;
+  size_t         reserved_;  // the next free slot of the glob files
   std::map<ino_t, off_t> map_;
+
+  int      fd_;
+  size_t   copySize_;
+  uint64_t seq_;     // of the last checkpoint
+  std::vector<FileOffRecord> last_;
+
+  bool            started_;
+  bool            quit_;
+  pthread_t       tid_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t  cond_;
 };
 
 #endif
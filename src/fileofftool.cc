@@ -0,0 +1,66 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "common.h"
+#include "logger.h"
+#include "fileoff.h"
+
+LOGGER_INIT();
+
+/* show the copies of a fileoff, or write a clean one from what is left */
+int main(int argc, char *argv[])
+{
+  bool repair = argc == 3 && strcmp(argv[1], "-r") == 0;
+  if (argc != 2 && !repair) {
+    fprintf(stderr, "%s [-r] fileoff\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::string file = argv[argc-1];
+  char errbuf[MAX_ERR_LEN];
+
+  std::vector<FileOffCheckpoint> copies;
+  if (!FileOff::read(file, &copies, errbuf)) {
+    fprintf(stderr, "%s\n", errbuf);
+    return EXIT_FAILURE;
+  }
+  if (copies.empty()) {
+    fprintf(stderr, "%s is empty or missing\n", file.c_str());
+    return EXIT_FAILURE;
+  }
+
+  for (size_t i = 0; i < copies.size(); ++i) {
+    const FileOffCheckpoint &copy = copies[i];
+    if (copy.legacy) {
+      printf("copy %d legacy records %d\n", (int) i, (int) copy.records.size());
+    } else {
+      char timestr[64];
+      time_t t = copy.time;
+      strftime(timestr, sizeof(timestr), "%Y-%m-%dT%H:%M:%S", localtime(&t));
+      printf("copy %d %s seq %lu time %s records %d bad %d\n", (int) i, copy.valid ? "valid" : "invalid",
+             (unsigned long) copy.seq, timestr, (int) copy.records.size(), (int) copy.bad);
+    }
+  }
+
+  std::map<ino_t, off_t> offs;
+  uint64_t seq;
+  FileOff::merge(copies, &offs, &seq);
+
+  for (std::map<ino_t, off_t>::iterator ite = offs.begin(); ite != offs.end(); ++ite) {
+    printf("%lu %ld\n", (unsigned long) ite->first, (long) ite->second);
+  }
+
+  if (repair) {
+    if (!FileOff::write(file, offs, seq + 1, errbuf)) {
+      fprintf(stderr, "%s\n", errbuf);
+      return EXIT_FAILURE;
+    }
+    printf("%s rewritten with %d records, seq %lu\n", file.c_str(), (int) offs.size(), (unsigned long) seq + 2);
+  }
+  return EXIT_SUCCESS;
+}
@@ -1,6 +1,9 @@
 #include <cstring>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -11,11 +14,17 @@
 #include "sys.h"
 #include "metrics.h"
 #include "luactx.h"
+#include "linescanner.h"
+#include "readchunk.h"
 #include "filereader.h"
 
 #define NL                  '\n'
 #define MAX_LINE_LEN        8 * 1024 * 1024     // 8M
+#define MAX_LINE_BATCH      4096
 #define MAX_TAIL_SIZE       50 * MAX_LINE_LEN   // 400M
+#define BACKFILL_READAHEAD  4 * MAX_LINE_LEN    // 32M
+#define DRR_QUANTUM         4 * MAX_LINE_LEN    // 32M for weight 1
+#define MIN_SHARED_READ     MAX_LINE_LEN / 8    // 1M
 
 FileReader::StartPosition FileReader::stringToStartPosition(const char *s)
 {
@@ -30,21 +39,40 @@ FileReader::FileReader(LuaCtx *ctx)
 {
   fd_     = -1;
   ctx_    = ctx;
-  buffer_ = new char[MAX_LINE_LEN];
+  chunk_  = 0;
   npos_   = 0;
+  lineEnds_ = 0;
   flags_  = 0;
 
   size_ = dsize_ = 0;
   line_ = dline_ = 0;
+  inode_ = 0;
 
   eof_ = false;
+  roff_ = rloff_ = 0;
+
+  backfill_ = false;
+  raoff_ = dropoff_ = 0;
+  backfillTime_ = 0;
+
+  deficit_ = 0;
+  backlog_ = throttled_ = false;
+  readyTime_ = waitRounds_ = waitTotal_ = waitMax_ = 0;
+
+  suspended_ = suspendPending_ = deleted_ = false;
+  retired_ = pending_ = 0;
+  closedSize_ = -1;
+  fileOffRecord_ = 0;
+  pthread_mutex_init(&ackMutex_, 0);
 
   parent_ = 0;
 }
 
 FileReader::~FileReader()
 {
-  delete[] buffer_;
+  pthread_mutex_destroy(&ackMutex_);
+  if (chunk_) chunk_->release();
+  if (lineEnds_) delete[] lineEnds_;
   if (fd_ > 0) close(fd_);
 }
 
@@ -81,6 +109,23 @@ bool FileReader::openFile(struct stat *st, char *errbuf)
   fstat(fd_, st);
   inode_ = st->st_ino;
 
+  /* a rotated file is read once from start to end, start reading the
+   * next one from disk in the background while this one is processed
+   */
+  backfill_ = ctx_->backfill();
+  raoff_ = dropoff_ = 0;
+  if (backfill_) {
+    backfillTime_ = time(0);
+    posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    const std::string *next = ctx_->nextHistoryFile();
+    int nfd = next ? open(next->c_str(), O_RDONLY) : -1;
+    if (nfd != -1) {
+      posix_fadvise(nfd, 0, BACKFILL_READAHEAD, POSIX_FADV_WILLNEED);
+      close(nfd);
+    }
+  }
+
   MD5_Init(&md5Ctx_);
   md5_.clear();
 
@@ -89,6 +134,8 @@ bool FileReader::openFile(struct stat *st, char *errbuf)
 
 bool FileReader::init(char *errbuf)
 {
+  chunk_ = ReadChunk::create(MAX_LINE_LEN);
+
   std::string timeFormatFile;
   if (ctx_->getTimeFormatFile(&timeFormatFile)) {
     ctx_->setTimeFormatFile(timeFormatFile);
@@ -122,6 +169,10 @@ bool FileReader::tryReinit()
 
     log_info(0, "%s size=%lu sendsize=%lu lines=%lu sendlines=%lu md5=%s %s", ctx_->file().c_str(),
              size_, dsize_, line_, dline_, md5_.c_str(), ctx_->datafile().c_str());
+    if (backfill_) {
+      log_info(0, "%s backfill %s in %lds", ctx_->file().c_str(), ctx_->datafile().c_str(),
+               (long) (time(0) - backfillTime_));
+    }
     util::Metrics::pingback("ROTATE", "file=%s&size=%lu&md5=%s", ctx_->datafile().c_str(), size_, md5_.c_str());
 
     tail2kafka(END, &st, buildFileEndRecord(time(0), size_, ctx_->datafile().c_str()));
@@ -130,6 +181,16 @@ bool FileReader::tryReinit()
     fd_ = -1;
     eof_ = false;
     ctx_->removeHistoryFile();
+
+    /* a glob file waits closed until the name is created again */
+    if (ctx_->globFile()) {
+      chunk_->release();
+      chunk_ = 0;
+      npos_ = 0;
+      suspended_ = true;
+      setClosedSize(0);
+      return resume();
+    }
   }
 
   if (fd_ == -1 && openFile(&st)) {
@@ -175,8 +236,7 @@ void FileReader::initFileOffRecord(FileOffRecord * fileOffRecord)
   assert(parent_ == 0);
 
   fileOffRecord_ = fileOffRecord;
-  fileOffRecord_->inode = inode_;
-  fileOffRecord_->off   = size_;
+  fileOffRecord_->set(inode_, size_);
 }
 
 // FileOffRecord should be called in only one thread, but it must not call thread unsafe function
@@ -186,32 +246,56 @@ void FileReader::updateFileOffRecord(const FileRecord *record)
   ctx_->cnf()->stats()->queueSizeDec();
 
   if (record->off == (off_t) -1) {
+    util::atomic_dec(&pending_);
     return;
   }
 
   assert(parent_ == 0);
 
-  if (record->inode != fileOffRecord_->inode) {
-    // rename file does not change inode
-    log_info(0, "%d %s change inode from %ld/%ld to %ld/%ld", fd_, ctx_->topic().c_str(),
-      (long) fileOffRecord_->inode, (long) fileOffRecord_->off,
-      (long) record->inode, (long) record->off);
+  ackFileRecord(record);
+
+  /* the last access, a glob file may be reused after it */
+  util::atomic_dec(&pending_);
+}
 
-    fileOffRecord_->inode = record->inode;
-    fileOffRecord_->off   = record->off;
+void FileReader::dropFileRecord(const FileRecord *record)
+{
+  if (record->off != (off_t) -1) ackFileRecord(record);
+  util::atomic_dec(&pending_);
+}
 
-    dline_ = 1;
-    dsize_ = record->data->size();
-  } else if (record->off > fileOffRecord_->off) {
-    fileOffRecord_->off   = record->off;
+/* acks may come out of order from several partitions or sinks, the
+ * offset moves to the end of the acked records before the first one
+ * still in flight, so a restart never skips a record which was lost
+ */
+void FileReader::ackFileRecord(const FileRecord *record)
+{
+  assert(parent_ == 0);
 
-    util::atomic_inc(&dline_);
-    util::atomic_inc(&dsize_, record->data->size() - ctx_->function()->extraSize());
-  } else if (ctx_->getPartitioner() > PARTITIONER_RANDOM) {
-    log_fatal(0, "%d %s off change smaller, from %ld/%ld to %ld/%ld", fd_, ctx_->topic().c_str(),
-              (long) fileOffRecord_->inode, (long) fileOffRecord_->off,
-              (long) record->inode, (long) record->off);
+  pthread_mutex_lock(&ackMutex_);
+  acks_.ack(record->seq);
+
+  AckSlot slot;
+  ino_t inode = fileOffRecord_->inode;
+  off_t off = -1;
+  while (acks_.release(&slot)) {
+    if (slot.inode != inode) {
+      // rename file does not change inode
+      log_info(0, "%d %s change inode from %ld/%ld to %ld/%ld", fd_, ctx_->topic().c_str(),
+        (long) inode, (long) fileOffRecord_->off, (long) slot.inode, (long) slot.off);
+
+      inode = slot.inode;
+      util::atomic_set(&dline_, slot.lines);
+      util::atomic_set(&dsize_, slot.size);
+    } else {
+      util::atomic_inc(&dline_, slot.lines);
+      util::atomic_inc(&dsize_, slot.size);
+    }
+    off = slot.off;
   }
+
+  if (off != (off_t) -1) fileOffRecord_->set(inode, off);
+  pthread_mutex_unlock(&ackMutex_);
 }
 
 static struct FileInotifyStatusWithDesc {
@@ -300,25 +384,27 @@ bool FileReader::setStartPositionEnd(off_t fileSize, char *errbuf)
   off_t min = std::min(fileSize, (off_t) MAX_LINE_LEN);
   lseek(fd_, fileSize - min, SEEK_SET);
 
-  if (read(fd_, buffer_, MAX_LINE_LEN) != min) {
+  char *buffer = writableChunk();
+  if (read(fd_, buffer, MAX_LINE_LEN) != min) {
     snprintf(errbuf, MAX_ERR_LEN, "read %s less min %s", ctx_->file().c_str(), errno == 0 ? "" : strerror(errno));
     return false;
   }
 
-  char *pos = (char *) memrchr(buffer_, NL, min);
+  char *pos = (char *) memrchr(buffer, NL, min);
   if (!pos) {
     snprintf(errbuf, MAX_ERR_LEN, "%s line length bigger than %ld", ctx_->file().c_str(), (long) min);
     return false;
   }
 
-  size_ = fileSize - (min - (pos+1 - buffer_));
+  size_ = fileSize - (min - (pos+1 - buffer));
   return true;
 }
 
 bool FileReader::tail2kafka(StartPosition pos, const struct stat *stPtr, std::string *rawData)
 {
   assert(parent_ == 0);
-  if (fd_ == -1 && !tryReinit()) return false;
+  if (suspended_ && !resume()) return false;
+  if (fd_ == -1 && (deleted_ || !tryReinit())) return false;
 
   std::auto_ptr<std::string> rawDataPtr(rawData);
   if (pos == NIL && ctx_->cnf()->flowControlOn()) return false;
@@ -342,17 +428,8 @@ bool FileReader::tail2kafka(StartPosition pos, const struct stat *stPtr, std::st
   if (off > stPtr->st_size) return true;
 
   bool fileStart = (pos == START || size_ == 0);
-
-  if (stPtr->st_size - off > MAX_TAIL_SIZE) { // limit tailsize
-    log_info(0, "%d %s limit tail, off %ld, size %ld",
-             fd_, ctx_->datafile().c_str(), off, stPtr->st_size);
-
-    size_ = off + MAX_TAIL_SIZE;
-    ctx_->cnf()->setTailLimit(true);
-  } else {
-    size_ = stPtr->st_size;
-    eof_ = true;
-  }
+  if (pos == NIL) served();
+  limitTail(off, stPtr->st_size, pos == NIL);
 
   if (size_ > 0 && fileStart) {  // ignore empty file
     if (pos == START) propagateRawData(rawDataPtr.release());
@@ -362,63 +439,535 @@ bool FileReader::tail2kafka(StartPosition pos, const struct stat *stPtr, std::st
   off_t loff = off - npos_;
   assert(loff >= 0);
 
+  if (ctx_->mmapTail()) {
+    if (!tailMmap(&off)) return false;
+    loff = off;
+  }
+
   while (off < size_) {
     size_t min = std::min(size_ - off, (off_t) (MAX_LINE_LEN - npos_));
     assert(min > 0);
-    ssize_t nn = read(fd_, buffer_ + npos_, min);
+    ssize_t nn = read(fd_, writableChunk() + npos_, min);
     if (nn == -1) {
       log_fatal(errno, "%d %s read error", fd_, ctx_->datafile().c_str());
       return false;
     } else if (nn == 0) { // file was truncated
       break;
     }
-    off += nn;
+    if (!consumeRead(nn, &off, &loff)) break;
+  }
 
-    propagateTailContent(nn);
-    propagateProcessLines(inode_, &loff);
+  if (pos == END && size_ > 0) {  // ignore empty file
+    assert(off == stPtr->st_size);
+    propagateRawData(rawDataPtr.release());
+  }
 
-    if (ctx_->cnf()->flowControlOn()) {
-      size_ = off;
+  if (pos == NIL && eof_) {
+    bool rc = tryReinit();
+    idle();
+    return rc;
+  } else {
+    return eof_;
+  }
+}
+
+/* drr is set for the scheduled tails, not for the START/END of a rotation */
+void FileReader::limitTail(off_t off, off_t fileSize, bool drr)
+{
+  backlog_ = throttled_ = false;
+  if (fileSize - off > MAX_TAIL_SIZE) { // limit tailsize
+    log_info(0, "%d %s limit tail, off %ld, size %ld",
+             fd_, ctx_->datafile().c_str(), off, fileSize);
+
+    size_ = off + MAX_TAIL_SIZE;
+    ctx_->cnf()->setTailLimit(true);
+    backlog_ = true;
+  } else {
+    size_ = fileSize;
+    eof_ = true;
+  }
+
+  /* deficit round robin, every round adds weight * quantum to the deficit
+   * of the file, a file still behind after spending it waits for the next
+   * round, a file which catches up starts from zero again
+   */
+  if (drr) {
+    deficit_ += ctx_->weight() * DRR_QUANTUM;
+    if (size_ - off > deficit_) {
+      size_ = off + deficit_;
       eof_ = false;
-      break;
+      backlog_ = true;
+      deficit_ = 0;
+    } else if (backlog_) {
+      deficit_ -= size_ - off;
+    } else {
+      deficit_ = 0;
     }
   }
 
-  if (pos == END && size_ > 0) {  // ignore empty file
-    assert(off == stPtr->st_size);
-    propagateRawData(rawDataPtr.release());
+  /* backfill_rate limits the rotated files only, the live files are not delayed.
+   * a cut file is tailed again in the next second, see InotifyCtx::requeue
+   */
+  if (backfill_ && size_ > off) {
+    off_t quota = ctx_->cnf()->backfillQuota(size_ - off);
+    if (off + quota < size_) {
+      size_ = off + quota;
+      eof_ = false;
+      backlog_ = throttled_ = true;
+    }
   }
+  backfillAdvise(off);
+}
+
+void FileReader::markReady()
+{
+  util::atomic_cas(&readyTime_, (int64_t) 0, ctx_->cnf()->fasttime(TIMEUNIT_MILLI));
+}
+
+/* the time from markReady to the tail */
+void FileReader::served()
+{
+  int64_t ready = util::atomic_set(&readyTime_, 0);
+  if (ready == 0) return;
+
+  int64_t wait = ctx_->cnf()->fasttime(TIMEUNIT_MILLI) - ready;
+  if (wait < 0) wait = 0;
 
-  if (pos == NIL && eof_)  return tryReinit();
-  else return eof_;
+  util::atomic_inc(&waitRounds_);
+  util::atomic_inc(&waitTotal_, (int) wait);
+  if (wait > waitMax_) waitMax_ = wait;
 }
 
-void FileReader::propagateTailContent(size_t size)
+bool FileReader::waitStats(int64_t *rounds, int64_t *total, int64_t *max)
+{
+  *rounds = util::atomic_set(&waitRounds_, 0);
+  *total  = util::atomic_set(&waitTotal_, 0);
+  *max    = util::atomic_set(&waitMax_, 0);
+  return *rounds > 0;
+}
+
+/* read ahead of the cursor and drop what was consumed from the page cache */
+void FileReader::backfillAdvise(off_t off)
+{
+  if (!backfill_) return;
+
+  if (off + BACKFILL_READAHEAD / 2 > raoff_) {
+    raoff_ = std::max(raoff_, off);
+    readahead(fd_, raoff_, BACKFILL_READAHEAD);
+    raoff_ += BACKFILL_READAHEAD;
+  }
+
+  if (off - dropoff_ >= BACKFILL_READAHEAD) {
+    posix_fadvise(fd_, dropoff_, off - dropoff_, POSIX_FADV_DONTNEED);
+    dropoff_ = off;
+  }
+}
+
+/* return false if flow control stops the tail */
+bool FileReader::consumeRead(size_t nn, off_t *off, off_t *loff)
+{
+  *off += nn;
+  npos_ += nn;
+
+  propagateProcessLines(inode_, loff);
+  backfillAdvise(*off);
+
+  if (ctx_->cnf()->flowControlOn()) {
+    size_ = *off;
+    eof_ = false;
+    return false;
+  }
+  return true;
+}
+
+/* tail2kafka() split in three for io_uring, prepareTail() does the stat,
+ * the caller reads into readBuffer() at the current position and hands
+ * the result to completeTail(), until completeTail() returns false
+ */
+bool FileReader::prepareTail()
 {
   assert(parent_ == 0);
+  if (suspended_ && !resume()) return false;
+  if (fd_ == -1 && (deleted_ || !tryReinit())) return false;
+  if (ctx_->cnf()->flowControlOn()) return false;
 
-  LuaCtx *ctx = ctx_->next();
-  while (ctx) {
-    FileReader *f = ctx->getFileReader();
-    memcpy(f->buffer_ + f->npos_, buffer_ + npos_, size);
-    f->npos_ += size;
+  if (ctx_->mmapTail()) {
+    tail2kafka();
+    return false;
+  }
 
-    ctx = ctx->next();
+  struct stat st;
+  if (fstat(fd_, &st) != 0) {
+    log_fatal(errno, "%d %s fstat error", fd_, ctx_->file().c_str());
+    return false;
+  }
+
+  off_t off = lseek(fd_, 0, SEEK_CUR);
+  if (off == (off_t) -1) {
+    log_fatal(errno, "%d %s lseek error", fd_, ctx_->file().c_str());
+    return false;
+  }
+
+  // file was truncated
+  if (off > st.st_size) return false;
+
+  bool fileStart = (size_ == 0);
+  served();
+  limitTail(off, st.st_size, true);
+  if (size_ > 0 && fileStart) propagateRawData(buildFileStartRecord(time(0)));
+
+  if (off >= size_) {
+    if (eof_) {
+      tryReinit();
+      idle();
+    }
+    return false;
   }
 
-  npos_ += size;
+  roff_ = off;
+  rloff_ = off - npos_;
+  assert(rloff_ >= 0);
+  return true;
+}
+
+char *FileReader::readBuffer(size_t *len)
+{
+  *len = std::min(size_ - roff_, (off_t) (MAX_LINE_LEN - npos_));
+  assert(*len > 0);
+  return writableChunk() + npos_;
+}
+
+/* nn is the read result or -errno, return true if there is more to read */
+bool FileReader::completeTail(ssize_t nn)
+{
+  if (nn < 0) {
+    log_fatal((int) -nn, "%d %s read error", fd_, ctx_->datafile().c_str());
+    return false;
+  }
+
+  // nn == 0, file was truncated
+  if (nn > 0 && consumeRead(nn, &roff_, &rloff_) && roff_ < size_) return true;
+
+  if (eof_) {
+    tryReinit();
+    idle();
+  }
+  return false;
+}
+
+/* the drr deficit and the backfill quota were charged by prepareTail(),
+ * so the prepared range is read as it is, no new stat
+ */
+void FileReader::finishTail()
+{
+  ssize_t nn;
+  do {
+    size_t len;
+    char *buf = readBuffer(&len);
+    while ((nn = read(fd_, buf, len)) == -1 && errno == EINTR);
+    if (nn == -1) nn = -errno;
+  } while (completeTail(nn));
+}
+
+void FileReader::suspend()
+{
+  assert(parent_ == 0);
+  suspendPending_ = true;
+  if (fd_ == -1 || suspended_) return;
+
+  struct stat st;
+  if (fstat(fd_, &st) == 0 && st.st_size == size_ && lseek(fd_, 0, SEEK_CUR) == size_) {
+    eof_ = true;
+    idle();
+  }
+}
+
+void FileReader::retire()
+{
+  assert(parent_ == 0);
+  deleted_ = true;
+
+  if (fd_ == -1) {
+    if (chunk_) chunk_->release();
+    chunk_ = 0;
+    suspended_ = false;
+    util::atomic_set(&retired_, 1);
+  } else {
+    tail2kafka();
+  }
 }
 
+/* back to a new reader, for a retired glob file reused for an other name */
+void FileReader::reset()
+{
+  assert(fd_ == -1 && chunk_ == 0);
+
+  flags_ = 0;
+  size_ = dsize_ = 0;
+  line_ = dline_ = 0;
+  inode_ = 0;
+  npos_ = 0;
+
+  eof_ = false;
+  backfill_ = false;
+  raoff_ = dropoff_ = 0;
+  deficit_ = 0;
+  backlog_ = throttled_ = false;
+
+  suspended_ = suspendPending_ = deleted_ = false;
+  util::atomic_set(&retired_, 0);
+  setClosedSize(-1);
+}
+
+/* the file is at the end, close it if it is evicted or deleted, the
+ * chunk and the line buffers go with the fd, a closed file costs no memory
+ */
+void FileReader::idle()
+{
+  if (!suspendPending_ && !deleted_) return;
+  if (fd_ == -1 || !eof_ || ctx_->backfill()) return;
+  if (npos_ > 0 && !deleted_) return;   // wait for the NL of the last line
+
+  if (npos_ > 0) log_error(0, "%s drop partial last line of %d bytes", ctx_->file().c_str(), (int) npos_);
+
+  close(fd_);
+  fd_ = -1;
+  npos_ = 0;
+  chunk_->release();
+  chunk_ = 0;
+
+  for (LuaCtx *ctx = ctx_; ctx; ctx = ctx->next()) {
+    FileReader *reader = ctx->getFileReader();
+    if (reader->lineEnds_) delete[] reader->lineEnds_;
+    reader->lineEnds_ = 0;
+  }
+
+  suspendPending_ = false;
+  if (deleted_) {
+    log_info(0, "%s retired size=%lu lines=%lu", ctx_->file().c_str(), size_, line_);
+    util::atomic_set(&retired_, 1);
+  } else {
+    suspended_ = true;
+    setClosedSize(size_);
+  }
+}
+
+/* atomic_set takes an int, the tail thread is the only writer */
+void FileReader::setClosedSize(off_t size)
+{
+  int64_t old = util::atomic_get(&closedSize_);
+  util::atomic_cas(&closedSize_, old, (int64_t) size);
+}
+
+/* reopen a suspended file, it goes on from size_ if it is the same inode */
+bool FileReader::resume()
+{
+  assert(parent_ == 0 && suspended_);
+
+  int fd = open(ctx_->datafile().c_str(), O_RDONLY);
+  if (fd == -1) {
+    if (errno != ENOENT) log_fatal(errno, "reopen %s error", ctx_->datafile().c_str());
+    return false;
+  }
+
+  if (!chunk_) chunk_ = ReadChunk::create(MAX_LINE_LEN);
+  suspended_ = false;
+  setClosedSize(-1);
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_ino != inode_) {
+    /* the name was deleted or moved and created again while it was closed */
+    close(fd);
+    log_info(0, "%s was replaced while closed", ctx_->datafile().c_str());
+    return tryReinit();
+  }
+
+  fd_ = fd;
+  lseek(fd_, size_, SEEK_SET);
+  return true;
+}
+
+/* the chained readers all consume up to the last NL, so they share the
+ * chunk of the first reader and its cursor instead of a copy each. the
+ * records may hold the chunk until they are acked, the next read goes to
+ * a new chunk then. the records of a read under MIN_SHARED_READ copy the
+ * lines, a few lines would pin the whole 8M chunk
+ */
 void FileReader::propagateProcessLines(ino_t inode, off_t *off)
 {
   assert(parent_ == 0);
 
+  ReadChunk *chunk = npos_ >= MIN_SHARED_READ ? chunk_ : 0;
+  size_t n = propagateProcessLines(inode, off, chunk_->data(), npos_, chunk);
+  if (n == 0 && npos_ == MAX_LINE_LEN) {
+    log_error(0, "%s line length exceed, truncate", ctx_->file().c_str());
+    n = npos_;
+  }
+  shiftChunk(n);
+}
+
+/* the chunk is written only when no one else holds it */
+char *FileReader::writableChunk()
+{
+  if (chunk_->shared()) {
+    ReadChunk *chunk = ReadChunk::create(MAX_LINE_LEN);
+    memcpy(chunk->data(), chunk_->data(), npos_);
+    chunk_->release();
+    chunk_ = chunk;
+  }
+  return chunk_->data();
+}
+
+/* drop the n bytes consumed, the partial line left is moved to the front */
+void FileReader::shiftChunk(size_t n)
+{
+  assert(n <= npos_);
+  if (n == 0) return;
+
+  npos_ -= n;
+  if (npos_ == 0) return;
+
+  if (chunk_->shared()) {
+    ReadChunk *chunk = ReadChunk::create(MAX_LINE_LEN);
+    memcpy(chunk->data(), chunk_->data() + n, npos_);
+    chunk_->release();
+    chunk_ = chunk;
+  } else {
+    memmove(chunk_->data(), chunk_->data() + n, npos_);
+  }
+}
+
+size_t FileReader::propagateProcessLines(ino_t inode, off_t *off, const char *data, size_t size, ReadChunk *chunk)
+{
+  assert(parent_ == 0);
+
+  size_t n = 0;
   LuaCtx *ctx = ctx_;
   while (ctx) {
-    ctx->getFileReader()->processLines(inode, off);
+    size_t nn = ctx->getFileReader()->processLines(inode, off, data, size, chunk);
+    if (ctx == ctx_) n = nn;
     ctx = ctx->next();
     off = 0;   // only first topic have off
   }
+  return n;
+}
+
+/* a truncate while the tail is mapped makes the pages past the new end
+ * raise SIGBUS. the handler maps zero pages over the rest of the mapping,
+ * zeros have no NL so no line is taken from them, and the scan stops
+ */
+static __thread const char *mmapStart = 0;
+static __thread const char *mmapEnd = 0;
+static __thread bool mmapFault = false;
+
+static uintptr_t pagesize = 0;
+static pthread_once_t sigbusOnce = PTHREAD_ONCE_INIT;
+static bool sigbusInstalled = false;
+
+static void sigbusHandler(int, siginfo_t *info, void *)
+{
+  const char *addr = (const char *) info->si_addr;
+  if (addr >= mmapStart && addr < mmapEnd) {
+    char *page = (char *) ((uintptr_t) addr & ~(pagesize - 1));
+    if (mmap(page, mmapEnd - page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+      mmapFault = true;
+      return;
+    }
+  }
+  /* not a mapped tail, the fault repeats with the default action */
+  signal(SIGBUS, SIG_DFL);
+}
+
+static void installSigbus()
+{
+  pagesize = sysconf(_SC_PAGESIZE);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = sigbusHandler;
+  sa.sa_flags = SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGBUS, &sa, NULL) == -1) log_fatal(errno, "sigaction SIGBUS error");
+  else sigbusInstalled = true;
+}
+
+/* map [off, size_) and scan the lines in place, no read() and no memmove.
+ * the file position is left at the first byte not consumed, so a partial
+ * last line is mapped again on the next call. if the file is truncated
+ * during the scan, off is set to the first byte not consumed and the
+ * caller reads the rest with read(), which sees the truncate
+ */
+bool FileReader::tailMmap(off_t *offPtr)
+{
+  assert(parent_ == 0 && npos_ == 0);
+
+  off_t off = *offPtr;
+  if (off >= size_) return true;
+
+  pthread_once(&sigbusOnce, installSigbus);
+  if (!sigbusInstalled) return true;   // read() instead
+
+  off_t start = off - off % (off_t) pagesize;
+  size_t length = size_ - start;
+
+  void *addr = mmap(0, length, PROT_READ, MAP_SHARED, fd_, start);
+  if (addr == MAP_FAILED) {
+    log_fatal(errno, "%d %s mmap error, off %ld, size %ld", fd_, ctx_->datafile().c_str(),
+              (long) off, (long) size_);
+    return false;
+  }
+  madvise(addr, length, MADV_SEQUENTIAL);
+  ReadChunk *chunk = ReadChunk::createMmap(addr, length);
+
+  mmapStart = (const char *) addr;
+  mmapEnd = mmapStart + length;
+  mmapFault = false;
+
+  const char *base = chunk->data() - start;
+  off_t loff = off;
+  bool block = false;
+
+  while (loff < size_) {
+    size_t min = std::min(size_ - loff, (off_t) MAX_LINE_LEN);
+    off_t end = loff + min;
+    /* the records copy the lines, the mapping is not held after the scan */
+    size_t n = propagateProcessLines(inode_, &loff, base + loff, min, 0);
+    if (mmapFault) break;
+
+    if (n == 0 && min == MAX_LINE_LEN) {
+      log_error(0, "%s line length exceed, truncate", ctx_->file().c_str());
+      loff = end;
+    } else if (n < min && end == size_) {
+      break;  // partial last line, wait for NL
+    }
+
+    if (ctx_->cnf()->flowControlOn()) {
+      block = true;
+      break;
+    }
+  }
+
+  mmapStart = mmapEnd = 0;
+  chunk->unref();
+
+  if (lseek(fd_, loff, SEEK_SET) == (off_t) -1) {
+    log_fatal(errno, "%d %s lseek error", fd_, ctx_->datafile().c_str());
+    return false;
+  }
+
+  if (mmapFault) {
+    log_error(0, "%s was truncated while mapped, read from %ld", ctx_->file().c_str(), (long) loff);
+    *offPtr = loff;
+    return true;
+  }
+
+  if (block) {
+    size_ = loff;
+    eof_ = false;
+  }
+
+  *offPtr = size_;
+  return true;
 }
 
 std::string *FileReader::buildFileStartRecord(time_t now)
@@ -462,9 +1011,13 @@ void FileReader::propagateRawData(const std::string *data)
 
   LuaCtx *ctx = ctx_;
   while (ctx) {
-    if (ctx->withhost()) {
-      std::string *raw = new std::string(*data);
-      std::vector<FileRecord *> *records = new std::vector<FileRecord *>(1, FileRecord::create(-1, -1, raw));
+    /* the files of a glob pattern share one topic, their START/END would mix */
+    if (ctx->withhost() && !ctx->globFile()) {
+      FileRecord *record = FileRecord::create(-1, -1);
+      record->payload()->assign(*data);
+
+      std::vector<FileRecord *> *records = FileRecord::createVector();
+      records->push_back(record);
       ctx->getFileReader()->sendLines(-1, records);
     }
     ctx = ctx->next();
@@ -472,48 +1025,59 @@ void FileReader::propagateRawData(const std::string *data)
   delete data;
 }
 
-void FileReader::processLines(ino_t inode, off_t *offPtr)
+/* return the bytes consumed, the partial last line is left to the caller */
+size_t FileReader::processLines(ino_t inode, off_t *offPtr, const char *data, size_t size, ReadChunk *chunk)
 {
   size_t n = 0;
-  char *pos;
+  const char *pos;
+
+  if (!lineEnds_) lineEnds_ = new uint32_t[MAX_LINE_BATCH];
 
-  std::vector<FileRecord *> *records = new std::vector<FileRecord *>;
+  std::vector<FileRecord *> *records = FileRecord::createVector();
   if (ctx_->copyRawRequired()) {
-    if ((pos = (char *) memrchr(buffer_, NL, npos_))) {
-      int np = processLine(offPtr ? *offPtr : -1, buffer_, pos - buffer_, records);
+    if ((pos = (const char *) memrchr(data, NL, size))) {
+      int np = processLine(offPtr ? *offPtr : -1, data, pos - data, records, chunk);
 
-      if (offPtr) *offPtr += pos - buffer_ + 1;
+      if (offPtr) *offPtr += pos - data + 1;
 
       if (np > 0) line_++;
-      if (parent_ == 0 && ctx_->md5sum() && pos != buffer_) MD5_Update(&md5Ctx_, buffer_, pos - buffer_ + 1);
-      n = (pos+1) - buffer_;
+      if (parent_ == 0 && ctx_->md5sum() && pos != data) MD5_Update(&md5Ctx_, data, pos - data + 1);
+      n = (pos+1) - data;
     }
   } else {
-    while ((pos = (char *) memchr(buffer_ + n, NL, npos_ - n))) {
-      int np = processLine(offPtr ? *offPtr : -1, buffer_ + n, pos - (buffer_ + n), records);
+    while (n < size) {
+      size_t scanned;
+      size_t nend = util::scanLines(data + n, size - n, lineEnds_, MAX_LINE_BATCH, &scanned);
+      if (nend == 0) break;
 
-      if (offPtr) *offPtr += pos - (buffer_ + n) + 1;
+      size_t len = lineEnds_[nend-1] + 1;
+      line_ += ctx_->function()->process(offPtr ? *offPtr : -1, data + n, lineEnds_, nend, records, chunk);
 
-      if (np > 0) line_++;
-      if (parent_ == 0 && ctx_->md5sum() && pos != buffer_ + n) MD5_Update(&md5Ctx_, buffer_ + n, pos - (buffer_ + n) + 1);
-      n = (pos+1) - buffer_;
-      if (n == npos_) break;
+      if (offPtr) *offPtr += len;
+      if (parent_ == 0 && ctx_->md5sum()) md5Lines(data + n, nend);
+      n += len;
+
+      /* the rest is the partial last line */
+      if (nend < MAX_LINE_BATCH) break;
     }
   }
 
   sendLines(inode, records);
+  return n;
+}
 
-  if (n == 0) {
-    if (npos_ == MAX_LINE_LEN) {
-      log_error(0, "%s line length exceed, truncate", ctx_->file().c_str());
-      npos_ = 0;
+/* empty lines are not part of md5, update the runs between them at once */
+void FileReader::md5Lines(const char *data, size_t nend)
+{
+  size_t start = 0, run = 0;
+  for (size_t i = 0; i < nend; ++i) {
+    if (lineEnds_[i] == start) {
+      if (start > run) MD5_Update(&md5Ctx_, data + run, start - run);
+      run = start + 1;
     }
-  } else if (npos_ > n) {
-    npos_ -= n;
-    memmove(buffer_, buffer_ + n, npos_);
-  } else {
-    npos_ = 0;
+    start = lineEnds_[i] + 1;
   }
+  if (start > run) MD5_Update(&md5Ctx_, data + run, start - run);
 }
 
 #define TR_NOTPRINT(line, nline) do {     \
@@ -523,7 +1087,8 @@ void FileReader::processLines(ino_t inode, off_t *offPtr)
 } while (0)
 
 /* line without NL */
-int FileReader::processLine(off_t off, char *line, size_t nline, std::vector<FileRecord *> *records)
+int FileReader::processLine(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records,
+                            ReadChunk *chunk)
 {
   /* ignore empty line */
   if (nline == 0) return 0;
@@ -533,7 +1098,7 @@ int FileReader::processLine(off_t off, char *line, size_t nline, std::vector<Fil
     n = ctx_->function()->serializeCache(records);
   } else {
     ctx_->cnf()->stats()->logReadInc();
-    n = ctx_->function()->process(off, line, nline, records);
+    n = ctx_->function()->process(off, line, nline, records, chunk);
   }
   return n;
 }
@@ -544,7 +1109,7 @@ bool FileReader::checkCache()
 
   LuaCtx *ctx = ctx_;
   while (ctx) {
-    std::vector<FileRecord *> *records = new std::vector<FileRecord *>;
+    std::vector<FileRecord *> *records = FileRecord::createVector();
     ctx->getFileReader()->processLine(-1, 0, -1, records);
     ctx->getFileReader()->sendLines(-1, records);
 
@@ -553,37 +1118,119 @@ bool FileReader::checkCache()
   return true;
 }
 
+/* the lines with offsets are packed into one message up to packlines
+ * lines or packsize bytes, the pack is acked and checkpointed as a whole
+ *   &host@<inode>@<offset of the first line> {<offset delta> <len> <line>}...
+ * deltas and lens are varints, a pack never spans two reads. the packs
+ * are built first, the ack window is locked only to issue them
+ */
+void FileReader::packLines(ino_t inode, std::vector<FileRecord *> *records)
+{
+  size_t packLines = ctx_->packlines();
+  size_t packSize = ctx_->packsize();
+
+  /* size and lines of each pack, in the order of records */
+  std::vector<std::pair<size_t, size_t> > packs;
+
+  FileRecord *pack = 0;
+  size_t lines = 0, size = 0, w = 0;
+  off_t last = 0;
+
+  for (size_t i = 0; i <= records->size(); ++i) {
+    FileRecord *record = i < records->size() ? (*records)[i] : 0;
+
+    if (pack && (!record || record->off == (off_t) -1 || lines == packLines || pack->data->size() >= packSize)) {
+      pack->off = last;
+      packs.push_back(std::make_pair(size, lines));
+      (*records)[w++] = pack;
+      pack = 0;
+    }
+    if (!record) break;
+
+    if (record->off == (off_t) -1) {
+      (*records)[w++] = record;
+      continue;
+    }
+
+    if (!pack) {
+      pack = FileRecord::create(inode, record->off);
+      pack->ctx = ctx_;
+      std::string *ptr = pack->payload();
+      ptr->append(1, '&').append(ctx_->cnf()->host()).append(1, '@').append(util::toStr(inode));
+      ptr->append(1, '@').append(util::toStr(record->off, PADDING_LEN)).append(1, ' ');
+
+      lines = size = 0;
+      last = record->off;
+    }
+
+    std::string *ptr = pack->payload();
+    util::appendVarint(ptr, record->off - last);
+    util::appendVarint(ptr, record->len());
+    ptr->append(record->ptr(), record->len());
+
+    last = record->off;
+    size += record->len();
+    ++lines;
+    FileRecord::destroy(record);
+  }
+  records->resize(w);
+
+  std::vector<std::pair<size_t, size_t> >::iterator pos = packs.begin();
+  pthread_mutex_lock(&ackMutex_);
+  for (std::vector<FileRecord *>::iterator ite = records->begin(); ite != records->end(); ++ite) {
+    if ((*ite)->off == (off_t) -1) continue;
+    (*ite)->seq = acks_.issue(inode, (*ite)->off, pos->first, pos->second);
+    ++pos;
+  }
+  pthread_mutex_unlock(&ackMutex_);
+}
+
 bool FileReader::sendLines(ino_t inode, std::vector<FileRecord *> *records)
 {
   if (records->empty()) {
-    delete records;
+    FileRecord::destroyVector(records);
     return true;
   } else {
+    int64_t now = ctx_->cnf()->fasttime(TIMEUNIT_MILLI);
     for (std::vector<FileRecord *>::iterator ite = records->begin(); ite != records->end(); ++ite) {
       (*ite)->inode = inode;
+      (*ite)->time  = now;
+    }
+
+    /* only the first reader of a file has offsets, in the order they are read */
+    if (parent_ == 0 && inode != (ino_t) -1 && ctx_->packlines() > 0) {
+      packLines(inode, records);
+    } else if (parent_ == 0 && inode != (ino_t) -1) {
+      size_t extra = ctx_->function()->extraSize();
+      pthread_mutex_lock(&ackMutex_);
+      for (std::vector<FileRecord *>::iterator ite = records->begin(); ite != records->end(); ++ite) {
+        if ((*ite)->off == (off_t) -1) continue;
+        (*ite)->seq = acks_.issue(inode, (*ite)->off, (*ite)->len() - extra);
+      }
+      pthread_mutex_unlock(&ackMutex_);
     }
 
     for (std::vector<FileRecord *>::iterator ite = records->begin(); ite != records->end(); ++ite) {
       (*ite)->ctx = ctx_;
-      log_debug(0, "%.*s", (int) (*ite)->data->size(), (*ite)->data->c_str());
+      log_debug(0, "%.*s", (int) (*ite)->len(), (*ite)->ptr());
     }
 
     size_t size = records->size();
 
-    uintptr_t ptr = (uintptr_t) records;
-    ssize_t nn = write(ctx_->cnf()->server, &ptr, sizeof(ptr));
-    if (nn == -1) {
-      if (errno != EINTR) {
-        log_fatal(errno, "write onetaskrequest error");
-        delete records;
-        return false;
-      }
-    }
-
     ctx_->cnf()->stats()->logWriteInc(size);
     ctx_->cnf()->stats()->queueSizeInc(size);
-
-    assert(nn != -1 && nn == sizeof(uintptr_t));
+    util::atomic_inc(&pending_, size);
+
+    if (!ctx_->cnf()->queue(ctx_->shard())->push(records)) {
+      log_fatal(errno, "push records to queue error");
+      ctx_->cnf()->stats()->queueSizeDec(size);
+      for (std::vector<FileRecord *>::iterator ite = records->begin(); ite != records->end(); ++ite) {
+        dropFileRecord(*ite);
+        FileRecord::destroy(*ite);
+      }
+      FileRecord::destroyVector(records);
+      return false;
+    }
     return true;
   }
 }
@@ -4,11 +4,14 @@
 #include <string>
 #include <vector>
 #include <stdint.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <openssl/md5.h>
 
+#include "gnuatomic.h"
 #include "filerecord.h"
 class LuaCtx;
+class ReadChunk;
 class FileOffRecord;
 
 enum FileInotifyStatus {
@@ -43,15 +46,61 @@ public:
   bool tail2kafka(StartPosition pos = NIL, const struct stat *stPtr = 0, std::string *rawData = 0);
   bool checkCache();
 
+  int fd() const { return fd_; }
+
+  /* the file has data and waits in a tail queue */
+  void markReady();
+  /* the last tail spent the deficit before the end of file */
+  bool backlog() const { return backlog_; }
+  /* the last tail was cut by backfill_rate, the rest waits for the next second */
+  bool throttled() const { return throttled_; }
+  /* rounds, total and max wait in milliseconds since the last call */
+  bool waitStats(int64_t *rounds, int64_t *total, int64_t *max);
+
+  /* the files of a glob pattern, close when idle and reopen on the next tail */
+  void suspend();
+  /* the file was deleted or moved away, close it at the end for good */
+  void retire();
+  void reset();
+  bool retired() const { return util::atomic_get((int *) &retired_); }
+  /* records sent and not acked yet */
+  int pending() const { return util::atomic_get((int *) &pending_); }
+  /* the size when the file was closed, -1 while it is open */
+  off_t closedSize() const { return util::atomic_get((int64_t *) &closedSize_); }
+
+  bool prepareTail();
+  char *readBuffer(size_t *len);
+  bool completeTail(ssize_t nn);
+  /* read the rest of a prepared tail with read(), see UringTail */
+  void finishTail();
+
   void initFileOffRecord(FileOffRecord * fileOffRecord);
   void updateFileOffRecord(const FileRecord *record);
+  /* a record which will never be acked, the offset may pass it */
+  void dropFileRecord(const FileRecord *record);
 
 private:
-  void propagateTailContent(size_t size);
   void propagateProcessLines(ino_t inode, off_t *off);
-  void processLines(ino_t inode, off_t *off);
-  int processLine(off_t off, char *line, size_t nline, std::vector<FileRecord *> *records);
+  size_t propagateProcessLines(ino_t inode, off_t *off, const char *data, size_t size, ReadChunk *chunk);
+  bool tailMmap(off_t *off);
+  void limitTail(off_t off, off_t fileSize, bool drr);
+  void served();
+  void backfillAdvise(off_t off);
+  bool consumeRead(size_t nn, off_t *off, off_t *loff);
+  bool resume();
+  void idle();
+  void setClosedSize(off_t size);
+
+  char *writableChunk();
+  void shiftChunk(size_t n);
+
+  size_t processLines(ino_t inode, off_t *off, const char *data, size_t size, ReadChunk *chunk);
+  void md5Lines(const char *data, size_t nend);
+  int processLine(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records,
+                  ReadChunk *chunk = 0);
   bool sendLines(ino_t inode, std::vector<FileRecord *> *records);
+  void packLines(ino_t inode, std::vector<FileRecord *> *records);
+  void ackFileRecord(const FileRecord *record);
 
   bool openFile(struct stat *st, char *errbuf = 0);
   bool setStartPosition(off_t fileSize, char *errbuf);
@@ -68,7 +117,32 @@ private:
   uint32_t flags_;
   bool eof_;
 
-  FileOffRecord *fileOffRecord_;
+  off_t roff_;   // read and line offset between prepareTail and completeTail
+  off_t rloff_;
+
+  bool   backfill_;      // datafile is a rotated file
+  off_t  raoff_;         // readahead was issued up to
+  off_t  dropoff_;       // page cache was dropped up to
+  time_t backfillTime_;
+
+  off_t   deficit_;       // bytes the file may still read in this round
+  bool    backlog_;
+  bool    throttled_;
+  int64_t readyTime_;     // ms, set by the dispatcher, cleared by the tail
+  int64_t waitRounds_;
+  int64_t waitTotal_;
+  int64_t waitMax_;
+
+  bool suspended_;       // closed, size_ and inode_ are kept
+  bool suspendPending_;  // close at the next end of file
+  bool deleted_;
+  int  retired_;
+  int  pending_;
+  int64_t closedSize_;   // read by the inotify thread, see InotifyCtx::rescan
+
+  FileOffRecord  *fileOffRecord_;
+  pthread_mutex_t ackMutex_;
+  AckWindow       acks_;
 
   size_t line_;
   size_t dline_;  // send line
@@ -79,8 +153,9 @@ private:
 
   FileReader *parent_;
 
-  char         *buffer_;
+  ReadChunk    *chunk_;   // only the first reader of a file has the chunk
   size_t        npos_;
+  uint32_t     *lineEnds_;
   LuaCtx       *ctx_;
 };
 
@@ -0,0 +1,162 @@
+#include <pthread.h>
+
+#include "gnuatomic.h"
+#include "readchunk.h"
+#include "filerecord.h"
+
+#define RECORD_SLAB_SIZE      256
+#define RECORD_BATCH_SIZE     256
+#define RECORD_CACHE_SIZE     4 * RECORD_BATCH_SIZE   // per thread
+#define MAX_RECORD_CAPACITY   64 * 1024
+#define MAX_VECTOR_CAPACITY   16 * 1024
+#define MAX_FREE_VECTORS      256
+
+struct RecordCache {
+  FileRecord *head;
+  size_t      size;
+};
+
+static __thread RecordCache recordCache = {0, 0};
+
+static pthread_mutex_t recordMutex = PTHREAD_MUTEX_INITIALIZER;
+static FileRecord     *recordFree  = 0;
+
+static pthread_mutex_t vectorMutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<std::vector<FileRecord *> *> vectorFree;
+
+static int64_t recordSlabs    = 0;
+static int64_t recordLive     = 0;
+static int64_t recordRecycled = 0;
+
+FileRecord *FileRecord::create(ino_t inode_, off_t off_)
+{
+  RecordCache *cache = &recordCache;
+
+  if (!cache->head) {
+    pthread_mutex_lock(&recordMutex);
+    while (recordFree && cache->size < RECORD_BATCH_SIZE) {
+      FileRecord *record = recordFree;
+      recordFree = record->nextFree_;
+      record->nextFree_ = cache->head;
+      cache->head = record;
+      ++cache->size;
+    }
+    pthread_mutex_unlock(&recordMutex);
+  }
+
+  if (!cache->head) {
+    FileRecord *slab = new FileRecord[RECORD_SLAB_SIZE];
+    for (int i = 0; i < RECORD_SLAB_SIZE; ++i) {
+      slab[i].nextFree_ = cache->head;
+      cache->head = slab + i;
+    }
+    cache->size += RECORD_SLAB_SIZE;
+    util::atomic_inc(&recordSlabs);
+  }
+
+  FileRecord *record = cache->head;
+  cache->head = record->nextFree_;
+  --cache->size;
+
+  record->ctx     = 0;
+  record->inode   = inode_;
+  record->off     = off_;
+  record->seq     = 0;
+  record->time    = 0;
+  record->handoff = 0;
+  record->esIndex = 0;
+  record->data    = &record->payload_;
+  record->key     = 0;
+  record->keyHash = 0;
+  record->chunk_  = 0;
+
+  util::atomic_inc(&recordLive);
+  return record;
+}
+
+void FileRecord::reference(ReadChunk *chunk, const char *ptr, size_t len)
+{
+  assert(chunk_ == 0 && payload_.empty());
+  chunk_  = chunk->ref();
+  ref_    = ptr;
+  refLen_ = len;
+}
+
+void FileRecord::destroy(FileRecord *record)
+{
+  /* keep the capacity of normal lines, give back the huge ones */
+  if (record->payload_.capacity() > MAX_RECORD_CAPACITY) std::string().swap(record->payload_);
+  else record->payload_.clear();
+
+  if (record->index_.capacity() > MAX_RECORD_CAPACITY) std::string().swap(record->index_);
+  else record->index_.clear();
+  record->key_.clear();
+  if (record->chunk_) {
+    record->chunk_->unref();
+    record->chunk_ = 0;
+  }
+
+  record->esIndex = 0;
+  record->data    = 0;
+  record->key     = 0;
+
+  RecordCache *cache = &recordCache;
+  record->nextFree_ = cache->head;
+  cache->head = record;
+  ++cache->size;
+
+  util::atomic_dec(&recordLive);
+  util::atomic_inc(&recordRecycled);
+
+  if (cache->size < RECORD_CACHE_SIZE) return;
+
+  /* hand a batch to the threads which allocate */
+  FileRecord *head = cache->head, *tail = head;
+  for (int i = 1; i < RECORD_BATCH_SIZE; ++i) tail = tail->nextFree_;
+  cache->head = tail->nextFree_;
+  cache->size -= RECORD_BATCH_SIZE;
+
+  pthread_mutex_lock(&recordMutex);
+  tail->nextFree_ = recordFree;
+  recordFree = head;
+  pthread_mutex_unlock(&recordMutex);
+}
+
+std::vector<FileRecord *> *FileRecord::createVector()
+{
+  std::vector<FileRecord *> *records = 0;
+
+  pthread_mutex_lock(&vectorMutex);
+  if (!vectorFree.empty()) {
+    records = vectorFree.back();
+    vectorFree.pop_back();
+  }
+  pthread_mutex_unlock(&vectorMutex);
+
+  return records ? records : new std::vector<FileRecord *>;
+}
+
+void FileRecord::destroyVector(std::vector<FileRecord *> *records)
+{
+  if (records->capacity() > MAX_VECTOR_CAPACITY) {
+    delete records;
+    return;
+  }
+  records->clear();
+
+  pthread_mutex_lock(&vectorMutex);
+  if (vectorFree.size() < MAX_FREE_VECTORS) {
+    vectorFree.push_back(records);
+    records = 0;
+  }
+  pthread_mutex_unlock(&vectorMutex);
+
+  if (records) delete records;
+}
+
+void FileRecord::stats(FileRecordStats *stats)
+{
+  stats->slabs    = util::atomic_get(&recordSlabs);
+  stats->live     = util::atomic_get(&recordLive);
+  stats->recycled = util::atomic_get(&recordRecycled);
+}
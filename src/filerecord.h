@@ -2,39 +2,134 @@
 #define _FILE_RECORD_H_
 
 #include <string>
+#include <vector>
+#include <deque>
+#include <cassert>
+#include <stdint.h>
 #include <sys/types.h>
 
 class LuaCtx;
+class ReadChunk;
 
+struct FileRecordStats {
+  int64_t slabs;      // slabs allocated, never freed
+  int64_t live;       // records in use
+  int64_t recycled;   // records returned to the pool
+};
+
+/* records and their payloads are recycled, not freed, the pool keeps a
+ * per thread cache and moves records between threads in batches
+ */
 struct FileRecord {
   LuaCtx        *ctx;
   ino_t          inode;
   off_t          off;
+  uint64_t       seq;     // of the AckWindow of the file, only if off is set
+  int64_t        time;    // ms when it was read, see kafkaheaders
+  int64_t        handoff; // ms when it was given to librdkafka, see dr_msg_cb
 
   const std::string   *esIndex;
   const std::string   *data;
+  const std::string   *key;       // kafka message key, 0 without keyidx
+  uint32_t             keyHash;
+
+  /* fill payload() and index(), the capacity of a recycled record is reused */
+  static FileRecord *create(ino_t inode_, off_t off_);
 
+  /* take the ownership of data_ and esIndex_ */
   static FileRecord *create(ino_t inode_, off_t off_, const std::string *data_) {
     return create(inode_, off_, 0, data_);
   }
 
   static FileRecord *create(ino_t inode_, off_t off_, const std::string *esIndex_,
                             const std::string *data_) {
-    FileRecord *record = new FileRecord;
-    record->inode = inode_;
-    record->off   = off_;
-
-    record->esIndex = esIndex_;
-    record->data    = data_;
+    FileRecord *record = create(inode_, off_);
+    if (esIndex_) {
+      record->index()->assign(*esIndex_);
+      delete esIndex_;
+    }
+    record->payload()->assign(*data_);
+    delete data_;
     return record;
   }
 
-  static void destroy(FileRecord *record) {
-    if (record->esIndex) delete record->esIndex;
+  static void destroy(FileRecord *record);
+
+  std::string *payload() { return &payload_; }
+  std::string *index() {
+    esIndex = &index_;
+    return &index_;
+  }
+  std::string *keyBuffer() {
+    key = &key_;
+    return &key_;
+  }
+
+  /* the payload is [ptr, ptr+len) of the read chunk, which is held until
+   * the record is destroyed, nothing is copied after the read
+   */
+  void reference(ReadChunk *chunk, const char *ptr, size_t len);
+
+  /* the bytes to send, the chunk or data */
+  const char *ptr() const { return chunk_ ? ref_ : data->data(); }
+  size_t len() const { return chunk_ ? refLen_ : data->size(); }
+
+  static std::vector<FileRecord *> *createVector();
+  static void destroyVector(std::vector<FileRecord *> *records);
+
+  static void stats(FileRecordStats *stats);
+
+private:
+  std::string  payload_;
+  std::string  index_;
+  std::string  key_;
+  ReadChunk   *chunk_;
+  const char  *ref_;
+  size_t       refLen_;
+  FileRecord  *nextFree_;
+};
+
+struct AckSlot {
+  ino_t  inode;
+  off_t  off;
+  size_t size;
+  size_t lines;   // more than one if packed
+  bool   acked;
+};
+
+/* the records of a file are issued in offset order but may be acked in
+ * any order, by several partitions or sinks. the offset is released only
+ * up to the first record which is not acked yet, the caller locks
+ */
+class AckWindow {
+public:
+  AckWindow() : base_(0) {}
+
+  uint64_t issue(ino_t inode, off_t off, size_t size, size_t lines = 1) {
+    AckSlot slot = {inode, off, size, lines, false};
+    slots_.push_back(slot);
+    return base_ + slots_.size() - 1;
+  }
+
+  void ack(uint64_t seq) {
+    assert(seq >= base_ && seq - base_ < slots_.size());
+    slots_[seq - base_].acked = true;
+  }
 
-    delete record->data;
-    delete record;
+  /* pop the lowest slot if it is acked */
+  bool release(AckSlot *slot) {
+    if (slots_.empty() || !slots_.front().acked) return false;
+    *slot = slots_.front();
+    slots_.pop_front();
+    ++base_;
+    return true;
   }
+
+  size_t size() const { return slots_.size(); }
+
+private:
+  uint64_t base_;   // seq of the first slot
+  std::deque<AckSlot> slots_;
 };
 
 #endif
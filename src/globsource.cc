@@ -0,0 +1,177 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <fnmatch.h>
+#include <sys/stat.h>
+
+#include "logger.h"
+#include "sys.h"
+#include "cnfctx.h"
+#include "luactx.h"
+#include "filereader.h"
+#include "globsource.h"
+
+bool GlobSource::isGlob(const std::string &file)
+{
+  size_t slash = file.rfind('/');
+  size_t start = slash == std::string::npos ? 0 : slash + 1;
+  return file.find_first_of("*?[", start) != std::string::npos;
+}
+
+GlobSource *GlobSource::create(CnfCtx *cnf, const std::string &file, char *errbuf)
+{
+  size_t slash = file.rfind('/');
+  if (slash == std::string::npos || slash == 0 || slash + 1 == file.size()) {
+    snprintf(errbuf, MAX_ERR_LEN, "glob file %s requires a directory", file.c_str());
+    return 0;
+  }
+
+  std::string dir = file.substr(0, slash);
+  if (dir.find_first_of("*?[") != std::string::npos) {
+    snprintf(errbuf, MAX_ERR_LEN, "glob file %s, wildcard is allowed in the basename only", file.c_str());
+    return 0;
+  }
+  if (!sys::isdir(dir.c_str(), errbuf)) return 0;
+
+  GlobSource *glob = new GlobSource;
+  glob->cnf_ = cnf;
+  glob->dir_ = dir;
+  glob->pattern_ = file.substr(slash + 1);
+  return glob;
+}
+
+GlobSource::~GlobSource()
+{
+  for (std::vector<LuaCtx *>::iterator ite = files_.begin(); ite != files_.end(); ++ite) {
+    LuaCtx *ctx = *ite;
+    while (ctx) {
+      LuaCtx *next = ctx->next();
+      delete ctx;
+      ctx = next;
+    }
+  }
+}
+
+bool GlobSource::match(const char *name) const
+{
+  return fnmatch(pattern_.c_str(), name, FNM_PERIOD) == 0;
+}
+
+bool GlobSource::init(LuaCtx *ctx, char *errbuf)
+{
+  ctx_ = ctx;
+
+  std::vector<std::string> files;
+  if (!sys::readdir(dir_.c_str(), 0, &files, errbuf)) return false;
+  std::sort(files.begin(), files.end());
+
+  for (std::vector<std::string>::iterator ite = files.begin(); ite != files.end(); ++ite) {
+    std::string name = ite->substr(dir_.size() + 1);
+    if (!match(name.c_str())) continue;
+
+    struct stat st;
+    if (stat(ite->c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+    LuaCtx *file = add(name);
+    if (file && !file->initGlobFile(*ite, false, errbuf)) {
+      log_error(0, "glob add %s error %s", ite->c_str(), errbuf);
+      remove(name);
+    }
+  }
+
+  log_info(0, "glob %s/%s matches %d files", dir_.c_str(), pattern_.c_str(), (int) names_.size());
+  return true;
+}
+
+LuaCtx *GlobSource::find(const std::string &name) const
+{
+  std::map<std::string, LuaCtx *>::const_iterator pos = names_.find(name);
+  return pos != names_.end() ? pos->second : 0;
+}
+
+/* a removed file is reused once its reader is closed and every record
+ * it sent was acked, so the number of files is bounded by globmaxfiles
+ * even if the names change every hour
+ */
+LuaCtx *GlobSource::reuse(const std::string &file)
+{
+  for (std::vector<LuaCtx *>::iterator ite = removed_.begin(); ite != removed_.end(); ++ite) {
+    bool idle = (*ite)->getFileReader()->retired();
+    for (LuaCtx *ctx = *ite; idle && ctx; ctx = ctx->next()) {
+      idle = ctx->getFileReader()->pending() == 0;
+    }
+
+    if (idle) {
+      LuaCtx *ctx = *ite;
+      removed_.erase(ite);
+      log_info(0, "glob reuse %s for %s", ctx->file().c_str(), file.c_str());
+      return ctx;
+    }
+  }
+  return 0;
+}
+
+LuaCtx *GlobSource::add(const std::string &name)
+{
+  assert(find(name) == 0);
+
+  LuaCtx *ctx = reuse(path(name));
+  if (!ctx) {
+    if (!cnf_->addGlobFile()) {
+      log_error(0, "glob %s exceeds globmaxfiles %d, ignore", path(name).c_str(), cnf_->globMaxFiles());
+      return 0;
+    }
+    ctx = ctx_->cloneGlobFile();
+    files_.push_back(ctx);
+  }
+
+  names_.insert(std::make_pair(name, ctx));
+  return ctx;
+}
+
+LuaCtx *GlobSource::remove(const std::string &name)
+{
+  std::map<std::string, LuaCtx *>::iterator pos = names_.find(name);
+  if (pos == names_.end()) return 0;
+
+  LuaCtx *ctx = pos->second;
+  names_.erase(pos);
+  removed_.push_back(ctx);
+  return ctx;
+}
+
+bool GlobSource::rescan(std::vector<std::string> *changed, std::vector<std::string> *gone, char *errbuf)
+{
+  std::vector<std::string> files;
+  if (!sys::readdir(dir_.c_str(), 0, &files, errbuf)) return false;
+  std::sort(files.begin(), files.end());
+
+  std::set<std::string> exist;
+  for (std::vector<std::string>::iterator ite = files.begin(); ite != files.end(); ++ite) {
+    std::string name = ite->substr(dir_.size() + 1);
+    if (!match(name.c_str()) || ignored(name)) continue;
+
+    struct stat st;
+    if (stat(ite->c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+    exist.insert(name);
+
+    LuaCtx *ctx = find(name);
+    if (!ctx) {
+      changed->push_back(name);
+    } else {
+      off_t size = ctx->getFileReader()->closedSize();
+      if (size != -1 && size != st.st_size) changed->push_back(name);
+    }
+  }
+
+  for (std::map<std::string, LuaCtx *>::iterator ite = names_.begin(); ite != names_.end(); ++ite) {
+    if (exist.find(ite->first) == exist.end()) gone->push_back(ite->first);
+  }
+  return true;
+}
+
+void GlobSource::ignore(const std::string &name, bool on)
+{
+  if (on) ignore_.insert(name);
+  else ignore_.erase(name);
+}
@@ -0,0 +1,66 @@
+#ifndef _GLOB_SOURCE_H_
+#define _GLOB_SOURCE_H_
+
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+
+class LuaCtx;
+class CnfCtx;
+
+/* file = "/data/logs/app-*.log", the wildcards are in the basename only.
+ * the directory is watched instead of every file, a file which matches
+ * gets a copy of the LuaCtx chain of the pattern and is opened only when
+ * it has data, InotifyCtx closes the idle ones, see globmaxfds
+ */
+class GlobSource {
+public:
+  static bool isGlob(const std::string &file);
+  static GlobSource *create(CnfCtx *cnf, const std::string &file, char *errbuf);
+  ~GlobSource();
+
+  const std::string &dir() const { return dir_; }
+  bool match(const char *name) const;
+
+  /* add the files which exist now, ctx is the head of the pattern chain */
+  bool init(LuaCtx *ctx, char *errbuf);
+
+  std::string path(const std::string &name) const { return dir_ + "/" + name; }
+  LuaCtx *find(const std::string &name) const;
+  /* the caller inits the file in its tail thread, see LuaCtx::initGlobFile */
+  LuaCtx *add(const std::string &name);
+  /* the file was deleted or moved out of the directory */
+  LuaCtx *remove(const std::string &name);
+
+  /* name is a rotated file of an other file of the pattern, not a new file */
+  void ignore(const std::string &name, bool on);
+  bool ignored(const std::string &name) const { return ignore_.find(name) != ignore_.end(); }
+
+  const std::vector<LuaCtx *> &files() const { return files_; }
+
+  /* after an inotify overflow, the names which are new or grew while
+   * closed, and the names which are gone
+   */
+  bool rescan(std::vector<std::string> *changed, std::vector<std::string> *gone, char *errbuf);
+
+private:
+  GlobSource() : cnf_(0), ctx_(0) {}
+  GlobSource(const GlobSource &);
+  GlobSource &operator=(const GlobSource &);
+
+  LuaCtx *reuse(const std::string &file);
+
+private:
+  CnfCtx      *cnf_;
+  LuaCtx      *ctx_;
+  std::string  dir_;
+  std::string  pattern_;
+
+  std::map<std::string, LuaCtx *> names_;
+  std::vector<LuaCtx *>           files_;    // every file ever added, owned
+  std::vector<LuaCtx *>           removed_;  // reused when no record is in flight
+  std::set<std::string>           ignore_;
+};
+
+#endif
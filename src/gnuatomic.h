@@ -15,6 +15,11 @@ IntegralType atomic_set(IntegralType *ptr, int val) {
   return __sync_lock_test_and_set(ptr, val);
 }
 
+template <class IntegralType>
+bool atomic_cas(IntegralType *ptr, IntegralType oldval, IntegralType newval) {
+  return __sync_bool_compare_and_swap(ptr, oldval, newval);
+}
+
 template <class IntegralType>
 IntegralType atomic_inc(IntegralType *ptr,  int val = 1) {
   return __sync_add_and_fetch(ptr, val);
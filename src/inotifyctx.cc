@@ -4,6 +4,7 @@
 #include <climits>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <errno.h>
 #include <sys/inotify.h>
 #include <sys/ioctl.h>
@@ -16,20 +17,135 @@
 #include "luactx.h"
 #include "filereader.h"
 #include "inotifyctx.h"
+#include "tailworker.h"
 #include "kafkactx.h"
+#include "globsource.h"
+#include "luafunction.h"
 
 #define MAX_ERR_LEN 512
 
 /* watch IN_DELETE_SELF does not work
  * luactx hold fd to the deleted file, the file will never be real deleted
- * so DELETE will be inotified
+ * so DELETE will be inotified, the unlink is seen as IN_ATTRIB of nlink
  */
-static const uint32_t WATCH_EVENT = IN_MODIFY | IN_MOVE_SELF;
+static const uint32_t WATCH_EVENT = IN_MODIFY | IN_MOVE_SELF | IN_ATTRIB;
 static const size_t ONE_EVENT_SIZE = sizeof(struct inotify_event) + NAME_MAX;
 
+/* the files of a glob pattern are not watched one by one, their directory is */
+static const uint32_t GLOB_WATCH_EVENT = IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_MODIFY | IN_DELETE | IN_ONLYDIR;
+static const size_t GLOB_EVENTS = 1024;
+
+/* seconds, an idle file doubles its intervals up to the max, the first
+ * tail after that brings them back
+ */
+static const int CHECK_INTERVAL       = 1;
+static const int MAX_CHECK_INTERVAL   = 32;
+static const int REWATCH_INTERVAL     = 5;
+static const int MAX_REWATCH_INTERVAL = 60;
+static const int REMEDY_INTERVAL      = 60;
+
+InotifyCtx::FileTimer::FileTimer(LuaCtx *luaCtx)
+  : ctx(luaCtx), wd(-1), aggregate(false), activeTime(0),
+    checkInterval(CHECK_INTERVAL), rewatchInterval(REWATCH_INTERVAL),
+    check(CHECK, this), rewatch(REWATCH, this), remedy(REMEDY, this), rollover(ROLLOVER, this),
+    backfill(BACKFILL, this)
+{
+  for (LuaCtx *next = ctx; next; next = next->next()) {
+    if (next->function()->getType() == LuaFunction::AGGREGATE) aggregate = true;
+  }
+}
+
+InotifyCtx::InotifyCtx(CnfCtx *cnf)
+  : cnf_(cnf), wfd_(-1), uringTail_(cnf->ioUring()), wheel_(cnf->fasttime()), blocked_(false)
+{}
+
 InotifyCtx::~InotifyCtx()
 {
+  stopWorkers();
   if (wfd_ > 0) close(wfd_);
+
+  for (std::map<LuaCtx *, FileTimer *>::iterator ite = timers_.begin(); ite != timers_.end(); ++ite) {
+    FileTimer *timer = ite->second;
+    wheel_.remove(&timer->check);
+    wheel_.remove(&timer->rewatch);
+    wheel_.remove(&timer->remedy);
+    wheel_.remove(&timer->rollover);
+    wheel_.remove(&timer->backfill);
+    delete timer;
+  }
+}
+
+bool InotifyCtx::startWorkers(char *errbuf)
+{
+  for (int i = 0; i < cnf_->tailWorkers(); ++i) {
+    TailWorker *worker = new TailWorker(i, cnf_->ioUring());
+    if (!worker->start(errbuf)) {
+      delete worker;
+      stopWorkers();
+      return false;
+    }
+    workers_.push_back(worker);
+  }
+
+  if (!workers_.empty()) log_info(0, "start %d tail threads", (int) workers_.size());
+  return true;
+}
+
+void InotifyCtx::stopWorkers()
+{
+  for (std::vector<TailWorker *>::iterator ite = workers_.begin(); ite != workers_.end(); ++ite) {
+    (*ite)->stop();
+    delete *ite;
+  }
+  workers_.clear();
+}
+
+/* the events of one read, of the coalesce window, and the backlog of
+ * the last round are collected, a file is tailed once for all of them
+ */
+void InotifyCtx::tail(LuaCtx *ctx)
+{
+  if (modifiedSet_.insert(ctx).second) {
+    ctx->getFileReader()->markReady();
+    modified_.push_back(ctx);
+    touchTimers(ctx);
+  }
+}
+
+void InotifyCtx::tailModified()
+{
+  if (modified_.empty()) return;
+
+  if (!workers_.empty()) {
+    for (std::vector<LuaCtx *>::iterator ite = modified_.begin(); ite != modified_.end(); ++ite) {
+      workers_[(*ite)->shard()]->tail(*ite);
+    }
+  } else {
+    uringTail_.tail(modified_);
+    addBacklog(modified_);
+  }
+  modified_.clear();
+  modifiedSet_.clear();
+}
+
+void InotifyCtx::addBacklog(const std::vector<LuaCtx *> &ctxs)
+{
+  for (std::vector<LuaCtx *>::const_iterator ite = ctxs.begin(); ite != ctxs.end(); ++ite) {
+    requeue(*ite);
+  }
+}
+
+/* the quota of backfill_rate is spent for this second, tailing the file
+ * again in this round would read nothing
+ */
+void InotifyCtx::requeue(LuaCtx *ctx)
+{
+  FileReader *reader = ctx->getFileReader();
+  if (reader->throttled()) {
+    throttle(ctx);
+  } else if (reader->backlog() && std::find(backlog_.begin(), backlog_.end(), ctx) == backlog_.end()) {
+    backlog_.push_back(ctx);
+  }
 }
 
 bool InotifyCtx::addWatch(LuaCtx *ctx, bool strict)
@@ -66,9 +182,114 @@ bool InotifyCtx::addWatch(LuaCtx *ctx, bool strict)
 
   ctx->holdFd(fd);
   fdToCtx_.insert(std::make_pair(wd, ctx));
+  getFileTimer(ctx)->wd = wd;
   return true;
 }
 
+InotifyCtx::FileTimer *InotifyCtx::getFileTimer(LuaCtx *ctx)
+{
+  std::map<LuaCtx *, FileTimer *>::iterator pos = timers_.find(ctx);
+  if (pos != timers_.end()) return pos->second;
+
+  FileTimer *timer = new FileTimer(ctx);
+  timers_.insert(std::make_pair(ctx, timer));
+  return timer;
+}
+
+/* the remedy of the files is spread over its interval */
+void InotifyCtx::addTimers(LuaCtx *ctx, int64_t remedy)
+{
+  FileTimer *timer = getFileTimer(ctx);
+  int64_t now = cnf_->fasttime();
+
+  wheel_.add(&timer->check, now + CHECK_INTERVAL);
+  wheel_.add(&timer->rewatch, now + REWATCH_INTERVAL);
+  wheel_.add(&timer->remedy, remedy);
+  if (ctx->fileWithTimeFormat()) wheel_.add(&timer->rollover, ctx->nextTimeFormatFile());
+}
+
+/* a file which was idle is looked at in the short intervals again */
+void InotifyCtx::touchTimers(LuaCtx *ctx)
+{
+  std::map<LuaCtx *, FileTimer *>::iterator pos = timers_.find(ctx);
+  if (pos == timers_.end()) return;
+
+  FileTimer *timer = pos->second;
+  int64_t now = cnf_->fasttime();
+  timer->activeTime = now;
+
+  if (timer->checkInterval > CHECK_INTERVAL && timer->check.pending()) {
+    timer->checkInterval = CHECK_INTERVAL;
+    wheel_.add(&timer->check, now + CHECK_INTERVAL);
+  }
+  if (timer->rewatchInterval > REWATCH_INTERVAL && timer->rewatch.pending()) {
+    timer->rewatchInterval = REWATCH_INTERVAL;
+    wheel_.add(&timer->rewatch, now + REWATCH_INTERVAL);
+  }
+}
+
+void InotifyCtx::throttle(LuaCtx *ctx)
+{
+  FileTimer *timer = getFileTimer(ctx);
+  if (!timer->backfill.pending()) wheel_.add(&timer->backfill, cnf_->fasttime() + 1);
+}
+
+/* only the files whose deadline is due cost a syscall in this second */
+void InotifyCtx::expireTimers()
+{
+  std::vector<util::TimerWheel::Timer *> expired;
+  wheel_.expire(cnf_->fasttime(), &expired);
+  if (expired.empty()) return;
+
+  int64_t now = cnf_->fasttime();
+  std::vector<LuaCtx *> checks;
+  std::vector<int> wds;
+
+  for (std::vector<util::TimerWheel::Timer *>::iterator ite = expired.begin(); ite != expired.end(); ++ite) {
+    FileTimer *timer = (FileTimer *) (*ite)->data();
+    LuaCtx *ctx = timer->ctx;
+
+    switch ((*ite)->type()) {
+    case FileTimer::CHECK:
+      checks.push_back(ctx);
+      if (timer->aggregate || now - timer->activeTime <= timer->checkInterval) {
+        timer->checkInterval = CHECK_INTERVAL;
+      } else {
+        timer->checkInterval = std::min(timer->checkInterval * 2, MAX_CHECK_INTERVAL);
+      }
+      wheel_.add(&timer->check, now + timer->checkInterval);
+      break;
+
+    case FileTimer::REWATCH:
+      tryReWatch(ctx, false, &wds);
+      if (ctx->holdFd() == -1 || now - timer->activeTime <= timer->rewatchInterval) {
+        timer->rewatchInterval = REWATCH_INTERVAL;
+      } else {
+        timer->rewatchInterval = std::min(timer->rewatchInterval * 2, MAX_REWATCH_INTERVAL);
+      }
+      wheel_.add(&timer->rewatch, now + timer->rewatchInterval);
+      break;
+
+    case FileTimer::REMEDY:
+      tryReWatch(ctx, true, &wds);
+      wheel_.add(&timer->remedy, now + REMEDY_INTERVAL);
+      break;
+
+    case FileTimer::ROLLOVER:
+      tryReWatch(ctx, false, &wds);
+      wheel_.add(&timer->rollover, ctx->nextTimeFormatFile());
+      break;
+
+    case FileTimer::BACKFILL:
+      tail(ctx);
+      break;
+    }
+  }
+
+  reWatch(wds);
+  if (!checks.empty()) checkFiles(checks);
+}
+
 bool InotifyCtx::init()
 {
   // inotify_init1 Linux 2.6.27
@@ -81,13 +302,163 @@ bool InotifyCtx::init()
   int nb = 1;
   ioctl(wfd_, FIONBIO, &nb);
 
+  int64_t now = cnf_->fasttime();
   for (std::vector<LuaCtx *>::iterator ite = cnf_->getLuaCtxs().begin();
        ite != cnf_->getLuaCtxs().end(); ++ite) {
-    if (!addWatch(*ite, true)) return false;
+    if ((*ite)->glob()) {
+      if (!addGlobWatch(*ite)) return false;
+    } else {
+      if (!addWatch(*ite, true)) return false;
+      addTimers(*ite, now + 1 + (ite - cnf_->getLuaCtxs().begin()) % REMEDY_INTERVAL);
+    }
   }
   return true;
 }
 
+bool InotifyCtx::addGlobWatch(LuaCtx *ctx)
+{
+  const std::string &dir = ctx->glob()->dir();
+
+  int wd = inotify_add_watch(wfd_, dir.c_str(), GLOB_WATCH_EVENT);
+  if (wd == -1) {
+    snprintf(cnf_->errbuf(), MAX_ERR_LEN, "%s add watch error %d:%s",
+             dir.c_str(), errno, strerror(errno));
+    return false;
+  }
+
+  log_info(0, "watch %s @%d", ctx->file().c_str(), wd);
+  globWds_.insert(std::make_pair(wd, ctx->glob()));
+  return true;
+}
+
+/* without tail threads, the calls run in the inotify thread */
+void InotifyCtx::initGlobFile(LuaCtx *ctx, const std::string &file)
+{
+  if (!workers_.empty()) {
+    workers_[ctx->shard()]->initGlob(ctx, file);
+  } else if (!ctx->initGlobFile(file, true, cnf_->errbuf())) {
+    log_error(0, "glob add %s error %s", file.c_str(), cnf_->errbuf());
+  }
+}
+
+/* the tailed file moves to the head of the lru, the files past globmaxfds
+ * are closed, a file which is not at the end is closed when it gets there
+ */
+void InotifyCtx::tailGlobFile(LuaCtx *ctx)
+{
+  std::map<LuaCtx *, std::list<LuaCtx *>::iterator>::iterator pos = globLruPos_.find(ctx);
+  if (pos != globLruPos_.end()) {
+    globLru_.splice(globLru_.begin(), globLru_, pos->second);
+  } else {
+    globLru_.push_front(ctx);
+    globLruPos_.insert(std::make_pair(ctx, globLru_.begin()));
+    wheel_.add(&getFileTimer(ctx)->check, cnf_->fasttime() + CHECK_INTERVAL);
+  }
+
+  while (globLru_.size() > (size_t) cnf_->globMaxFds()) {
+    LuaCtx *idle = globLru_.back();
+    globLru_.pop_back();
+    globLruPos_.erase(idle);
+    wheel_.remove(&getFileTimer(idle)->check);
+
+    if (workers_.empty()) idle->getFileReader()->suspend();
+    else workers_[idle->shard()]->suspend(idle);
+  }
+
+  tail(ctx);
+}
+
+/* deleted or moved out of the directory, the rest of it is still read */
+void InotifyCtx::retireGlobFile(LuaCtx *ctx)
+{
+  if (!workers_.empty()) {
+    workers_[ctx->shard()]->retire(ctx);
+  } else {
+    ctx->getFileReader()->retire();
+    if (ctx->getFileReader()->throttled()) throttle(ctx);
+    else if (ctx->getFileReader()->backlog()) tail(ctx);
+  }
+}
+
+void InotifyCtx::globEvent(GlobSource *glob, const struct inotify_event *event)
+{
+  if (event->len == 0) return;  // the directory itself
+  std::string name(event->name);
+
+  if (event->mask & IN_MOVED_FROM) {
+    if (glob->find(name)) {
+      globMoved_[event->cookie] = std::make_pair(glob, name);
+    } else if (glob->ignored(name)) {
+      glob->ignore(name, false);
+      globMoved_[event->cookie] = std::make_pair(glob, std::string());
+    }
+    return;
+  }
+
+  if (event->mask & IN_MOVED_TO) {
+    std::map<uint32_t, std::pair<GlobSource *, std::string> >::iterator pos = globMoved_.find(event->cookie);
+    if (pos != globMoved_.end()) {
+      std::string from = pos->second.second;
+      globMoved_.erase(pos);
+
+      /* a rotated file moved again is still a rotated file */
+      if (glob->match(name.c_str())) glob->ignore(name, true);
+      if (from.empty()) return;
+
+      /* rotated in the directory, the file keeps its name and reads the
+       * rotated one to the end first, like a file which is not a glob
+       */
+      LuaCtx *ctx = glob->find(from);
+      std::string path = glob->path(name);
+      log_info(0, "inotify glob %s was moved to %s", glob->path(from).c_str(), path.c_str());
+
+      if (workers_.empty()) ctx->getFileReader()->tagRotate(FILE_MOVED, path.c_str());
+      else workers_[ctx->shard()]->tagRotate(ctx, path);
+      tailGlobFile(ctx);
+      return;
+    }
+  }
+
+  if (event->mask & IN_DELETE) {
+    glob->ignore(name, false);
+    LuaCtx *ctx = glob->remove(name);
+    if (ctx) {
+      log_info(0, "inotify glob %s was deleted", glob->path(name).c_str());
+      retireGlobFile(ctx);
+    }
+    return;
+  }
+
+  if (!glob->match(name.c_str()) || glob->ignored(name)) return;
+
+  LuaCtx *ctx = glob->find(name);
+  if (!ctx) {
+    if (!(ctx = glob->add(name))) return;
+
+    log_info(0, "inotify glob %s was added", glob->path(name).c_str());
+    initGlobFile(ctx, glob->path(name));
+  }
+  tailGlobFile(ctx);
+}
+
+/* an IN_MOVED_FROM without its IN_MOVED_TO, the file left the directory */
+void InotifyCtx::globMovedOut()
+{
+  for (std::map<uint32_t, std::pair<GlobSource *, std::string> >::iterator ite = globMoved_.begin();
+       ite != globMoved_.end(); ++ite) {
+    GlobSource *glob = ite->second.first;
+    const std::string &name = ite->second.second;
+    if (name.empty()) continue;
+
+    LuaCtx *ctx = glob->remove(name);
+    if (ctx) {
+      log_info(0, "inotify glob %s was moved out", glob->path(name).c_str());
+      retireGlobFile(ctx);
+    }
+  }
+  globMoved_.clear();
+}
+
 void InotifyCtx::flowControl(RunStatus *runStatus, bool remedy)
 {
   while (runStatus->get() == RunStatus::WAIT) {
@@ -122,57 +493,163 @@ void InotifyCtx::tagRotate(LuaCtx *ctx, int wd)
   } else {
     path[n] = '\0';
     log_info(0, "tag remove %d %s", wd, ctx->file().c_str());
-    ctx->getFileReader()->tagRotate(FILE_MOVED, path);
+    if (workers_.empty()) ctx->getFileReader()->tagRotate(FILE_MOVED, path);
+    else workers_[ctx->shard()]->tagRotate(ctx, path);
   }
 }
 
 /* unlink or truncate
  * Note that the event queue can overflow. In this case, events are lost.
  */
-
-void InotifyCtx::tryReWatch(bool remedy)
+void InotifyCtx::tryReWatch(LuaCtx *ctx, bool remedy, std::vector<int> *wds)
 {
-  std::vector<int> wds;
-
-  for (std::map<int, LuaCtx *>::iterator ite = fdToCtx_.begin(); ite != fdToCtx_.end(); ++ite) {
-    LuaCtx *ctx = ite->second;
+  /* the file is created again, read it from the start */
+  if (ctx->holdFd() == -1) {
+    if (addWatch(ctx, false)) tail(ctx);
+    return;
+  }
 
-    if (remedy) {
-      struct stat got, want;
-      if (fstat(ctx->holdFd(), &got) == 0 && stat(ctx->file().c_str(), &want) == 0) {
-        if (got.st_ino != want.st_ino) {
-          log_error(0, "inotify may failed, tagRotate manual");
-          tagRotate(ctx, ite->first);
-        }
-      } else {
-        log_fatal(errno, "stat holdFd %d or file %s error", ctx->holdFd(), ctx->file().c_str());
+  int wd = getFileTimer(ctx)->wd;
+  if (remedy) {
+    struct stat got, want;
+    if (fstat(ctx->holdFd(), &got) == 0 && stat(ctx->file().c_str(), &want) == 0) {
+      if (got.st_ino != want.st_ino) {
+        log_error(0, "inotify may failed, tagRotate manual");
+        tagRotate(ctx, wd);
       }
-    }
-
-    if (ctx->getFileReader()->remove()) {
-      wds.push_back(ite->first);
+    } else {
+      log_fatal(errno, "stat holdFd %d or file %s error", ctx->holdFd(), ctx->file().c_str());
     }
   }
 
-  for (std::vector<int>::iterator ite = wds.begin(); ite != wds.end(); ++ite) {
-    inotify_rm_watch(wfd_, *ite);
+  /* the tail thread reports the result, see reWatchRemoved */
+  if (!workers_.empty()) {
+    workers_[ctx->shard()]->remove(ctx, wd);
+  } else if (ctx->getFileReader()->remove()) {
+    wds->push_back(wd);
+  }
+}
 
+void InotifyCtx::reWatch(const std::vector<int> &wds)
+{
+  for (std::vector<int>::const_iterator ite = wds.begin(); ite != wds.end(); ++ite) {
     std::map<int, LuaCtx *>::iterator pos = fdToCtx_.find(*ite);
+    if (pos == fdToCtx_.end()) continue;
+
+    inotify_rm_watch(wfd_, *ite);
     LuaCtx *ctx = pos->second;
 
     fdToCtx_.erase(pos);
     close(ctx->holdFd());
 
     addWatch(ctx, false);
-    ctx->getFileReader()->tail2kafka();
+    tail(ctx);
+  }
+  tailModified();
+}
+
+void InotifyCtx::reWatchRemoved()
+{
+  std::vector<int> wds;
+  for (std::vector<TailWorker *>::iterator ite = workers_.begin(); ite != workers_.end(); ++ite) {
+    (*ite)->getRemoved(&wds);
   }
+  if (!wds.empty()) reWatch(wds);
+}
+
+void InotifyCtx::requeueThrottled()
+{
+  std::vector<LuaCtx *> ctxs;
+  for (std::vector<TailWorker *>::iterator ite = workers_.begin(); ite != workers_.end(); ++ite) {
+    (*ite)->getThrottled(&ctxs);
+  }
+  for (std::vector<LuaCtx *>::iterator ite = ctxs.begin(); ite != ctxs.end(); ++ite) throttle(*ite);
+}
+
+void InotifyCtx::readEvents(char *eventBuffer, size_t eventBufferSize, bool *overflow)
+{
+  ssize_t nn = read(wfd_, eventBuffer, eventBufferSize);
+  if (nn <= 0) return;
+
+  char *p = eventBuffer;
+  while (p < eventBuffer + nn) {
+    /* IN_IGNORED when watch was removed */
+    struct inotify_event *event = (struct inotify_event *) p;
+    p += sizeof(struct inotify_event) + event->len;
+
+    if (event->mask & IN_Q_OVERFLOW) {
+      *overflow = true;
+      continue;
+    }
+
+    std::map<int, GlobSource *>::iterator glob = globWds_.find(event->wd);
+    if (glob != globWds_.end()) {
+      globEvent(glob->second, event);
+      continue;
+    }
+
+    if (event->mask & IN_MODIFY) {
+      LuaCtx *ctx = getLuaCtx(event->wd);
+      if (ctx) {
+        log_debug(0, "inotify %s was modified", ctx->file().c_str());
+        tail(ctx);
+      } else {
+        log_fatal(0, "@%d could not found ctx", event->wd);
+      }
+    }
+    if (event->mask & (IN_MOVE_SELF | IN_ATTRIB)) {
+      LuaCtx *ctx = getLuaCtx(event->wd);
+      if (ctx) {
+        if (event->mask & IN_MOVE_SELF) {
+          log_info(0, "inotify %s was moved", ctx->file().c_str());
+          tagRotate(ctx, event->wd);
+        }
+        /* rewatch in the next second instead of at its deadline */
+        wheel_.add(&getFileTimer(ctx)->rewatch, cnf_->fasttime());
+      } else {
+        log_fatal(0, "@%d could not found ctx", event->wd);
+      }
+    }
+  }
+  globMovedOut();
+}
+
+/* IN_Q_OVERFLOW, the events were lost. every file is looked at once now
+ * instead of at the next remedy, a file without new data costs one fstat,
+ * a closed glob file is opened only if its size changed. the remedy of
+ * every file is due in the next second, it finds a lost IN_MOVE_SELF
+ */
+void InotifyCtx::rescan()
+{
+  log_error(0, "inotify queue overflow, rescan");
 
   for (std::vector<LuaCtx *>::iterator ite = cnf_->getLuaCtxs().begin();
        ite != cnf_->getLuaCtxs().end(); ++ite) {
-    LuaCtx *ctx = *ite;
+    if ((*ite)->glob()) continue;
+    tail(*ite);
+    wheel_.add(&getFileTimer(*ite)->remedy, cnf_->fasttime());
+  }
+
+  for (std::map<int, GlobSource *>::iterator ite = globWds_.begin(); ite != globWds_.end(); ++ite) {
+    GlobSource *glob = ite->second;
+    std::vector<std::string> changed, gone;
+    if (!glob->rescan(&changed, &gone, cnf_->errbuf())) {
+      log_fatal(0, "glob rescan %s error %s", glob->dir().c_str(), cnf_->errbuf());
+      continue;
+    }
 
-    if (ctx->holdFd() == -1) {
-      addWatch(ctx, false);
+    for (std::vector<std::string>::iterator jte = gone.begin(); jte != gone.end(); ++jte) {
+      LuaCtx *ctx = glob->remove(*jte);
+      if (ctx) retireGlobFile(ctx);
+    }
+
+    for (std::vector<std::string>::iterator jte = changed.begin(); jte != changed.end(); ++jte) {
+      LuaCtx *ctx = glob->find(*jte);
+      if (!ctx) {
+        if (!(ctx = glob->add(*jte))) continue;
+        initGlobFile(ctx, glob->path(*jte));
+      }
+      tailGlobFile(ctx);
     }
   }
 }
@@ -181,86 +658,103 @@ void InotifyCtx::loop()
 {
   RunStatus *runStatus = cnf_->getRunStatus();
 
-  const size_t eventBufferSize = cnf_->getLuaCtxSize() * ONE_EVENT_SIZE * 5;
+  const size_t eventBufferSize = (cnf_->getLuaCtxSize() * 5 + globWds_.size() * GLOB_EVENTS) * ONE_EVENT_SIZE;
   char *eventBuffer = (char *) malloc(eventBufferSize);
 
+  /* the glob files which are behind were left open by GlobSource::init */
+  for (std::map<int, GlobSource *>::iterator ite = globWds_.begin(); ite != globWds_.end(); ++ite) {
+    const std::vector<LuaCtx *> &files = ite->second->files();
+    for (std::vector<LuaCtx *>::const_iterator jte = files.begin(); jte != files.end(); ++jte) {
+      if ((*jte)->getFileReader()->fd() != -1) tailGlobFile(*jte);
+    }
+  }
+
   struct pollfd fds[] = {
     {wfd_, POLLIN, 0 }
   };
 
-  bool rotate = false;
-  long savedTime = cnf_->fasttime(true, TIMEUNIT_SECONDS);
-  long rewatchTime = savedTime;
-  long remedyTime = savedTime;
+  long remedyTime = cnf_->fasttime(true, TIMEUNIT_SECONDS);
 
   while (runStatus->get() == RunStatus::WAIT) {
-    int nfd = poll(fds, 1, cnf_->getTailLimit() ? 1 : 500);
+    int timeout = !backlog_.empty() ? 0 : (cnf_->getTailLimit() ? 1 : 500);
+    int nfd = poll(fds, 1, timeout);
     cnf_->fasttime(true, TIMEUNIT_SECONDS);
     cnf_->setTailLimit(false);
 
     if (nfd == -1) {
       if (errno != EINTR) return;
-    } else if (nfd == 0) {
-      globalCheck();
-    } else {
-      ssize_t nn = read(wfd_, eventBuffer, eventBufferSize);
-      assert(nn > 0);
-
-      char *p = eventBuffer;
-      while (p < eventBuffer + nn) {
-        /* IN_IGNORED when watch was removed */
-        struct inotify_event *event = (struct inotify_event *) p;
-        if (event->mask & IN_MODIFY) {
-          LuaCtx *ctx = getLuaCtx(event->wd);
-          if (ctx) {
-            log_debug(0, "inotify %s was modified", ctx->file().c_str());
-            ctx->getFileReader()->tail2kafka();
-          } else {
-            log_fatal(0, "@%d could not found ctx", event->wd);
-          }
+    } else if (nfd > 0) {
+      bool overflow = false;
+      readEvents(eventBuffer, eventBufferSize, &overflow);
+
+      /* a few more milliseconds for the next appends, one tail reads them all */
+      if (cnf_->coalesceMs() > 0 && !modified_.empty()) {
+        int64_t deadline = cnf_->fasttime(true, TIMEUNIT_MILLI) + cnf_->coalesceMs();
+        int wait;
+        while ((wait = (int) (deadline - cnf_->fasttime(true, TIMEUNIT_MILLI))) > 0 && poll(fds, 1, wait) > 0) {
+          readEvents(eventBuffer, eventBufferSize, &overflow);
         }
-        if (event->mask & IN_MOVE_SELF) {
-          LuaCtx *ctx = getLuaCtx(event->wd);
-          if (ctx) {
-            log_info(0, "inotify %s was moved", ctx->file().c_str());
-            tagRotate(ctx, event->wd);
-            rotate = true;
-          } else {
-            log_fatal(0, "@%d could not found ctx", event->wd);
-          }
-        }
-        p += sizeof(struct inotify_event) + event->len;
       }
-    }
 
-    if (cnf_->fasttime() != savedTime) {
-      globalCheck();
-      savedTime = cnf_->fasttime();
+      if (overflow) rescan();
     }
 
-    bool remedy = cnf_->fasttime() > remedyTime + 60;
+    /* every file in the backlog gets one more quantum in this round */
+    std::vector<LuaCtx *> backlog;
+    backlog.swap(backlog_);
+    for (std::vector<LuaCtx *>::iterator ite = backlog.begin(); ite != backlog.end(); ++ite) {
+      tail(*ite);
+    }
+    tailModified();
 
-    if (cnf_->fasttime() > rewatchTime + 5 || remedy || rotate) {
-      tryReWatch(remedy);
-      if (remedy) remedyTime = cnf_->fasttime();
-      rewatchTime = cnf_->fasttime();
-      rotate = false;
+    expireTimers();
+    if (!workers_.empty()) {
+      reWatchRemoved();
+      requeueThrottled();
     }
 
+    bool remedy = cnf_->fasttime() > remedyTime + 60;
+    if (remedy) remedyTime = cnf_->fasttime();
+
     if (cnf_->getPollLimit()) sys::millisleep(cnf_->getPollLimit());
     flowControl(runStatus, remedy);
+
+    /* the files skipped while blocked may get no more event */
+    bool blocked = cnf_->flowControlOn();
+    if (blocked_ && !blocked) globalCheck();
+    blocked_ = blocked;
   }
 
   runStatus->set(RunStatus::STOP);
 }
 
+/* the glob files which may be open are checked, not the closed ones */
 void InotifyCtx::globalCheck()
 {
+  std::vector<LuaCtx *> files;
   for (std::vector<LuaCtx *>::iterator ite = cnf_->getLuaCtxs().begin();
        ite != cnf_->getLuaCtxs().end(); ++ite) {
+    if (!(*ite)->glob()) files.push_back(*ite);
+  }
+  files.insert(files.end(), globLru_.begin(), globLru_.end());
+  checkFiles(files);
+}
+
+/* flush the aggregate cache and tail, in case an event was lost */
+void InotifyCtx::checkFiles(const std::vector<LuaCtx *> &files)
+{
+  if (workers_.empty()) {
+    uringTail_.checkFiles(files);
+    addBacklog(files);
+    return;
+  }
+
+  std::vector<std::vector<LuaCtx *> > shards(workers_.size());
+  for (std::vector<LuaCtx *>::const_iterator ite = files.begin(); ite != files.end(); ++ite) {
+    shards[(*ite)->shard()].push_back(*ite);
+  }
 
-    LuaCtx *ctx = *ite;
-    ctx->getFileReader()->checkCache();
-    ctx->getFileReader()->tail2kafka();
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    if (!shards[i].empty()) workers_[i]->checkFiles(shards[i]);
   }
 }
@@ -2,38 +2,114 @@
 #define _INOTIFY_CTX_H_
 
 #include <map>
+#include <set>
+#include <list>
+#include <string>
+#include <vector>
+#include <stdint.h>
 #include "runstatus.h"
+#include "uringtail.h"
+#include "timerwheel.h"
 
 class LuaCtx;
 class CnfCtx;
+class TailWorker;
+class GlobSource;
+struct inotify_event;
 
 class InotifyCtx {
   template<class T> friend class UNITTEST_HELPER;
 public:
-  InotifyCtx(CnfCtx *cnf) : cnf_(cnf), wfd_(-1) {}
+  InotifyCtx(CnfCtx *cnf);
   ~InotifyCtx();
 
   bool init();
   void loop();
 
+  /* without tail threads, the files are tailed in the inotify thread */
+  bool startWorkers(char *errbuf);
+  void stopWorkers();
+
 private:
   LuaCtx *getLuaCtx(int wd) {
     std::map<int, LuaCtx *>::iterator pos = fdToCtx_.find(wd);
     return pos != fdToCtx_.end() ? pos->second : 0;
   }
 
+  /* the periodic work of one file, a deadline each in wheel_ */
+  struct FileTimer {
+    enum Type { CHECK, REWATCH, REMEDY, ROLLOVER, BACKFILL };
+    FileTimer(LuaCtx *ctx);
+
+    LuaCtx *ctx;
+    int     wd;
+    bool    aggregate;        // the cache is flushed every second
+    int64_t activeTime;       // tailed last time
+    int     checkInterval;    // doubled while the file is idle
+    int     rewatchInterval;
+
+    util::TimerWheel::Timer check;     // flush the aggregate cache and tail
+    util::TimerWheel::Timer rewatch;   // deleted, truncated or not watched yet
+    util::TimerWheel::Timer remedy;    // stat the name, a lost IN_MOVE_SELF
+    util::TimerWheel::Timer rollover;  // the name of fileWithTimeFormat changes
+    util::TimerWheel::Timer backfill;  // the backfill_rate quota of the next second
+  };
+
+  FileTimer *getFileTimer(LuaCtx *ctx);
+  void addTimers(LuaCtx *ctx, int64_t remedy);
+  void touchTimers(LuaCtx *ctx);
+  void expireTimers();
+  void throttle(LuaCtx *ctx);
+
   bool addWatch(LuaCtx *ctx, bool strict);
-  void tryReWatch(bool remedy);
+  void tryReWatch(LuaCtx *ctx, bool remedy, std::vector<int> *wds);
+  void reWatch(const std::vector<int> &wds);
+  void reWatchRemoved();
+  void requeueThrottled();
   void tagRotate(LuaCtx *ctx, int wd);
+  void checkFiles(const std::vector<LuaCtx *> &files);
   void globalCheck();
 
+  bool addGlobWatch(LuaCtx *ctx);
+  void globEvent(GlobSource *glob, const struct inotify_event *event);
+  void globMovedOut();
+  void initGlobFile(LuaCtx *ctx, const std::string &file);
+  void tailGlobFile(LuaCtx *ctx);
+  void retireGlobFile(LuaCtx *ctx);
+
+  void tail(LuaCtx *ctx);
+  void tailModified();
+  void addBacklog(const std::vector<LuaCtx *> &ctxs);
+  void requeue(LuaCtx *ctx);
+
   void flowControl(RunStatus *runStatus, bool remedy);
 
+  void readEvents(char *eventBuffer, size_t eventBufferSize, bool *overflow);
+  void rescan();
+
 private:
   CnfCtx *cnf_;
 
   int wfd_;
   std::map<int, LuaCtx *> fdToCtx_;
+
+  std::vector<TailWorker *> workers_;
+
+  UringTail             uringTail_;  // without tail threads
+  std::vector<LuaCtx *> modified_;
+  std::set<LuaCtx *>    modifiedSet_;
+  std::vector<LuaCtx *> backlog_;    // files which spent their deficit
+
+  util::TimerWheel                wheel_;
+  std::map<LuaCtx *, FileTimer *> timers_;
+  bool                            blocked_;  // flow control was on in the last round
+
+  std::map<int, GlobSource *> globWds_;
+  /* IN_MOVED_FROM waits for its IN_MOVED_TO, the name is empty for an ignored file */
+  std::map<uint32_t, std::pair<GlobSource *, std::string> > globMoved_;
+  /* the glob files which may be open, the tail of the list is closed first */
+  std::list<LuaCtx *> globLru_;
+  std::map<LuaCtx *, std::list<LuaCtx *>::iterator> globLruPos_;
 };
 
 #endif
@@ -0,0 +1,165 @@
+#include <cstdio>
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "iouring.h"
+
+#if defined(HAVE_IO_URING) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+# include <linux/io_uring.h>
+# define IO_URING_ENABLED 1
+#endif
+
+#define MAX_ERR_LEN 512
+
+using namespace util;
+
+IoUring::IoUring()
+  : fd_(-1), sqEntries_(0), prepared_(0),
+    sqPtr_(MAP_FAILED), sqSize_(0), cqPtr_(MAP_FAILED), cqSize_(0), sqesPtr_(MAP_FAILED), sqesSize_(0),
+    sqHead_(0), sqTail_(0), sqMask_(0), sqArray_(0), cqHead_(0), cqTail_(0), cqMask_(0), cqes_(0)
+{}
+
+IoUring::~IoUring()
+{
+  if (sqesPtr_ != MAP_FAILED) munmap(sqesPtr_, sqesSize_);
+  if (cqPtr_ != MAP_FAILED) munmap(cqPtr_, cqSize_);
+  if (sqPtr_ != MAP_FAILED) munmap(sqPtr_, sqSize_);
+  if (fd_ != -1) close(fd_);
+}
+
+#ifdef IO_URING_ENABLED
+
+IoUring *IoUring::create(unsigned entries, char *errbuf)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+
+  int fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (fd == -1) {
+    snprintf(errbuf, MAX_ERR_LEN, "io_uring_setup error %d:%s", errno, strerror(errno));
+    return 0;
+  }
+
+  IoUring *ring = new IoUring;
+  ring->fd_ = fd;
+  ring->sqEntries_ = p.sq_entries;
+
+  if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+    snprintf(errbuf, MAX_ERR_LEN, "io_uring read at current position is not supported");
+    delete ring;
+    return 0;
+  }
+
+  ring->sqSize_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cqSize_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqesSize_ = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sqPtr_ = mmap(0, ring->sqSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->sqPtr_ != MAP_FAILED) {
+    ring->cqPtr_ = mmap(0, ring->cqSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  }
+  if (ring->cqPtr_ != MAP_FAILED) {
+    ring->sqesPtr_ = mmap(0, ring->sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  }
+  if (ring->sqesPtr_ == MAP_FAILED) {
+    snprintf(errbuf, MAX_ERR_LEN, "io_uring mmap error %d:%s", errno, strerror(errno));
+    delete ring;
+    return 0;
+  }
+
+  char *sq = (char *) ring->sqPtr_;
+  ring->sqHead_  = (unsigned *) (sq + p.sq_off.head);
+  ring->sqTail_  = (unsigned *) (sq + p.sq_off.tail);
+  ring->sqMask_  = (unsigned *) (sq + p.sq_off.ring_mask);
+  ring->sqArray_ = (unsigned *) (sq + p.sq_off.array);
+
+  char *cq = (char *) ring->cqPtr_;
+  ring->cqHead_ = (unsigned *) (cq + p.cq_off.head);
+  ring->cqTail_ = (unsigned *) (cq + p.cq_off.tail);
+  ring->cqMask_ = (unsigned *) (cq + p.cq_off.ring_mask);
+  ring->cqes_   = cq + p.cq_off.cqes;
+
+  return ring;
+}
+
+bool IoUring::prepRead(int fd, void *buf, unsigned len, uint64_t userData)
+{
+  unsigned tail = *sqTail_;
+  __sync_synchronize();
+  if (tail - *sqHead_ == sqEntries_) return false;
+
+  unsigned idx = tail & *sqMask_;
+  struct io_uring_sqe *sqe = (struct io_uring_sqe *) sqesPtr_ + idx;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode    = IORING_OP_READ;
+  sqe->fd        = fd;
+  sqe->off       = (uint64_t) -1;
+  sqe->addr      = (uint64_t) (uintptr_t) buf;
+  sqe->len       = len;
+  sqe->user_data = userData;
+
+  sqArray_[idx] = idx;
+  __sync_synchronize();
+  *sqTail_ = tail + 1;
+
+  ++prepared_;
+  return true;
+}
+
+int IoUring::submit()
+{
+  int submitted = 0;
+  while (prepared_ > 0) {
+    int rc = syscall(__NR_io_uring_enter, fd_, prepared_, 0, 0, 0, 0);
+    if (rc == -1) {
+      if (errno == EINTR) continue;
+      if (submitted == 0) return -errno;
+      break;
+    }
+    if (rc == 0) break;
+    prepared_ -= rc;
+    submitted += rc;
+  }
+  return submitted;
+}
+
+bool IoUring::wait(uint64_t *userData, int *res)
+{
+  unsigned head = *cqHead_;
+  for ( ;; ) {
+    __sync_synchronize();
+    if (head != *cqTail_) break;
+
+    int rc = syscall(__NR_io_uring_enter, fd_, 0, 1, IORING_ENTER_GETEVENTS, 0, 0);
+    if (rc == -1 && (errno == EAGAIN || errno == EBUSY)) {
+      usleep(1000);   // the kernel is short of memory or the cq overflows, try again
+    } else if (rc == -1 && errno != EINTR) {
+      return false;
+    }
+  }
+
+  struct io_uring_cqe *cqe = (struct io_uring_cqe *) cqes_ + (head & *cqMask_);
+  *userData = cqe->user_data;
+  *res      = cqe->res;
+
+  __sync_synchronize();
+  *cqHead_ = head + 1;
+  return true;
+}
+
+#else
+
+IoUring *IoUring::create(unsigned, char *errbuf)
+{
+  snprintf(errbuf, MAX_ERR_LEN, "io_uring is not supported by this build");
+  return 0;
+}
+
+bool IoUring::prepRead(int, void *, unsigned, uint64_t) { return false; }
+int IoUring::submit() { return -ENOSYS; }
+bool IoUring::wait(uint64_t *, int *) { return false; }
+
+#endif
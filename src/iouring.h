@@ -0,0 +1,62 @@
+#ifndef _IO_URING_H_
+#define _IO_URING_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace util {
+
+/* a minimal io_uring on raw syscalls, only what the tail needs:
+ * queue reads, submit them in one syscall, reap the completions.
+ * reads use offset -1, the current file position, which requires
+ * IORING_FEAT_RW_CUR_POS (linux 5.6), so lseek keeps working on the fd
+ */
+class IoUring {
+public:
+  /* return 0 and fill errbuf if the kernel or the build lacks io_uring */
+  static IoUring *create(unsigned entries, char *errbuf);
+  ~IoUring();
+
+  unsigned entries() const { return sqEntries_; }
+
+  /* return false if the submission queue is full */
+  bool prepRead(int fd, void *buf, unsigned len, uint64_t userData);
+
+  /* submit all prepared requests, return how many, or -errno */
+  int submit();
+
+  /* block until a completion is ready, res is the read result or -errno,
+   * false only if the ring is broken
+   */
+  bool wait(uint64_t *userData, int *res);
+
+private:
+  IoUring();
+  IoUring(const IoUring &);
+  IoUring &operator=(const IoUring &);
+
+  int fd_;
+  unsigned sqEntries_;
+  unsigned prepared_;
+
+  void   *sqPtr_;
+  size_t  sqSize_;
+  void   *cqPtr_;
+  size_t  cqSize_;
+  void   *sqesPtr_;
+  size_t  sqesSize_;
+
+  unsigned *sqHead_;
+  unsigned *sqTail_;
+  unsigned *sqMask_;
+  unsigned *sqArray_;
+
+  unsigned *cqHead_;
+  unsigned *cqTail_;
+  unsigned *cqMask_;
+  void     *cqes_;
+};
+
+}  // namespace util
+
+#endif
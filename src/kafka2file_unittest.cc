@@ -67,6 +67,66 @@ DEFINE(messageInfoExtrace)
   check(rc, "extrace %s error", PTRS(payload));
   check(info.len == 18, "info payload len error %d", info.len);
   check(strncmp(info.ptr, payload.c_str(), info.len) == 0, "info payload error %.*s", info.len, info.ptr);
+
+  // the offset header
+  char offset[8];
+  util::encodeUint64(123456789012ULL, offset);
+  check(offset[0] == 0 && offset[7] == (char) 0x14, "offset header error %d", (int) offset[7]);
+  check(util::decodeUint64(offset) == 123456789012ULL, "offset header error %lu", util::decodeUint64(offset));
+
+#if RD_KAFKA_VERSION >= KAFKA_HEADERS_VERSION
+  // a kafkaheaders message, the payload has no prefix
+  payload = "Hello World\n";
+  rd_kafka_headers_t *hdrs = rd_kafka_headers_new(2);
+  rd_kafka_header_add(hdrs, KAFKA_HEADER_HOST, -1, "zzyong", 6);
+  rc = MessageInfo::extract(hdrs, payload.c_str(), payload.size(), &info, true);
+  check(!rc, "headers without offset should be rejected");
+
+  rd_kafka_header_add(hdrs, KAFKA_HEADER_OFFSET, -1, offset, 8);
+  rc = MessageInfo::extract(hdrs, payload.c_str(), payload.size(), &info, true);
+  check(rc, "extrace headers error");
+  check(info.type == MessageInfo::NMSG, "info type error");
+  check(info.host == "zzyong", "info host error %s", PTRS(info.host));
+  check(info.pos == 123456789012L, "info pos error %ld", info.pos);
+  check(info.ptr == payload.c_str() && info.len == 11, "info payload error %.*s", info.len, info.ptr);
+  rd_kafka_headers_destroy(hdrs);
+#endif
+}
+
+DEFINE(messageInfoPack)
+{
+  MessageInfo info;
+
+  std::string payload("&zzyong@1234567@0000000000100 ");
+  util::appendVarint(&payload, 0);
+  util::appendVarint(&payload, 6);
+  payload.append("Hello\n");
+  util::appendVarint(&payload, 300);
+  util::appendVarint(&payload, 6);
+  payload.append("World\n");
+
+  bool rc = MessageInfo::extract(payload.c_str(), payload.size(), &info, true);
+  check(rc, "extrace pack error");
+  check(info.type == MessageInfo::PACK, "info type error");
+  check(info.host == "zzyong", "info host error %s", PTRS(info.host));
+  check(info.inode == 1234567, "info inode error %lu", (unsigned long) info.inode);
+  check(info.lines == 2, "info lines error %d", (int) info.lines);
+
+  const char *line;
+  int nline;
+  check(info.nextLine(&line, &nline) && info.pos == 100, "info pos error %ld", info.pos);
+  check(nline == 5 && strncmp(line, "Hello", 5) == 0, "line error %.*s", nline, line);
+  check(info.nextLine(&line, &nline) && info.pos == 400, "info pos error %ld", info.pos);
+  check(nline == 5 && strncmp(line, "World", 5) == 0, "line error %.*s", nline, line);
+  check(!info.nextLine(&line, &nline), "pack has 2 lines");
+
+  payload.resize(payload.size() - 1);
+  rc = MessageInfo::extract(payload.c_str(), payload.size(), &info, true);
+  check(!rc, "truncated pack should be rejected");
+
+  payload = "&zzyong@0000000000100 ";
+  rc = MessageInfo::extract(payload.c_str(), payload.size(), &info, true);
+  check(!rc, "pack without inode should be rejected");
 }
 
 DEFINE(luaTransformInit)
@@ -88,8 +148,18 @@ DEFINE(luaTransformInit)
   check(value.isString() && value.asString() == "/host/api/null", "uri fun call error");
 }
 
-inline rd_kafka_message_t *initKafkaMessage(rd_kafka_message_t *rkm, const char *payload, uint64_t offset)
+/* rd_kafka_message_headers() looks at the librdkafka message around
+ * rkm, a message built by hand sits in zeroed memory so it has no headers
+ */
+struct KafkaMessage {
+  rd_kafka_message_t rkm;
+  char               internal[1024];
+};
+
+inline rd_kafka_message_t *initKafkaMessage(KafkaMessage *msg, const char *payload, uint64_t offset)
 {
+  memset(msg, 0, sizeof(*msg));
+  rd_kafka_message_t *rkm = &msg->rkm;
   rkm->payload = (void *) payload;
   rkm->len     = strlen(payload);
   rkm->offset  = offset;
@@ -123,7 +193,7 @@ DEFINE(luaTransformLogRotate)
   bool *withTimeout = ENV_GET("WITH_TIMEOUT", bool *);
 
   uint64_t offset;
-  rd_kafka_message_t rkm;
+  KafkaMessage rkm;
   for (int i = 0; msgs[i]; ++i) {
     printf("%s\n", msgs[i]);
     uint32_t flags = luaTransform->write(initKafkaMessage(&rkm, msgs[i], i), &offset);
@@ -190,6 +260,7 @@ int main()
 
   TEST(parseRequest);
   TEST(messageInfoExtrace);
+  TEST(messageInfoPack);
 
   TEST(luaTransformInit);
 
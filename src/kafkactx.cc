@@ -1,16 +1,162 @@
 #include <cstring>
+#include <memory>
+#include <algorithm>
 #include <errno.h>
 #include <arpa/inet.h>
+#include <sys/time.h>
+#include <json/json.h>
 
 #include "logger.h"
+#include "common.h"
+#include "util.h"
 #include "cnfctx.h"
 #include "luactx.h"
 #include "filereader.h"
+#include "spool.h"
 #include "kafkactx.h"
 
-static int stats_cb(rd_kafka_t *, char * /*json*/, size_t /*json_len*/, void *)
+static int64_t jsonInt(const Json::Value &obj, const char *name)
 {
-//  log_opaque(json, (int) json_len, true);
+  if (!obj.isObject()) return 0;
+  const Json::Value &value = obj[name];
+  return value.isNumeric() ? value.asInt64() : 0;
+}
+
+static std::string jsonString(const Json::Value &obj, const char *name)
+{
+  if (!obj.isObject()) return "";
+  const Json::Value &value = obj[name];
+  return value.isString() ? value.asString() : "";
+}
+
+/* missing fields are 0, older librdkafka has no batchsize for example */
+bool KafkaStats::parse(const char *json, size_t len)
+{
+  Json::Value root;
+  Json::Reader reader;
+  if (!reader.parse(json, json + len, root) || !root.isObject()) return false;
+
+  name    = jsonString(root, "name");
+  time    = jsonInt(root, "time");
+  msgCnt  = jsonInt(root, "msg_cnt");
+  msgSize = jsonInt(root, "msg_size");
+  txmsgs  = jsonInt(root, "txmsgs");
+  txbytes = jsonInt(root, "txmsg_bytes");
+
+  const Json::Value &brokerObjs = root["brokers"];
+  for (Json::Value::const_iterator ite = brokerObjs.begin(); brokerObjs.isObject() && ite != brokerObjs.end(); ++ite) {
+    const Json::Value &obj = *ite;
+    if (jsonInt(obj, "nodeid") < 0) continue;    // bootstrap brokers
+
+    KafkaBrokerStats broker;
+    broker.name      = jsonString(obj, "name");
+    broker.rtt       = jsonInt(obj["rtt"], "avg");
+    broker.outbuf    = jsonInt(obj, "outbuf_cnt");
+    broker.waitresp  = jsonInt(obj, "waitresp_cnt");
+    broker.tx        = jsonInt(obj, "tx");
+    broker.txretries = jsonInt(obj, "txretries");
+    broker.txerrs    = jsonInt(obj, "txerrs");
+    broker.timeouts  = jsonInt(obj, "req_timeouts");
+    brokers.push_back(broker);
+  }
+
+  const Json::Value &topicObjs = root["topics"];
+  for (Json::Value::const_iterator ite = topicObjs.begin(); topicObjs.isObject() && ite != topicObjs.end(); ++ite) {
+    const Json::Value &obj = *ite;
+
+    KafkaTopicStats topic;
+    topic.topic     = jsonString(obj, "topic");
+    topic.batchsize = jsonInt(obj["batchsize"], "avg");
+    topic.batchcnt  = jsonInt(obj["batchcnt"], "avg");
+    topics.push_back(topic);
+
+    const Json::Value &partitionObjs = obj["partitions"];
+    for (Json::Value::const_iterator jte = partitionObjs.begin();
+         partitionObjs.isObject() && jte != partitionObjs.end(); ++jte) {
+      const Json::Value &pobj = *jte;
+      if (jsonInt(pobj, "partition") < 0) continue;    // UA, not assigned yet
+
+      KafkaPartitionStats partition;
+      partition.topic     = topic.topic;
+      partition.partition = jsonInt(pobj, "partition");
+      partition.leader    = jsonInt(pobj, "leader");
+      partition.msgq      = jsonInt(pobj, "msgq_cnt") + jsonInt(pobj, "xmit_msgq_cnt");
+      partition.msgqBytes = jsonInt(pobj, "msgq_bytes") + jsonInt(pobj, "xmit_msgq_bytes");
+      partition.txmsgs    = jsonInt(pobj, "txmsgs");
+      partition.txbytes   = jsonInt(pobj, "txbytes");
+      partitions.push_back(partition);
+    }
+  }
+  return true;
+}
+
+void KafkaStats::format(bool withPartitions, std::vector<std::string> *lines) const
+{
+  char buffer[1024];
+
+  snprintf(buffer, 1024, "kafka stats %s msgq=%ld,msgqbytes=%ld,txmsgs=%ld,txbytes=%ld", name.c_str(),
+           (long) msgCnt, (long) msgSize, (long) txmsgs, (long) txbytes);
+  lines->push_back(buffer);
+
+  for (std::vector<KafkaBrokerStats>::const_iterator ite = brokers.begin(); ite != brokers.end(); ++ite) {
+    snprintf(buffer, 1024, "kafka stats %s broker %s rtt=%ldus,outbuf=%ld,waitresp=%ld,tx=%ld,txretries=%ld,txerrs=%ld,timeouts=%ld",
+             name.c_str(), ite->name.c_str(), (long) ite->rtt, (long) ite->outbuf, (long) ite->waitresp,
+             (long) ite->tx, (long) ite->txretries, (long) ite->txerrs, (long) ite->timeouts);
+    lines->push_back(buffer);
+  }
+
+  for (std::vector<KafkaTopicStats>::const_iterator ite = topics.begin(); ite != topics.end(); ++ite) {
+    int64_t msgq = 0, maxq = 0;
+    for (std::vector<KafkaPartitionStats>::const_iterator jte = partitions.begin(); jte != partitions.end(); ++jte) {
+      if (jte->topic != ite->topic) continue;
+      msgq += jte->msgq;
+      maxq = std::max(maxq, jte->msgq);
+    }
+    snprintf(buffer, 1024, "kafka stats %s topic %s msgq=%ld,maxq=%ld,batchsize=%ld,batchcnt=%ld",
+             name.c_str(), ite->topic.c_str(), (long) msgq, (long) maxq, (long) ite->batchsize, (long) ite->batchcnt);
+    lines->push_back(buffer);
+  }
+
+  for (std::vector<KafkaPartitionStats>::const_iterator ite = partitions.begin();
+       withPartitions && ite != partitions.end(); ++ite) {
+    snprintf(buffer, 1024, "kafka stats %s partition %s/%d leader=%d,msgq=%ld,msgqbytes=%ld,txmsgs=%ld,txbytes=%ld",
+             name.c_str(), ite->topic.c_str(), (int) ite->partition, (int) ite->leader, (long) ite->msgq,
+             (long) ite->msgqBytes, (long) ite->txmsgs, (long) ite->txbytes);
+    lines->push_back(buffer);
+  }
+}
+
+/* the latest stats of a producer are kept for logStats, all of them go
+ * to the stats log at most every STATS_LOG_INTERVAL
+ */
+int KafkaCtx::stats_cb(rd_kafka_t *rk, char *json, size_t json_len, void *opaque)
+{
+  KafkaCtx *kafka = (KafkaCtx *) opaque;
+
+  KafkaStats stats;
+  if (!stats.parse(json, json_len)) {
+    log_error(0, "kafka stats json parse error");
+    return 0;
+  }
+
+  std::vector<std::string> lines;
+  pthread_mutex_lock(&kafka->statsMutex_);
+  for (std::vector<KafkaProducer>::iterator ite = kafka->producers_.begin(); ite != kafka->producers_.end(); ++ite) {
+    if (ite->rk != rk) continue;
+
+    ite->stats = stats;
+    ite->statsFresh = true;
+    if (stats.time >= ite->statsLogged + STATS_LOG_INTERVAL) {
+      ite->statsLogged = stats.time;
+      stats.format(true, &lines);
+    }
+  }
+  pthread_mutex_unlock(&kafka->statsMutex_);
+
+  for (std::vector<std::string>::iterator ite = lines.begin(); ite != lines.end(); ++ite) {
+    if (kafka->statsLog_) kafka->statsLog_->info(__FILE__, __LINE__, 0, "%s", ite->c_str());
+    else log_info(0, "%s", ite->c_str());
+  }
   return 0;
 }
 
@@ -30,13 +176,55 @@ static void log_cb(const rd_kafka_t *, int level, const char *fac, const char *b
   log_info(0, "kafka error level %d fac %s buf %s", level, fac, buf);
 }
 
-static void dr_msg_cb(rd_kafka_t *, const rd_kafka_message_t *rkmsg, void *)
+/* the latency is from the handoff to librdkafka, so the time a record
+ * waits in the rings, the retry queue or the spool is not in it
+ */
+void KafkaCtx::dr_msg_cb(rd_kafka_t *, const rd_kafka_message_t *rkmsg, void *opaque)
 {
+  KafkaCtx *kafka = (KafkaCtx *) opaque;
   FileRecord *record = (FileRecord *) rkmsg->_private;
+
+  if (!rkmsg->err) {
+    KafkaProducer *producer = &kafka->producers_[kafka->rktProducer_[record->ctx->rktId()]];
+    util::atomic_inc(&producer->msgs);
+    util::atomic_inc(&producer->bytes, (int64_t) rkmsg->len);
+  }
+
+  if (record->ctx->getPartitioner() == PARTITIONER_RANDOM && record->handoff > 0 &&
+      rkmsg->partition >= 0 && rkmsg->partition < MAX_PARTITION_STATS) {
+    int64_t *latency = &kafka->partitions_[record->ctx->rktId()].latency[rkmsg->partition];
+    int64_t ms = kafka->cnf_->fasttime(TIMEUNIT_MILLI) - record->handoff;
+    int64_t avg = util::atomic_get(latency);
+    util::atomic_set(latency, avg == 0 ? std::max(ms, (int64_t) 1) : avg + (ms - avg) / 8);
+  }
+
   record->ctx->getFileReader()->updateFileOffRecord(record);
   FileRecord::destroy(record);
 }
 
+/* the hash of the key is computed by the tail threads, see keyidx.
+ * a key always goes to the same partition, even without a leader, the
+ * message waits in librdkafka for the leader instead of moving
+ */
+int32_t KafkaCtx::key_partitioner_cb (
+  const rd_kafka_topic_t *, const void *, size_t, int32_t pc, void *, void *msg_opaque)
+{
+  const FileRecord *record = (const FileRecord *) msg_opaque;
+  return record->keyHash % pc;
+}
+
+/* a random partition which has a leader */
+static int32_t random_partitioner_cb (
+  const rd_kafka_topic_t *rkt, const void *, size_t, int32_t pc, void *, void *)
+{
+  int32_t start = rand() % pc;
+  for (int32_t i = 0; i < pc; ++i) {
+    int32_t partition = (start + i) % pc;
+    if (rd_kafka_topic_partition_available(rkt, partition)) return partition;
+  }
+  return start;
+}
+
 static int32_t partitioner_cb (
   const rd_kafka_topic_t *, const void *, size_t, int32_t pc, void *opaque, void *)
 {
@@ -46,7 +234,7 @@ static int32_t partitioner_cb (
   else return partition;
 }
 
-bool KafkaCtx::initKafka(const char *brokers, const std::map<std::string, std::string> &gcnf, char *errbuf)
+rd_kafka_t *KafkaCtx::initKafka(const char *brokers, const std::map<std::string, std::string> &gcnf, char *errbuf)
 {
   char errstr[512];
 
@@ -58,7 +246,7 @@ bool KafkaCtx::initKafka(const char *brokers, const std::map<std::string, std::s
       snprintf(errbuf, MAX_ERR_LEN, "kafka conf %s=%s %s", ite->first.c_str(), ite->second.c_str(), errstr);
 
       rd_kafka_conf_destroy(conf);
-      return false;
+      return 0;
     }
   }
 
@@ -69,19 +257,21 @@ bool KafkaCtx::initKafka(const char *brokers, const std::map<std::string, std::s
   rd_kafka_conf_set_log_cb(conf, log_cb);
 
   /* rd_kafka_t will own conf */
-  if (!(rk_ = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr)))) {
+  rd_kafka_t *rk = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr));
+  if (!rk) {
     snprintf(errbuf, MAX_ERR_LEN, "new kafka produce error %s", errstr);
-    return false;
+    return 0;
   }
 
-  if (rd_kafka_brokers_add(rk_, brokers) < 1) {
+  if (rd_kafka_brokers_add(rk, brokers) < 1) {
     snprintf(errbuf, MAX_ERR_LEN, "kafka invalid brokers %s", brokers);
-    return false;
+    rd_kafka_destroy(rk);
+    return 0;
   }
-  return true;
+  return rk;
 }
 
-rd_kafka_topic_t *KafkaCtx::initKafkaTopic(LuaCtx *ctx, const std::map<std::string, std::string> &tcnf, char *errbuf)
+rd_kafka_topic_t *KafkaCtx::initKafkaTopic(rd_kafka_t *rk, LuaCtx *ctx, const std::map<std::string, std::string> &tcnf, char *errbuf)
 {
   char errstr[512];
 
@@ -98,14 +288,24 @@ rd_kafka_topic_t *KafkaCtx::initKafkaTopic(LuaCtx *ctx, const std::map<std::stri
 
   rd_kafka_topic_conf_set_opaque(tconf, ctx);
   if (ctx->getPartitioner() == PARTITIONER_RANDOM) {
-    rd_kafka_topic_conf_set_partitioner_cb(tconf, rd_kafka_msg_partitioner_random);
+    rd_kafka_topic_conf_set_partitioner_cb(tconf, random_partitioner_cb);
+  } else if (ctx->getPartitioner() == PARTITIONER_KEY) {
+    rd_kafka_topic_conf_set_partitioner_cb(tconf, key_partitioner_cb);
   } else {
     rd_kafka_topic_conf_set_partitioner_cb(tconf, partitioner_cb);
   }
 
+#if RD_KAFKA_VERSION < KAFKA_HEADERS_VERSION
+  if (ctx->kafkaheaders()) {
+    snprintf(errbuf, MAX_ERR_LEN, "%s kafkaheaders requires librdkafka 0.11.4", ctx->topic().c_str());
+    rd_kafka_topic_conf_destroy(tconf);
+    return 0;
+  }
+#endif
+
   rd_kafka_topic_t *rkt;
   /* rd_kafka_topic_t will own tconf */
-  rkt = rd_kafka_topic_new(rk_, ctx->topic().c_str(), tconf);
+  rkt = rd_kafka_topic_new(rk, ctx->topic().c_str(), tconf);
   if (!rkt) {
     snprintf(errbuf, MAX_ERR_LEN, "kafka_topic_new error");
     return 0;
@@ -117,7 +317,10 @@ bool KafkaCtx::init(CnfCtx *cnf, char *errbuf)
 {
   cnf_ = cnf;
 
-  if (!initKafka(cnf->getBrokers(), cnf->getKafkaGlobalConf(), errbuf)) return false;
+  producers_.resize(cnf->kafkaProducers());
+  for (std::vector<KafkaProducer>::iterator ite = producers_.begin(); ite != producers_.end(); ++ite) {
+    if (!(ite->rk = initKafka(cnf->getBrokers(), cnf->getKafkaGlobalConf(), errbuf))) return false;
+  }
 
   rkts_ = new rd_kafka_topic_t*[cnf->getLuaCtxSize()];
   errors_ = new int[cnf->getLuaCtxSize()];
@@ -127,10 +330,13 @@ bool KafkaCtx::init(CnfCtx *cnf, char *errbuf)
        ite != cnf->getLuaCtxs().end(); ++ite) {
     LuaCtx *ctx = (*ite);
     while (ctx) {
-      rd_kafka_topic_t *rkt = initKafkaTopic(ctx, cnf->getKafkaTopicConf(), errbuf);
+      /* a topic is on one producer, whichever file it comes from */
+      size_t producer = util::hash(ctx->topic().data(), ctx->topic().size()) % producers_.size();
+      rd_kafka_topic_t *rkt = initKafkaTopic(producers_[producer].rk, ctx, cnf->getKafkaTopicConf(), errbuf);
       if (!rkt) return false;
 
       rkts_[nrkt_] = rkt;
+      rktProducer_.push_back(producer);
       ctx->setRktId(nrkt_);
       nrkt_++;
 
@@ -138,16 +344,196 @@ bool KafkaCtx::init(CnfCtx *cnf, char *errbuf)
     }
   }
 
+  if (cnf->logdir() != "-") {
+    std::string file = cnf->logdir() + "/kafka_stats.log";
+    if (!(statsLog_ = Logger::create(file, Logger::DAY))) {
+      snprintf(errbuf, MAX_ERR_LEN, "create kafka stats log %s error", file.c_str());
+      return false;
+    }
+  }
+
+  retries_.resize(nrkt_);
+  if (!startMetadata(errbuf)) return false;
+
+  if (cnf->spoolSize() > 0) {
+    std::auto_ptr<Spool> spool(new Spool);
+    if (!spool->init(cnf->libdir() + "/spool", (size_t) cnf->spoolSize() * 1024 * 1024, errbuf)) return false;
+    spool_ = spool.release();
+  }
+
   return true;
 }
 
 KafkaCtx::~KafkaCtx()
 {
+  if (metaStarted_) {
+    pthread_mutex_lock(&metaMutex_);
+    metaQuit_ = true;
+    pthread_cond_signal(&metaCond_);
+    pthread_mutex_unlock(&metaMutex_);
+    pthread_join(metaTid_, 0);
+  }
+  pthread_mutex_destroy(&metaMutex_);
+  pthread_cond_destroy(&metaCond_);
+  pthread_mutex_destroy(&statsMutex_);
+
   for (size_t i = 0; i < nrkt_; ++i) rd_kafka_topic_destroy(rkts_[i]);
-  if (rk_) rd_kafka_destroy(rk_);
+  for (std::vector<KafkaProducer>::iterator ite = producers_.begin(); ite != producers_.end(); ++ite) {
+    if (ite->rk) rd_kafka_destroy(ite->rk);
+  }
 
   if (rkts_) delete[] rkts_;
   if (errors_) delete[] errors_;
+  if (spool_) delete spool_;
+  if (statsLog_) delete statsLog_;
+}
+
+/* the producers which have events are served first, the wait is shared */
+int KafkaCtx::pollEvents(int timeout)
+{
+  int nevent = 0;
+  for (std::vector<KafkaProducer>::iterator ite = producers_.begin(); ite != producers_.end(); ++ite) {
+    nevent += rd_kafka_poll(ite->rk, 0);
+  }
+  if (nevent > 0 || timeout <= 0) return nevent;
+
+  int wait = std::max(timeout / (int) producers_.size(), 1);
+  for (std::vector<KafkaProducer>::iterator ite = producers_.begin(); ite != producers_.end(); ++ite) {
+    nevent += rd_kafka_poll(ite->rk, wait);
+  }
+  return nevent;
+}
+
+void KafkaCtx::poll(int timeout)
+{
+  pollEvents(timeout);
+}
+
+bool KafkaCtx::startMetadata(char *errbuf)
+{
+  partitions_.resize(nrkt_);
+
+  bool random = false;
+  for (LuaCtxPtrList::iterator ite = cnf_->getLuaCtxs().begin(); ite != cnf_->getLuaCtxs().end(); ++ite) {
+    for (LuaCtx *ctx = *ite; ctx; ctx = ctx->next()) {
+      if (ctx->getPartitioner() != PARTITIONER_RANDOM) continue;
+      partitions_[ctx->rktId()].random = true;
+      random = true;
+    }
+  }
+  if (!random) return true;
+
+  int rc = pthread_create(&metaTid_, 0, metadataRoutine, this);
+  if (rc != 0) {
+    snprintf(errbuf, MAX_ERR_LEN, "start kafka metadata thread error %s", strerror(rc));
+    return false;
+  }
+  metaStarted_ = true;
+  return true;
+}
+
+void KafkaCtx::refreshMetadata()
+{
+  for (size_t i = 0; i < nrkt_; ++i) {
+    if (!partitions_[i].random) continue;
+
+    const struct rd_kafka_metadata *metadata = 0;
+    rd_kafka_resp_err_t err = rd_kafka_metadata(rk(i), 0, rkts_[i], &metadata, METADATA_TIMEOUT);
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+      log_error(0, "%s rd_kafka_metadata error %s", rd_kafka_topic_name(rkts_[i]), rd_kafka_err2str(err));
+      continue;
+    }
+
+    std::vector<int32_t> available;
+    for (int j = 0; j < metadata->topic_cnt; ++j) {
+      const struct rd_kafka_metadata_topic *topic = metadata->topics + j;
+      for (int k = 0; k < topic->partition_cnt; ++k) {
+        const struct rd_kafka_metadata_partition *partition = topic->partitions + k;
+        if (partition->err == RD_KAFKA_RESP_ERR_NO_ERROR && partition->leader >= 0) {
+          available.push_back(partition->id);
+        }
+      }
+    }
+    rd_kafka_metadata_destroy(metadata);
+
+    /* only this thread changes available */
+    if (available.size() != partitions_[i].available.size()) {
+      log_info(0, "%s kafka partitions with leader %d -> %d", rd_kafka_topic_name(rkts_[i]),
+               (int) partitions_[i].available.size(), (int) available.size());
+    }
+    updatePartitions(&partitions_[i], &available);
+  }
+}
+
+/* a partition which gets its leader back has its latency forgotten, so
+ * it is tried again
+ */
+void KafkaCtx::updatePartitions(KafkaPartitions *parts, std::vector<int32_t> *available)
+{
+  std::sort(available->begin(), available->end());
+
+  pthread_mutex_lock(&metaMutex_);
+  for (std::vector<int32_t>::iterator ite = available->begin(); ite != available->end(); ++ite) {
+    if (*ite < MAX_PARTITION_STATS &&
+        !std::binary_search(parts->available.begin(), parts->available.end(), *ite)) {
+      util::atomic_set(&parts->latency[*ite], (int64_t) 0);
+    }
+  }
+  parts->available.swap(*available);
+  pthread_mutex_unlock(&metaMutex_);
+}
+
+void *KafkaCtx::metadataRoutine(void *data)
+{
+  KafkaCtx *kafka = (KafkaCtx *) data;
+
+  pthread_mutex_lock(&kafka->metaMutex_);
+  while (!kafka->metaQuit_) {
+    pthread_mutex_unlock(&kafka->metaMutex_);
+    kafka->refreshMetadata();
+    pthread_mutex_lock(&kafka->metaMutex_);
+    if (kafka->metaQuit_) break;
+
+    struct timeval now;
+    gettimeofday(&now, 0);
+    struct timespec deadline = {now.tv_sec + METADATA_REFRESH_INTERVAL, now.tv_usec * 1000};
+    pthread_cond_timedwait(&kafka->metaCond_, &kafka->metaMutex_, &deadline);
+  }
+  pthread_mutex_unlock(&kafka->metaMutex_);
+  return 0;
+}
+
+/* a partition with a leader, the one with lower latency is picked more
+ * often. UA before the first metadata, librdkafka picks one then
+ */
+int32_t KafkaCtx::choosePartition(size_t id)
+{
+  KafkaPartitions *parts = &partitions_[id];
+  int32_t partition = RD_KAFKA_PARTITION_UA;
+
+  pthread_mutex_lock(&metaMutex_);
+  const std::vector<int32_t> &available = parts->available;
+
+  int64_t total = 0;
+  for (std::vector<int32_t>::const_iterator ite = available.begin(); ite != available.end(); ++ite) {
+    int64_t latency = *ite < MAX_PARTITION_STATS ? util::atomic_get(&parts->latency[*ite]) : 0;
+    total += LATENCY_WEIGHT / (latency + LATENCY_BASE);
+  }
+
+  if (total > 0) {
+    int64_t r = rand() % total;
+    for (std::vector<int32_t>::const_iterator ite = available.begin(); ite != available.end(); ++ite) {
+      int64_t latency = *ite < MAX_PARTITION_STATS ? util::atomic_get(&parts->latency[*ite]) : 0;
+      r -= LATENCY_WEIGHT / (latency + LATENCY_BASE);
+      if (r < 0) {
+        partition = *ite;
+        break;
+      }
+    }
+    if (partition == RD_KAFKA_PARTITION_UA) partition = available.back();
+  }
+  pthread_mutex_unlock(&metaMutex_);
+  return partition;
 }
 
 bool KafkaCtx::ping(LuaCtx *ctx)
@@ -167,83 +553,268 @@ bool KafkaCtx::ping(LuaCtx *ctx)
   */
 }
 
-bool KafkaCtx::produce(FileRecord *record)
+void KafkaCtx::dropRecord(rd_kafka_topic_t *rkt, FileRecord *record, rd_kafka_resp_err_t err)
+{
+  cnf_->stats()->queueSizeDec();
+  cnf_->stats()->logErrorInc();
+  log_fatal(0, "%s kafka produce error %s", rd_kafka_topic_name(rkt), rd_kafka_err2str(err));
+  record->ctx->getFileReader()->dropFileRecord(record);
+  FileRecord::destroy(record);
+}
+
+void KafkaCtx::retryRecord(size_t id, FileRecord *record)
 {
-  CnfCtx *cnf = record->ctx->cnf();
-  rd_kafka_topic_t *rkt = rkts_[record->ctx->rktId()];
+  KafkaRetry *retry = &retries_[id];
+  int64_t now = cnf_->fasttime(TIMEUNIT_MILLI);
+
+  if (retry->records.empty()) {
+    ++nretry_;
+    retry->backoff  = RETRY_BACKOFF_MIN;
+    retry->nextTry  = now + retry->backoff;
+    retry->progress = now;
+    util::atomic_set(&retry->oldest, now);
+  }
+  retry->records.push_back(std::make_pair(record, now));
+  util::atomic_inc(&retry->depth);
+}
+
+/* the failed records of a topic are produced again in order, the backoff
+ * doubles while the queue is still full. false if no record went out for
+ * QUEUE_ERROR_TIMEOUT, librdkafka may be trapped, exit to restart
+ */
+bool KafkaCtx::drainRetry(size_t id)
+{
+  KafkaRetry *retry = &retries_[id];
+  int64_t now = cnf_->fasttime(TIMEUNIT_MILLI);
+  if (retry->records.empty() || now < retry->nextTry) return true;
+
+  rd_kafka_topic_t *rkt = rkts_[id];
+  size_t n = retry->records.size();
+  while (!retry->records.empty()) {
+    FileRecord *record = retry->records.front().first;
+    rd_kafka_resp_err_t err = produceRecord(rkt, record);
+    if (err == RD_KAFKA_RESP_ERR__QUEUE_FULL) break;
+
+    retry->records.pop_front();
+    util::atomic_dec(&retry->depth);
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR) dropRecord(rkt, record, err);
+  }
 
-  int rc;
+  /* the spool takes what is left, the topic's next records go after it */
+  while (spool_ && !retry->records.empty()) {
+    if (!spoolRecord(retry->records.front().first)) return false;
+    retry->records.pop_front();
+    util::atomic_dec(&retry->depth);
+  }
+
+  if (retry->records.empty()) {
+    --nretry_;
+    log_info(0, "%s kafka retry queue is drained", rd_kafka_topic_name(rkt));
+    return true;
+  }
+
+  if (retry->records.size() < n) retry->progress = now;
+  else if (now - retry->progress > (QUEUE_ERROR_TIMEOUT + 2) * 1000) return false;
+
+  util::atomic_set(&retry->oldest, retry->records.front().second);
+  retry->backoff = std::min(retry->backoff * 2, RETRY_BACKOFF_MAX);
+  retry->nextTry = now + retry->backoff;
+  log_error(0, "%s kafka produce queue full, %d records retry in %dms",
+            rd_kafka_topic_name(rkt), (int) retry->records.size(), retry->backoff);
+  return true;
+}
+
+/* the spool keeps the order, once it has records the new ones wait
+ * behind them. a spooled record is only a frame on disk, it leaves
+ * queueSize until it is produced again, so the tail threads are not
+ * blocked by it. the record is destroyed once it is spooled
+ */
+bool KafkaCtx::spoolRecord(FileRecord *record)
+{
   int i = 1;
-  time_t startTime = cnf->fasttime();
-  while ((rc = rd_kafka_produce(rkt, RD_KAFKA_PARTITION_UA, 0, (void *) record->data->c_str(),
-                                record->data->size(), 0, 0, record)) != 0) {
-    rd_kafka_resp_err_t err = rd_kafka_last_error();
-    if (err == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
-      if (cnf->fasttime() - startTime > QUEUE_ERROR_TIMEOUT + 2) {
-        // librdkafka may trap this loop, call exit to restart
-        return false;
-      }
+  time_t startTime = cnf_->fasttime();
+  while (!spool_->push(record)) {
+    if (cnf_->fasttime() - startTime > QUEUE_ERROR_TIMEOUT + 2) return false;
+
+    cnf_->flowControl(true);
+    int nevent = pollEvents(100 * i);
+    log_error(0, "spool is full(#%d), %d records %lu bytes, poll event %d",
+              i++, (int) spool_->records(), (unsigned long) spool_->size(), nevent);
+    if (!drainSpool()) return false;
+  }
 
-      cnf->flowControl(true);
-      int nevent = rd_kafka_poll(rk_, 100 * i);
-      log_error(0, "%s kafka produce error(#%d) %s, poll event %d",
-                rd_kafka_topic_name(rkt), i++, rd_kafka_err2str(err), nevent);
-    } else {
-      cnf->stats()->queueSizeDec();
-      cnf->stats()->logErrorInc();
-      log_fatal(0, "%s kafka produce error %s",
-                rd_kafka_topic_name(rkt), rd_kafka_err2str(err));
-      FileRecord::destroy(record);
+  cnf_->flowControl(false);
+  cnf_->stats()->queueSizeDec();
+  return true;
+}
+
+/* false if the spool can not be read, its records are lost, the logs
+ * are read again from the fileoff after the restart
+ */
+bool KafkaCtx::drainSpool()
+{
+  while (spool_ && !spool_->empty()) {
+    FileRecord *record;
+    if (!spool_->front(&record)) return false;
+    rd_kafka_topic_t *rkt = rkts_[record->ctx->rktId()];
+
+    /* the ack may come before pop() in an other thread's poll */
+    cnf_->stats()->queueSizeInc();
+    rd_kafka_resp_err_t err = produceRecord(rkt, record);
+    if (err == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+      cnf_->stats()->queueSizeDec();
       break;
     }
-  }
+    spool_->pop();
 
-  cnf->flowControl(false);
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR) dropRecord(rkt, record, err);
+  }
   return true;
 }
 
+bool KafkaCtx::drain()
+{
+  for (size_t i = 0; nretry_ > 0 && i < nrkt_; ++i) {
+    if (!drainRetry(i)) return false;
+  }
+  return drainSpool();
+}
+
+bool KafkaCtx::backlog() const
+{
+  return nretry_ > 0 || (spool_ && !spool_->empty());
+}
+
+void KafkaCtx::logStats()
+{
+  int64_t now = cnf_->fasttime(TIMEUNIT_MILLI);
+  for (size_t i = 0; producers_.size() > 1 && i < producers_.size(); ++i) {
+    log_info(0, "kafka producer #%d msgs=%ld,bytes=%ld", (int) i,
+             (long) util::atomic_get(&producers_[i].msgs), (long) util::atomic_get(&producers_[i].bytes));
+  }
+
+  std::vector<std::string> lines;
+  pthread_mutex_lock(&statsMutex_);
+  for (std::vector<KafkaProducer>::iterator ite = producers_.begin(); ite != producers_.end(); ++ite) {
+    if (ite->statsFresh) ite->stats.format(false, &lines);
+    ite->statsFresh = false;
+  }
+  pthread_mutex_unlock(&statsMutex_);
+  for (std::vector<std::string>::iterator ite = lines.begin(); ite != lines.end(); ++ite) {
+    log_info(0, "%s", ite->c_str());
+  }
+
+  for (size_t i = 0; i < nrkt_; ++i) {
+    int64_t depth = util::atomic_get(&retries_[i].depth);
+    if (depth == 0) continue;
+
+    int64_t oldest = util::atomic_get(&retries_[i].oldest);
+    log_info(0, "%s kafka retry depth=%ld,age=%ldms", rd_kafka_topic_name(rkts_[i]),
+             (long) depth, (long) (now - oldest));
+  }
+}
+
+#if RD_KAFKA_VERSION >= KAFKA_HEADERS_VERSION
+static void addHeader(rd_kafka_headers_t *hdrs, const char *name, uint64_t value)
+{
+  char buf[8];
+  util::encodeUint64(value, buf);
+  rd_kafka_header_add(hdrs, name, -1, buf, 8);
+}
+#endif
+
+/* with kafkaheaders the host, inode, offset and time go to the headers,
+ * which librdkafka owns once the message is queued
+ */
+rd_kafka_resp_err_t KafkaCtx::produceRecord(rd_kafka_topic_t *rkt, FileRecord *record)
+{
+  const void *key = record->key ? record->key->data() : 0;
+  size_t keylen = record->key ? record->key->size() : 0;
+  record->handoff = cnf_->fasttime(TIMEUNIT_MILLI);
+
+#if RD_KAFKA_VERSION >= KAFKA_HEADERS_VERSION
+  if (record->ctx->kafkaheaders()) {
+    const std::string &host = record->ctx->host();
+    rd_kafka_headers_t *hdrs = rd_kafka_headers_new(4);
+    rd_kafka_header_add(hdrs, KAFKA_HEADER_HOST, -1, host.data(), host.size());
+    if (record->off != (off_t) -1) {
+      addHeader(hdrs, KAFKA_HEADER_INODE, record->inode);
+      addHeader(hdrs, KAFKA_HEADER_OFFSET, record->off);
+    }
+    addHeader(hdrs, KAFKA_HEADER_TIME, record->time);
+
+    rd_kafka_resp_err_t err = rd_kafka_producev(
+      rk(record->ctx->rktId()), RD_KAFKA_V_RKT(rkt), RD_KAFKA_V_PARTITION(RD_KAFKA_PARTITION_UA), RD_KAFKA_V_MSGFLAGS(0),
+      RD_KAFKA_V_VALUE(record->ptr(), record->len()), RD_KAFKA_V_KEY(key, keylen),
+      RD_KAFKA_V_OPAQUE(record), RD_KAFKA_V_HEADERS(hdrs), RD_KAFKA_V_END);
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR) rd_kafka_headers_destroy(hdrs);
+    return err;
+  }
+#endif
+
+  if (rd_kafka_produce(rkt, RD_KAFKA_PARTITION_UA, 0, (void *) record->ptr(),
+                       record->len(), key, keylen, record) == 0) {
+    return RD_KAFKA_RESP_ERR_NO_ERROR;
+  }
+  return rd_kafka_last_error();
+}
+
 bool KafkaCtx::produce(std::vector<FileRecord *> *datas)
 {
   cnf_->stats()->logRecvInc(datas->size());
   assert(!datas->empty());
 
+  if (!drain()) return false;
+
   LuaCtx *ctx = datas->at(0)->ctx;
-  rd_kafka_topic_t *rkt = rkts_[ctx->rktId()];
+  size_t id = ctx->rktId();
+  rd_kafka_topic_t *rkt = rkts_[id];
 
-  int partition = RD_KAFKA_PARTITION_UA;
-  if (ctx->getPartitioner() == PARTITIONER_RANDOM) {
-    if (ctx->rktPartition() < 0 ) {
-      const struct rd_kafka_metadata *metadata = 0;
-      rd_kafka_resp_err_t err = rd_kafka_metadata(rk_, 0, rkt, &metadata, 500);
+  /* the order of a topic is kept, the records wait behind its failed ones */
+  if (!retries_[id].records.empty()) {
+    for (std::vector<FileRecord *>::iterator ite = datas->begin(); ite != datas->end(); ++ite) {
+      retryRecord(id, *ite);
+    }
+    poll(0);
+    return true;
+  }
 
-      if (err == RD_KAFKA_RESP_ERR_NO_ERROR) {
-        if (metadata->topic_cnt > 0) {
-          ctx->rktSetPartition(metadata->topics[0].partition_cnt);
-        }
-        rd_kafka_metadata_destroy(metadata);
-      } else {
-        log_fatal(0, "%s rd_kafka_metadata error %s",
-                  rd_kafka_topic_name(rkt), rd_kafka_err2str(err));
-      }
+  if (spool_ && !spool_->empty()) {
+    for (std::vector<FileRecord *>::iterator ite = datas->begin(); ite != datas->end(); ++ite) {
+      if (!spoolRecord(*ite)) return false;
     }
+    poll(0);
+    return true;
+  }
 
-    if (ctx->rktPartition() >= 0) {
-      partition = rand() % ctx->rktPartition();
+  /* rd_kafka_produce_batch has no headers */
+  if (ctx->kafkaheaders()) {
+    for (std::vector<FileRecord *>::iterator ite = datas->begin(); ite != datas->end(); ++ite) {
+      if (!retries_[id].records.empty() || produceRecord(rkt, *ite) != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        retryRecord(id, *ite);
+      }
     }
+    poll(0);
+    return true;
   }
 
+  int partition = RD_KAFKA_PARTITION_UA;
+  if (ctx->getPartitioner() == PARTITIONER_RANDOM) partition = choosePartition(id);
+
   std::vector<rd_kafka_message_t> rkmsgs;
   rkmsgs.resize(datas->size());
 
+  int64_t now = cnf_->fasttime(TIMEUNIT_MILLI);
   size_t i = 0;
   for (std::vector<FileRecord *>::iterator ite = datas->begin(), end = datas->end();
        ite != end; ++ite, ++i) {
     FileRecord *record = (*ite);
+    record->handoff = now;
 
-    rkmsgs[i].payload  = (void *) record->data->c_str();
-    rkmsgs[i].len      = record->data->size();
-    rkmsgs[i].key      = 0;
-    rkmsgs[i].key_len  = 0;
+    rkmsgs[i].payload  = (void *) record->ptr();
+    rkmsgs[i].len      = record->len();
+    rkmsgs[i].key      = record->key ? (void *) record->key->data() : 0;
+    rkmsgs[i].key_len  = record->key ? record->key->size() : 0;
     rkmsgs[i]._private = record;
   }
 
@@ -253,12 +824,10 @@ bool KafkaCtx::produce(std::vector<FileRecord *> *datas)
 
     for (std::vector<rd_kafka_message_t>::iterator ite = rkmsgs.begin(), end = rkmsgs.end();
          ite != end; ++ite) {
-      if (ite->err) {
-        if (!produce((FileRecord *) ite->_private)) return false;
-      }
+      if (ite->err) retryRecord(id, (FileRecord *) ite->_private);
     }
   }
 
-  rd_kafka_poll(rk_, 0);
+  poll(0);
   return true;
 }
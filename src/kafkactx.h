@@ -2,37 +2,187 @@
 #define _KAFKACTX_H_
 
 #include <map>
+#include <cstring>
+#include <deque>
 #include <string>
 #include <vector>
+#include <utility>
+#include <pthread.h>
 #include <librdkafka/rdkafka.h>
 
 #include "filerecord.h"
+#include "sink.h"
+class Spool;
+class Logger;
 class CnfCtx;
 class LuaCtx;
 
-class KafkaCtx {
+#define RETRY_BACKOFF_MIN 100    // ms
+#define RETRY_BACKOFF_MAX 5000
+
+/* the records of a topic which librdkafka did not take, only the routine
+ * thread uses it, depth and oldest are read by logStats
+ */
+struct KafkaRetry {
+  std::deque<std::pair<FileRecord *, int64_t> > records;   // with the ms it failed
+  int64_t nextTry;
+  int     backoff;
+  int64_t progress;   // ms a record went out last
+  int64_t depth;
+  int64_t oldest;
+
+  KafkaRetry() : nextTry(0), backoff(0), progress(0), depth(0), oldest(0) {}
+};
+
+#define METADATA_REFRESH_INTERVAL 30      // seconds
+#define METADATA_TIMEOUT          5000    // ms
+#define MAX_PARTITION_STATS       256
+#define LATENCY_BASE              10      // ms
+#define LATENCY_WEIGHT            1000000
+
+/* the partitions of a random topic which have a leader, refreshed by the
+ * metadata thread, and the delivery latency of each, a moving average in
+ * ms updated by dr_msg_cb, 0 if not known yet
+ */
+struct KafkaPartitions {
+  bool                 random;
+  std::vector<int32_t> available;   // metaMutex_
+  int64_t              latency[MAX_PARTITION_STATS];
+
+  KafkaPartitions() : random(false) { memset(latency, 0, sizeof(latency)); }
+};
+
+#define STATS_LOG_INTERVAL        60      // seconds
+
+/* from the statistics json of librdkafka, see statistics.interval.ms.
+ * tx, txretries, txerrs, timeouts and txmsgs are counters since the
+ * start, the others are gauges
+ */
+struct KafkaBrokerStats {
+  std::string name;
+  int64_t     rtt;        // avg us
+  int64_t     outbuf;     // requests not sent yet
+  int64_t     waitresp;   // requests in flight
+  int64_t     tx;
+  int64_t     txretries;
+  int64_t     txerrs;
+  int64_t     timeouts;
+};
+
+struct KafkaTopicStats {
+  std::string topic;
+  int64_t     batchsize;  // avg bytes
+  int64_t     batchcnt;   // avg messages
+};
+
+struct KafkaPartitionStats {
+  std::string topic;
+  int32_t     partition;
+  int32_t     leader;
+  int64_t     msgq;       // queued and in transmit queue
+  int64_t     msgqBytes;
+  int64_t     txmsgs;
+  int64_t     txbytes;
+};
+
+struct KafkaStats {
+  std::string name;
+  int64_t     time;       // 0 if none yet
+  int64_t     msgCnt;     // in the producer queue
+  int64_t     msgSize;
+  int64_t     txmsgs;
+  int64_t     txbytes;
+
+  std::vector<KafkaBrokerStats>    brokers;
+  std::vector<KafkaTopicStats>     topics;
+  std::vector<KafkaPartitionStats> partitions;
+
+  KafkaStats() : time(0), msgCnt(0), msgSize(0), txmsgs(0), txbytes(0) {}
+
+  bool parse(const char *json, size_t len);
+
+  /* a line for the producer, each broker and topic, and each partition */
+  void format(bool withPartitions, std::vector<std::string> *lines) const;
+};
+
+/* a rd_kafka_t, the topics are hashed to one of them by name, each has
+ * its own librdkafka threads and broker queues. msgs and bytes are the
+ * delivered ones
+ */
+struct KafkaProducer {
+  rd_kafka_t *rk;
+  int64_t     msgs;
+  int64_t     bytes;
+  KafkaStats  stats;        // statsMutex_
+  bool        statsFresh;   // not in logStats yet
+  time_t      statsLogged;
+
+  KafkaProducer() : rk(0), msgs(0), bytes(0), statsFresh(false), statsLogged(0) {}
+};
+
+class KafkaCtx : public Sink {
   template<class T> friend class UNITTEST_HELPER;
 public:
-  KafkaCtx() : rk_(0), nrkt_(0), rkts_(0), errors_(0) {}
+  KafkaCtx() : nrkt_(0), rkts_(0), errors_(0), nretry_(0), spool_(0),
+               metaStarted_(false), metaQuit_(false), statsLog_(0) {
+    pthread_mutex_init(&metaMutex_, 0);
+    pthread_mutex_init(&statsMutex_, 0);
+    pthread_cond_init(&metaCond_, 0);
+  }
   ~KafkaCtx();
   bool init(CnfCtx *cnf, char *errbuf);
   bool produce(std::vector<FileRecord *> *datas);
-  void poll(int timeout) { rd_kafka_poll(rk_, timeout); }
+  void poll(int timeout);
+  bool drain();
+  bool backlog() const;
+  void logStats();
+  const char *name() const { return "kafka"; }
   bool ping(LuaCtx *ctx);
 
 private:
   CnfCtx *cnf_;
 
-  rd_kafka_t        *rk_;
+  std::vector<KafkaProducer> producers_;
+  std::vector<size_t>        rktProducer_;   // by rktId
+
   size_t             nrkt_;
   rd_kafka_topic_t **rkts_;
   int               *errors_;
+  std::vector<KafkaRetry> retries_;   // by rktId
+  size_t             nretry_;         // retries_ not empty
+  Spool             *spool_;   // 0 without spool_size
+
+  std::vector<KafkaPartitions> partitions_;   // by rktId
+  bool               metaStarted_;
+  bool               metaQuit_;
+  pthread_t          metaTid_;
+  pthread_mutex_t    metaMutex_;
+  pthread_cond_t     metaCond_;
+
+  Logger            *statsLog_;   // logdir/kafka_stats.log, 0 with the default log
+  pthread_mutex_t    statsMutex_;
 
   static void error_cb(rd_kafka_t *, int, const char *, void *);
+  static int stats_cb(rd_kafka_t *rk, char *json, size_t json_len, void *opaque);
+  static void dr_msg_cb(rd_kafka_t *, const rd_kafka_message_t *rkmsg, void *opaque);
+  static void *metadataRoutine(void *data);
+  static int32_t key_partitioner_cb(const rd_kafka_topic_t *, const void *, size_t, int32_t pc, void *, void *msg_opaque);
+
+  rd_kafka_t *initKafka(const char *brokers, const std::map<std::string, std::string> &gcnf, char *errbuf);
+  rd_kafka_topic_t *initKafkaTopic(rd_kafka_t *rk, LuaCtx *ctx, const std::map<std::string, std::string> &tcnf, char *errbuf);
+  rd_kafka_t *rk(size_t id) { return producers_[rktProducer_[id]].rk; }
+  int pollEvents(int timeout);
+  void dropRecord(rd_kafka_topic_t *rkt, FileRecord *record, rd_kafka_resp_err_t err);
+  void retryRecord(size_t id, FileRecord *record);
+  bool drainRetry(size_t id);
+  bool spoolRecord(FileRecord *record);
+  bool drainSpool();
+  rd_kafka_resp_err_t produceRecord(rd_kafka_topic_t *rkt, FileRecord *record);
 
-  bool initKafka(const char *brokers, const std::map<std::string, std::string> &gcnf, char *errbuf);
-  rd_kafka_topic_t *initKafkaTopic(LuaCtx *ctx, const std::map<std::string, std::string> &tcnf, char *errbuf);
-  bool produce(FileRecord *data);
+  bool startMetadata(char *errbuf);
+  void refreshMetadata();
+  void updatePartitions(KafkaPartitions *parts, std::vector<int32_t> *available);
+  int32_t choosePartition(size_t id);
 };
 
 #endif
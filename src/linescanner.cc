@@ -0,0 +1,164 @@
+#include <cstring>
+#include "linescanner.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && \
+  (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+# define LINESCANNER_X86 1
+# include <immintrin.h>
+#endif
+
+#define NL '\n'
+
+namespace util {
+
+static size_t scanLinesScalar(const char *data, size_t size, uint32_t *ends, size_t max, size_t *scanned)
+{
+  size_t n = 0, off = 0;
+  const char *pos;
+
+  while (n < max && (pos = (const char *) memchr(data + off, NL, size - off))) {
+    ends[n++] = pos - data;
+    off = pos - data + 1;
+  }
+
+  *scanned = (n == max) ? off : size;
+  return n;
+}
+
+#ifdef LINESCANNER_X86
+
+/* drain the NL bitmask of one block, return false if ends is full */
+#define DRAIN_MASK(mask, base) do {                  \
+  while (mask) {                                     \
+    uint32_t pos = (base) + __builtin_ctz(mask);     \
+    ends[n++] = pos;                                 \
+    if (n == max) {                                  \
+      *scanned = pos + 1;                            \
+      return n;                                      \
+    }                                                \
+    mask &= mask - 1;                                \
+  }                                                  \
+} while (0)
+
+static size_t scanLinesSse2(const char *data, size_t size, uint32_t *ends, size_t max, size_t *scanned)
+{
+  size_t n = 0, off = 0;
+  if (max == 0) {
+    *scanned = 0;
+    return 0;
+  }
+
+  const __m128i nl = _mm_set1_epi8(NL);
+  for (; off + 16 <= size; off += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *) (data + off));
+    uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, nl));
+    DRAIN_MASK(mask, off);
+  }
+
+  for (; off < size; ++off) {
+    if (data[off] != NL) continue;
+    ends[n++] = off;
+    if (n == max) {
+      *scanned = off + 1;
+      return n;
+    }
+  }
+
+  *scanned = size;
+  return n;
+}
+
+__attribute__((target("avx2")))
+static size_t scanLinesAvx2(const char *data, size_t size, uint32_t *ends, size_t max, size_t *scanned)
+{
+  size_t n = 0, off = 0;
+  if (max == 0) {
+    *scanned = 0;
+    return 0;
+  }
+
+  const __m256i nl = _mm256_set1_epi8(NL);
+  for (; off + 64 <= size; off += 64) {
+    __m256i lo = _mm256_loadu_si256((const __m256i *) (data + off));
+    __m256i hi = _mm256_loadu_si256((const __m256i *) (data + off + 32));
+    uint32_t mlo = _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, nl));
+    uint32_t mhi = _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, nl));
+    if ((mlo | mhi) == 0) continue;
+
+    DRAIN_MASK(mlo, off);
+    DRAIN_MASK(mhi, off + 32);
+  }
+
+  if (off + 32 <= size) {
+    __m256i block = _mm256_loadu_si256((const __m256i *) (data + off));
+    uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, nl));
+    DRAIN_MASK(mask, off);
+    off += 32;
+  }
+
+  for (; off < size; ++off) {
+    if (data[off] != NL) continue;
+    ends[n++] = off;
+    if (n == max) {
+      *scanned = off + 1;
+      return n;
+    }
+  }
+
+  *scanned = size;
+  return n;
+}
+
+#undef DRAIN_MASK
+#endif
+
+struct ScanLinesImpl {
+  const char   *name;
+  ScanLinesFun  fun;
+};
+
+static ScanLinesImpl selectScanLinesImpl()
+{
+  ScanLinesImpl impl;
+#ifdef LINESCANNER_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    impl.name = "avx2";
+    impl.fun  = scanLinesAvx2;
+  } else {
+    impl.name = "sse2";
+    impl.fun  = scanLinesSse2;
+  }
+#else
+  impl.name = "scalar";
+  impl.fun  = scanLinesScalar;
+#endif
+  return impl;
+}
+
+static ScanLinesImpl scanLinesImpl_ = selectScanLinesImpl();
+
+size_t scanLines(const char *data, size_t size, uint32_t *ends, size_t max, size_t *scanned)
+{
+  return scanLinesImpl_.fun(data, size, ends, max, scanned);
+}
+
+const char *scanLinesImpl()
+{
+  return scanLinesImpl_.name;
+}
+
+ScanLinesFun getScanLinesFun(const char *impl)
+{
+  if (strcmp(impl, "scalar") == 0) return scanLinesScalar;
+#ifdef LINESCANNER_X86
+  if (strcmp(impl, "sse2") == 0) return scanLinesSse2;
+  if (strcmp(impl, "avx2") == 0) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? scanLinesAvx2 : 0;
+  }
+#endif
+  return 0;
+}
+
+} // namespace util
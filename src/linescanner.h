@@ -0,0 +1,25 @@
+#ifndef _LINE_SCANNER_H_
+#define _LINE_SCANNER_H_
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace util {
+
+typedef size_t (*ScanLinesFun)(const char *data, size_t size, uint32_t *ends, size_t max, size_t *scanned);
+
+/* find NL in [data, data+size), ends[i] is the offset of the i-th NL
+ * the scan stops when max NL were found, *scanned is the bytes examined
+ * size must be less than 4G
+ */
+size_t scanLines(const char *data, size_t size, uint32_t *ends, size_t max, size_t *scanned);
+
+/* implementation selected at startup, avx2, sse2 or scalar */
+const char *scanLinesImpl();
+
+/* 0 if impl is unknown or the cpu does not support it */
+ScanLinesFun getScanLinesFun(const char *impl);
+
+} // namespace util
+
+#endif
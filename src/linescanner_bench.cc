@@ -0,0 +1,109 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+
+#include "linescanner.h"
+
+#define NL          '\n'
+#define LINE_BATCH  4096
+
+/* linescanner_bench [MB] [avglinelen]
+ * compare the memchr per line loop with the batched scanner
+ */
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static size_t sink_;
+
+static void __attribute__((noinline)) consumeLine(const char *line, size_t nline)
+{
+  sink_ += nline + (nline ? line[0] : 0);
+}
+
+static size_t memchrLoop(const char *data, size_t size)
+{
+  size_t n = 0, lines = 0;
+  const char *pos;
+  while ((pos = (const char *) memchr(data + n, NL, size - n))) {
+    consumeLine(data + n, pos - (data + n));
+    ++lines;
+    n = (pos+1) - data;
+    if (n == size) break;
+  }
+  return lines;
+}
+
+static size_t scanLoop(util::ScanLinesFun fun, const char *data, size_t size, uint32_t *ends)
+{
+  size_t n = 0, lines = 0;
+  while (n < size) {
+    size_t scanned;
+    size_t nend = fun(data + n, size - n, ends, LINE_BATCH, &scanned);
+    if (nend == 0) break;
+
+    size_t start = 0;
+    for (size_t i = 0; i < nend; start = ends[i] + 1, ++i) {
+      consumeLine(data + n + start, ends[i] - start);
+    }
+    lines += nend;
+    n += ends[nend-1] + 1;
+    if (nend < LINE_BATCH) break;
+  }
+  return lines;
+}
+
+static void report(const char *name, size_t size, size_t lines, double cost)
+{
+  printf("%-8s %8.2f MB/s %10.2f Mlines/s\n", name,
+         size / cost / (1024 * 1024), lines / cost / 1000000);
+}
+
+int main(int argc, char *argv[])
+{
+  size_t mb = argc > 1 ? atoi(argv[1]) : 256;
+  size_t avg = argc > 2 ? atoi(argv[2]) : 200;
+  if (mb == 0 || avg < 2) {
+    fprintf(stderr, "%s [MB] [avglinelen]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::string data;
+  data.reserve(mb * 1024 * 1024);
+  srand(0);
+  while (data.size() < mb * 1024 * 1024) {
+    size_t len = avg / 2 + rand() % avg;
+    for (size_t i = 0; i < len; ++i) data.append(1, 'a' + rand() % 26);
+    data.append(1, NL);
+  }
+
+  std::vector<uint32_t> ends(LINE_BATCH);
+  printf("lines avg %d bytes, %d MB, selected %s\n", (int) avg, (int) mb, util::scanLinesImpl());
+
+  double start = now();
+  size_t lines = memchrLoop(data.data(), data.size());
+  report("memchr", data.size(), lines, now() - start);
+
+  const char *impls[] = {"scalar", "sse2", "avx2"};
+  for (size_t i = 0; i < sizeof(impls)/sizeof(impls[0]); ++i) {
+    util::ScanLinesFun fun = util::getScanLinesFun(impls[i]);
+    if (!fun) continue;
+
+    start = now();
+    size_t n = scanLoop(fun, data.data(), data.size(), &ends[0]);
+    report(impls[i], data.size(), n, now() - start);
+    if (n != lines) {
+      fprintf(stderr, "%s lines %d != %d\n", impls[i], (int) n, (int) lines);
+      return EXIT_FAILURE;
+    }
+  }
+
+  return sink_ == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -16,6 +16,8 @@
 #include "logger.h"
 #include "filereader.h"
 #include "luahelper.h"
+#include "fileoff.h"
+#include "globsource.h"
 #include "luactx.h"
 
 static bool loadHistoryFile(const std::string &libdir, const std::string &name, std::deque<std::string> *q)
@@ -118,6 +120,8 @@ static bool parseUserGroup(const char *username, uid_t *uid, gid_t *gid, char *e
 
 bool LuaCtx::testFile(const char *luaFile, char *errbuf)
 {
+  if (glob_) return sys::isdir(glob_->dir().c_str(), errbuf);
+
   std::string filename;
   if (fileWithTimeFormat_) {
     timeFormatFile_ = sys::timeFormat(cnf_->fasttime(), file_.c_str(), file_.size());
@@ -185,6 +189,13 @@ LuaCtx *LuaCtx::loadFile(CnfCtx *cnf, const char *file)
   if (!helper->getBool("fileWithTimeFormat", &ctx->fileWithTimeFormat_, false)) return 0;
 
   if (!helper->getString("file", &ctx->file_)) return 0;
+  if (GlobSource::isGlob(ctx->file_)) {
+    if (ctx->fileWithTimeFormat_ || ctx->autocreat_) {
+      snprintf(cnf->errbuf(), MAX_ERR_LEN, "%s glob file does not support fileWithTimeFormat or autocreat", file);
+      return 0;
+    }
+    if (!(ctx->glob_ = GlobSource::create(cnf, ctx->file_, cnf->errbuf()))) return 0;
+  }
   if (!ctx->testFile(file, cnf->errbuf())) return 0;
 
   std::string esIndex, esDoc;
@@ -228,12 +239,31 @@ LuaCtx *LuaCtx::loadFile(CnfCtx *cnf, const char *file)
 
   if (!helper->getBool("md5sum", &ctx->md5sum_, false)) return 0;
   if (!helper->getBool("rawcopy", &ctx->rawcopy_, false)) return 0;
+  if (!helper->getBool("mmaptail", &ctx->mmapTail_, false)) return 0;
+  if (!helper->getInt("weight", &ctx->weight_, 1)) return 0;
+  if (ctx->weight_ < 1 || ctx->weight_ > MAX_FILE_WEIGHT) {
+    snprintf(cnf->errbuf(), MAX_ERR_LEN, "%s weight must be in [1, %d]", file, MAX_FILE_WEIGHT);
+    return 0;
+  }
   if (!helper->getInt("timeidx", &ctx->timeidx_, -1)) return 0;
   if (!helper->getBool("withtime", &ctx->withtime_, true)) return 0;
   if (!helper->getBool("autonl", &ctx->autonl_, true)) return 0;
   if (!helper->getBool("withhost", &ctx->withhost_, true)) return 0;
   if (!helper->getString("pkey", &ctx->pkey_, "")) return 0;
 
+  if (!helper->getInt("packlines", &ctx->packlines_, 0)) return 0;
+  if (!helper->getInt("packsize", &ctx->packsize_, 64)) return 0;
+  if (ctx->packlines_ < 0 || ctx->packlines_ > MAX_PACK_LINES) {
+    snprintf(cnf->errbuf(), MAX_ERR_LEN, "%s packlines must be in [0, %d]", file, MAX_PACK_LINES);
+    return 0;
+  }
+  if (ctx->packsize_ < 1 || ctx->packsize_ > MAX_PACK_SIZE) {
+    snprintf(cnf->errbuf(), MAX_ERR_LEN, "%s packsize must be in [1, %d] KB", file, MAX_PACK_SIZE);
+    return 0;
+  }
+
+  if (!helper->getBool("kafkaheaders", &ctx->kafkaheaders_, false)) return 0;
+
   LuaFunction::Type luafType;
   if (!ctx->topic_.empty()) luafType = LuaFunction::KAFKAPLAIN;
   else if (!esIndex.empty()) luafType = LuaFunction::ESPLAIN;
@@ -242,6 +272,45 @@ LuaCtx *LuaCtx::loadFile(CnfCtx *cnf, const char *file)
   if (!(ctx->function_ = LuaFunction::create(ctx.get(), helper.get(), luafType))) return 0;
   if (!ctx->loadHistoryFile()) return 0;
 
+  if (ctx->packlines_ > 0) {
+    LuaFunction::Type type = ctx->function_->getType();
+    if (ctx->topic_.empty() || !(type == LuaFunction::KAFKAPLAIN || type == LuaFunction::FILTER ||
+                                 type == LuaFunction::GREP || type == LuaFunction::TRANSFORM)) {
+      snprintf(cnf->errbuf(), MAX_ERR_LEN, "%s packlines works with kafka topic of plain, filter, grep and transform", file);
+      return 0;
+    }
+    if (ctx->rawcopy_) {
+      snprintf(cnf->errbuf(), MAX_ERR_LEN, "%s packlines conflicts with rawcopy", file);
+      return 0;
+    }
+  }
+
+  if (ctx->kafkaheaders_) {
+    LuaFunction::Type type = ctx->function_->getType();
+    if (ctx->topic_.empty() || !(type == LuaFunction::KAFKAPLAIN || type == LuaFunction::FILTER ||
+                                 type == LuaFunction::GREP || type == LuaFunction::TRANSFORM)) {
+      snprintf(cnf->errbuf(), MAX_ERR_LEN, "%s kafkaheaders works with kafka topic of plain, filter, grep and transform", file);
+      return 0;
+    }
+    if (!ctx->withhost_ || ctx->packlines_ > 0) {
+      snprintf(cnf->errbuf(), MAX_ERR_LEN, "%s kafkaheaders requires withhost and conflicts with packlines", file);
+      return 0;
+    }
+  }
+
+  if (!helper->getInt("keyidx", &ctx->keyidx_, 0)) return 0;
+  if (ctx->keyidx_ != 0) {
+    LuaFunction::Type type = ctx->function_->getType();
+    if (ctx->topic_.empty() || type == LuaFunction::AGGREGATE || type == LuaFunction::INDEXDOC) {
+      snprintf(cnf->errbuf(), MAX_ERR_LEN, "%s keyidx works with kafka topic only, not aggregate", file);
+      return 0;
+    }
+    if (ctx->partition_ == PARTITIONER_RANDOM || ctx->autoparti_ || ctx->rawcopy_ || ctx->packlines_ > 0) {
+      snprintf(cnf->errbuf(), MAX_ERR_LEN, "%s keyidx conflicts with partition=-100, autoparti, rawcopy and packlines", file);
+      return 0;
+    }
+  }
+
   // es
   if (ctx->topic_.empty()) ctx->partition_ = PARTITIONER_RANDOM;
 
@@ -342,21 +411,88 @@ bool LuaCtx::initFileReader(FileReader *reader, char *errbuf)
   return true;
 }
 
+/* the readers of a glob file live as long as the pattern, a removed file
+ * is reused for an other name with the same readers, see GlobSource::reuse
+ */
+LuaCtx *LuaCtx::cloneGlobFile(FileReader *reader)
+{
+  LuaCtx *ctx = new LuaCtx(*this);
+  ctx->glob_       = 0;
+  ctx->globParent_ = this;
+  ctx->globOff_    = 0;
+  ctx->fqueue_.clear();
+
+  ctx->holdFd_ = -1;
+  ctx->tailPending_ = ctx->removePending_ = 0;
+
+  ctx->fileReader_ = new FileReader(ctx);
+  if (reader) ctx->fileReader_->init(reader);
+
+  ctx->next_ = next_ ? next_->cloneGlobFile(reader ? reader : ctx->fileReader_) : 0;
+  return ctx;
+}
+
+/* in the tail thread of the file once it was tailed, a failed file is retired */
+bool LuaCtx::initGlobFile(const std::string &file, bool created, char *errbuf)
+{
+  assert(globParent_);
+  std::string name = file.substr(file.rfind('/') + 1);
+
+  bool rc = true;
+  for (LuaCtx *ctx = this; ctx; ctx = ctx->next_) {
+    ctx->file_ = file;
+    ctx->fileAlias_ = ctx->globParent_->fileAlias_ + "." + name;
+    ctx->startPosition_ = created ? "START" : ctx->globParent_->startPosition_;
+    ctx->fileReader_->reset();
+    if (rc) rc = ctx->loadHistoryFile();
+  }
+
+  if (!rc || !fileReader_->init(errbuf)) {
+    fileReader_->retire();
+    return false;
+  }
+
+  /* the slots are reserved after FileOff::reinit, before it the files get one there */
+  if (!globOff_) globOff_ = cnf_->getFileOff()->reserve();
+  if (globOff_) fileReader_->initFileOffRecord(globOff_);
+
+  fileReader_->suspend();
+  return true;
+}
+
+void LuaCtx::setGlobOff(FileOffRecord *fileOffRecord)
+{
+  globOff_ = fileOffRecord;
+  if (fileReader_) fileReader_->initFileOffRecord(globOff_);
+}
+
 LuaCtx::LuaCtx()
 {
   helper_     = 0;
   function_   = 0;
   fileReader_ = 0;
 
+  glob_       = 0;
+  globParent_ = 0;
+  globOff_    = 0;
+
   partition_ = -1;
   timeidx_  = -1;
+  keyidx_   = 0;
+  packlines_ = 0;
+  packsize_  = 64;
+  kafkaheaders_ = false;
   next_ = 0;
 
-  rktPartition_ = -1;
+  shard_ = 0;
+  tailPending_ = removePending_ = 0;
 }
 
 LuaCtx::~LuaCtx() {
-  if (helper_) delete helper_;
-  if (function_) delete function_;
+  if (!globParent_) {
+    if (helper_) delete helper_;
+    if (function_) delete function_;
+  }
+  if (glob_) delete glob_;
   if (fileReader_) delete fileReader_;
 }
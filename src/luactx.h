@@ -13,8 +13,14 @@
 #include "cnfctx.h"
 
 class FileReader;
+class GlobSource;
+class FileOffRecord;
 
 #define PARTITIONER_RANDOM -100
+#define PARTITIONER_KEY    -101
+#define MAX_FILE_WEIGHT    100
+#define MAX_PACK_LINES     10000
+#define MAX_PACK_SIZE      1024   // KB
 
 #define ESDOC_DATAFORMAT_NGINX_JSON 1
 #define ESDOC_DATAFORMAT_NGINX_LOG  2
@@ -43,7 +49,7 @@ public:
   FileReader *getFileReader() { return fileReader_; }
 
   void setRktId(int id) { rktId_ = id; }
-  int rktId() { return rktId_; }
+  int rktId() { return globParent_ ? globParent_->rktId() : rktId_; }
 
   void setNext(LuaCtx* nxt) { next_ = nxt; }
   LuaCtx *next() { return next_; }
@@ -60,6 +66,7 @@ public:
 
   int getPartitioner() const {
     if (partition_ == PARTITIONER_RANDOM) return partition_;
+    else if (keyidx_ != 0) return PARTITIONER_KEY;
     else return -1;
   }
 
@@ -75,19 +82,17 @@ public:
     }
   }
 
-  int rktPartition() const {
-    return rktPartition_;
-  }
-
-  void rktSetPartition(int pc) {
-    rktPartition_ = pc;
-  }
-
   bool withhost() const { return withhost_; }
   bool withtime() const { return withtime_; }
   int timeidx() const { return timeidx_; }
+  int keyidx() const { return keyidx_; }
+  int packlines() const { return packlines_; }
+  bool kafkaheaders() const { return kafkaheaders_; }
+  size_t packsize() const { return packsize_ * 1024; }
   bool autonl() const { return autonl_; }
   bool md5sum() const { return md5sum_; }
+  bool mmapTail() const { return mmapTail_; }
+  int weight() const { return weight_; }
   const std::string &pkey() const { return pkey_; }
 
   const char *getStartPosition() const { return startPosition_.c_str(); }
@@ -106,6 +111,11 @@ public:
     return false;
   }
 
+  /* when getTimeFormatFile gives the next name */
+  time_t nextTimeFormatFile() const {
+    return sys::nextTimeFormat(cnf_->fasttime(), file_.c_str(), file_.size());
+  }
+
   void setTimeFormatFile(const std::string &timeFormatFile) {
     if (fileWithTimeFormat_) timeFormatFile_ = timeFormatFile;
   }
@@ -119,6 +129,10 @@ public:
     else return fileWithTimeFormat_ ? timeFormatFile_ : file_;
   }
 
+  /* rotated files are waiting, the reader is on the oldest of them */
+  bool backfill() const { return !fqueue_.empty(); }
+  const std::string *nextHistoryFile() const { return fqueue_.size() > 1 ? &fqueue_[1] : 0; }
+
   bool addHistoryFile(const std::string &historyFile);
   bool removeHistoryFile();
 
@@ -133,6 +147,22 @@ public:
   int holdFd() const { return holdFd_; }
   void holdFd(int fd) { holdFd_ = fd; }
 
+  int shard() const { return shard_; }
+  void shard(int id) { shard_ = id; }
+
+  /* file is a pattern, it has no reader, the matched files have */
+  GlobSource *glob() { return glob_; }
+  bool globFile() const { return globParent_ != 0; }
+
+  /* a file of the pattern, the chain shares the functions of the pattern */
+  LuaCtx *cloneGlobFile(FileReader *reader = 0);
+  bool initGlobFile(const std::string &file, bool created, char *errbuf);
+  void setGlobOff(FileOffRecord *fileOffRecord);
+
+  /* set when a task of the tail thread is queued, to skip duplicates */
+  int *tailPending() { return &tailPending_; }
+  int *removePending() { return &removePending_; }
+
 private:
   LuaCtx();
 
@@ -159,6 +189,10 @@ private:
   bool          withhost_;
   bool          withtime_;
   int           timeidx_;
+  int           keyidx_;
+  int           packlines_;
+  int           packsize_;
+  bool          kafkaheaders_;
   bool          autonl_;
   std::string   pkey_;
 
@@ -171,6 +205,8 @@ private:
   int           partition_;
   bool          rawcopy_;
   bool          md5sum_;
+  bool          mmapTail_;
+  int           weight_;
 
   LuaFunction  *function_;
   std::string   startPosition_;
@@ -180,9 +216,16 @@ private:
   CnfCtx       *cnf_;
   LuaHelper    *helper_;
 
+  GlobSource    *glob_;
+  LuaCtx        *globParent_;
+  FileOffRecord *globOff_;
+
   size_t rktId_;
-  int rktPartition_;
   int holdFd_;
+
+  int shard_;
+  int tailPending_;
+  int removePending_;
 };
 
 #endif
@@ -1,22 +1,33 @@
 #include <memory>
+#include <algorithm>
 #include <hs/hs.h>
+#include "logger.h"
 #include "util.h"
+#include "taskqueue.h"
+#include "readchunk.h"
 #include "luactx.h"
 #include "luafunction.h"
 
+#define MAX_LUA_WORKERS     16
+#define MIN_PARALLEL_LINES  64   // per worker
+
 class RegexFun {
 public:
   static RegexFun *create(const std::map<std::string, std::string> &cfg, char *errbuf);
   int match(const char *data, size_t len);
 
+  /* share the database, a scratch can not be used by two threads */
+  RegexFun *clone(char *errbuf) const;
+
   ~RegexFun() {
     hs_free_scratch(scratch_);
-    hs_free_database(re_);
+    if (own_) hs_free_database(re_);
   }
 
 private:
   hs_database_t *re_;
   hs_scratch_t *scratch_;
+  bool own_;
 };
 
 RegexFun * RegexFun::create(const std::map<std::string, std::string> &cfg, char *errbuf)
@@ -50,6 +61,22 @@ RegexFun * RegexFun::create(const std::map<std::string, std::string> &cfg, char
   RegexFun *fun = new RegexFun;
   fun->re_ = database;
   fun->scratch_ = scratch;
+  fun->own_ = true;
+  return fun;
+}
+
+RegexFun *RegexFun::clone(char *errbuf) const
+{
+  hs_scratch_t *scratch = NULL;
+  if (hs_clone_scratch(scratch_, &scratch) != HS_SUCCESS) {
+    snprintf(errbuf, MAX_ERR_LEN, "unable to clone scratch space");
+    return 0;
+  }
+
+  RegexFun *fun = new RegexFun;
+  fun->re_ = re_;
+  fun->scratch_ = scratch;
+  fun->own_ = false;
   return fun;
 }
 
@@ -69,8 +96,6 @@ int RegexFun::match(const char *data, size_t len)
   return found;
 }
 
-#define PADDING_LEN 13
-
 const char *LuaFunction::typeToString(Type type)
 {
   switch (type) {
@@ -118,7 +143,7 @@ LuaFunction *LuaFunction::create(LuaCtx *ctx, LuaHelper *helper, Type defType)
       fun = value;
       if (!ctx->cnf()->getLuaHelper()->getFunction(fun.c_str(), &value, "")) return 0;
       if (value == fun) {
-        function->init(ctx->cnf()->getLuaHelper(), value, types[i]);
+        function->init(ctx->cnf()->getLuaHelper(), value, types[i], ctx->cnf()->luaMutex());
       }
     }
   }
@@ -135,9 +160,31 @@ LuaFunction *LuaFunction::create(LuaCtx *ctx, LuaHelper *helper, Type defType)
     return 0;
   }
 
+  int luaWorkers;
+  if (!helper->getInt("luaworkers", &luaWorkers, 1)) return 0;
+  if (luaWorkers < 1 || luaWorkers > MAX_LUA_WORKERS) {
+    snprintf(errbuf, MAX_ERR_LEN, "%s luaworkers must be in [1, %d]", helper->file(), MAX_LUA_WORKERS);
+    return 0;
+  }
+  if (luaWorkers > 1) {
+    /* aggregate keeps state across lines, main.lua functions are shared */
+    if (function->type_ == AGGREGATE || function->mutex_) {
+      snprintf(errbuf, MAX_ERR_LEN, "%s luaworkers does not support aggregate or functions of main.lua",
+               helper->file());
+      return 0;
+    }
+    /* the workers would read the mapped lines outside the SIGBUS guard of the tail thread */
+    if (ctx->mmapTail()) {
+      snprintf(errbuf, MAX_ERR_LEN, "%s luaworkers can not be used with mmaptail", helper->file());
+      return 0;
+    }
+  }
+
   if (ctx->withhost()) {
-    if (function->type_ == KAFKAPLAIN || function->type_ == FILTER ||
-        function->type_ == GREP || function->type_ == TRANSFORM) {
+    if (ctx->packlines() > 0 || ctx->kafkaheaders()) {
+      function->extraSize_ = 0;   // see FileReader::packLines and KafkaCtx::produce
+    } else if (function->type_ == KAFKAPLAIN || function->type_ == FILTER ||
+               function->type_ == GREP || function->type_ == TRANSFORM) {
       function->extraSize_ = 1 + ctx->cnf()->host().size() + 1 + PADDING_LEN + 1;  // *host@off
     } else {
       function->extraSize_ = ctx->cnf()->host().size() + 1; // host
@@ -146,9 +193,49 @@ LuaFunction *LuaFunction::create(LuaCtx *ctx, LuaHelper *helper, Type defType)
     function->extraSize_ = 0;
   }
 
+  for (int i = 1; i < luaWorkers; ++i) {
+    LuaFunction *worker = function->clone(errbuf);
+    if (!worker) return 0;
+    function->workers_.push_back(worker);
+  }
+  if (!function->workers_.empty()) function->pool_ = new util::TaskQueue("lua");
+
+  return function.release();
+}
+
+LuaFunction *LuaFunction::clone(char *errbuf) const
+{
+  std::auto_ptr<LuaHelper> helper(new LuaHelper);
+  if (!helper->dofile(helper_->file(), errbuf)) return 0;
+
+  std::auto_ptr<LuaFunction> function(new LuaFunction(ctx_));
+  if (matchFun_ && !(function->matchFun_ = matchFun_->clone(errbuf))) return 0;
+
+  function->init(helper.release(), funName_, type_);
+  function->ownHelper_ = true;
+  function->filters_   = filters_;
+  function->extraSize_ = extraSize_;
   return function.release();
 }
 
+LuaFunction::~LuaFunction()
+{
+  if (pool_) delete pool_;
+  for (std::vector<LuaFunction *>::iterator ite = workers_.begin(); ite != workers_.end(); ++ite) {
+    delete *ite;
+  }
+
+  if (matchFun_) delete matchFun_;
+  if (ownHelper_) delete helper_;
+}
+
+/* a packed line has the host and offset in the header of its pack,
+ * with kafkaheaders they are kafka headers
+ */
+inline bool hostPrefix(const LuaCtx *ctx, off_t off) {
+  return ctx->withhost() && !ctx->kafkaheaders() && (off == (off_t) -1 || ctx->packlines() == 0);
+}
+
 inline std::string *addHost(std::string *ptr, const std::string &host, off_t off, bool space) {
   ptr->append(1, '*').append(host);
   if (off != (off_t) -1) ptr->append(1, '@').append(util::toStr(off, PADDING_LEN));
@@ -158,8 +245,9 @@ inline std::string *addHost(std::string *ptr, const std::string &host, off_t off
 
 int LuaFunction::filter(off_t off, const std::vector<std::string> &fields, std::vector<FileRecord *> *records)
 {
-  std::string *result = new std::string;
-  if (ctx_->withhost()) result = addHost(result, ctx_->cnf()->host(), off, false);
+  FileRecord *record = FileRecord::create(0, off);
+  std::string *result = record->payload();
+  if (hostPrefix(ctx_, off)) result = addHost(result, ctx_->cnf()->host(), off, false);
 
   for (std::vector<int>::iterator ite = filters_.begin(), end = filters_.end();
        ite != end; ++ite) {
@@ -170,7 +258,7 @@ int LuaFunction::filter(off_t off, const std::vector<std::string> &fields, std::
     result->append(fields[idx]);
   }
 
-  records->push_back(FileRecord::create(0, off, result));
+  records->push_back(record);
   return 1;
 }
 
@@ -179,14 +267,15 @@ int LuaFunction::grep(off_t off, const std::vector<std::string> &fields, std::ve
   if (!helper_->call(funName_.c_str(), fields, 1)) return -1;
   if (helper_->callResultNil()) return 0;
 
-  std::string *result = new std::string;
-  if (ctx_->withhost()) result = addHost(result, ctx_->cnf()->host(), off, true);
+  FileRecord *record = FileRecord::create(0, off);
+  std::string *result = record->payload();
+  if (hostPrefix(ctx_, off)) result = addHost(result, ctx_->cnf()->host(), off, true);
 
   if (helper_->callResultListAsString(funName_.c_str(), result)) {
-    records->push_back(FileRecord::create(0, off, result));
+    records->push_back(record);
     return 1;
   } else {
-    delete result;
+    FileRecord::destroy(record);
     return -1;
   }
 }
@@ -196,27 +285,38 @@ int LuaFunction::transform(off_t off, const char *line, size_t nline, std::vecto
   if (!helper_->call(funName_.c_str(), line, nline)) return -1;
   if (helper_->callResultNil()) return 0;
 
-  std::string *result = new std::string;
-  if (ctx_->withhost()) result = addHost(result, ctx_->cnf()->host(), off, true);
+  FileRecord *record = FileRecord::create(0, off);
+  std::string *result = record->payload();
+  if (hostPrefix(ctx_, off)) result = addHost(result, ctx_->cnf()->host(), off, true);
 
   if (helper_->callResultString(funName_.c_str(), result, true)) {
-    records->push_back(FileRecord::create(0, off, result));
+    records->push_back(record);
     return 1;
   } else {
-    delete result;
+    FileRecord::destroy(record);
     return -1;
   }
 }
 
-int LuaFunction::kafkaPlain(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records)
+/* a line of the read chunk is sent as it is, unless it needs the host prefix */
+int LuaFunction::kafkaPlain(off_t off, const char *line, size_t nline, ReadChunk *chunk,
+                            std::vector<FileRecord *> *records)
 {
-  std::string *ptr = new std::string;
+  FileRecord *record = FileRecord::create(0, off);
+
+  if (chunk && !hostPrefix(ctx_, off) && (!ctx_->autonl() || line[nline] == '\n')) {
+    record->reference(chunk, line, nline + (ctx_->autonl() ? 1 : 0));
+    records->push_back(record);
+    return 1;
+  }
 
-  if (ctx_->withhost()) addHost(ptr, ctx_->cnf()->host(), off, true);
+  std::string *ptr = record->payload();
+
+  if (hostPrefix(ctx_, off)) addHost(ptr, ctx_->cnf()->host(), off, true);
   ptr->append(line, nline);
   if (ctx_->autonl()) ptr->append(1, '\n');
 
-  records->push_back(FileRecord::create(0, off, ptr));
+  records->push_back(record);
   return 1;
 }
 
@@ -225,15 +325,13 @@ int LuaFunction::indexdoc(off_t off, const char *line, size_t nline, std::vector
   if (!helper_->call(funName_.c_str(), line, nline, 2)) return -1;
   if (helper_->callResultNil()) return 0;
 
-  std::string *index = new std::string;
-  std::string *doc = new std::string;
+  FileRecord *record = FileRecord::create(0, off);
 
-  if (helper_->callResultString(funName_.c_str(), index, doc)) {
-    records->push_back(FileRecord::create(0, off, index, doc));
+  if (helper_->callResultString(funName_.c_str(), record->index(), record->payload())) {
+    records->push_back(record);
     return 1;
   } else {
-    delete index;
-    delete doc;
+    FileRecord::destroy(record);
     return -1;
   }
 }
@@ -287,10 +385,15 @@ int LuaFunction::esPlain(off_t off, const char *line, size_t nline, std::vector<
     esIndex.assign(buf, n);
   }
 
-  std::string *doc = 0, *index = 0;
+  FileRecord *record = 0;
+  std::string *doc, *index;
   if (esDocPos == 1) {
-    index = new std::string(esIndex);
-    doc = new std::string(line, nline);
+    record = FileRecord::create(0, off);
+    index = record->index();
+    doc = record->payload();
+
+    index->assign(esIndex);
+    doc->assign(line, nline);
   } else {
     std::vector<std::string> v;
     splitn(line, nline, &v, esDocPos);
@@ -298,28 +401,30 @@ int LuaFunction::esPlain(off_t off, const char *line, size_t nline, std::vector<
       return -1;
     }
 
+    record = FileRecord::create(0, off);
+    index = record->index();
+    doc = record->payload();
+
     if (esIndexPos > 0) {
-      index = new std::string(v[esIndexPos-1] + esIndex);
+      index->assign(v[esIndexPos-1]).append(esIndex);
     } else {
-      index = new std::string(esIndex);
+      index->assign(esIndex);
     }
     if (esDocDataFormat == ESDOC_DATAFORMAT_NGINX_LOG) {
-      doc = new std::string;
       transformEsDocNginxLog(v[esDocPos-1], doc);
 			if (doc->compare("-") == 0) doc->clear();
     } else if (esDocDataFormat == ESDOC_DATAFORMAT_NGINX_JSON) {
-      doc = new std::string;
       transformEsDocNginxJson(v[esDocPos-1], doc);
 			if (doc->compare("-") == 0) doc->clear();
     } else {
-      doc = new std::string(v[esDocPos-1]);
+      doc->assign(v[esDocPos-1]);
     }
   }
 
 	if (doc->empty()) {
-		delete doc;
+		FileRecord::destroy(record);
 	} else {
-		records->push_back(FileRecord::create(0, off, index, doc));
+		records->push_back(record);
 	}
   return 0;
 }
@@ -331,7 +436,8 @@ int LuaFunction::serializeCache(std::vector<FileRecord *> *records)
   int n = 0;
   for (std::map<std::string, std::map<std::string, int> >::iterator ite = aggregateCache_.begin();
        ite != aggregateCache_.end(); ++ite) {
-    std::string *s = new std::string;
+    FileRecord *record = FileRecord::create(0, -1);
+    std::string *s = record->payload();
     if (ctx_->withhost()) s->append(ctx_->host()).append(1, ' ');
     if (ctx_->withtime()) s->append(lasttime_).append(1, ' ');
 
@@ -339,7 +445,7 @@ int LuaFunction::serializeCache(std::vector<FileRecord *> *records)
     for (std::map<std::string, int>::iterator jte = ite->second.begin(); jte != ite->second.end(); ++jte) {
       s->append(1, ' ').append(jte->first).append(1, '=').append(util::toStr(jte->second));
     }
-    records->push_back(FileRecord::create(0, -1, s));
+    records->push_back(record);
     ++n;
   }
   aggregateCache_.clear();
@@ -370,7 +476,52 @@ int LuaFunction::aggregate(const std::vector<std::string> &fields, std::vector<F
   return n;
 }
 
-int LuaFunction::process(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records)
+int LuaFunction::processFields(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records)
+{
+  std::vector<std::string> fields;
+  split(line, nline, &fields);
+
+  if (ctx_->timeidx() >= 0) {
+    int idx = absidx(ctx_->timeidx(), fields.size());
+    if (idx < 0 || (size_t) idx >= fields.size()) return false;
+    timeLocalToIso8601(fields[idx], &fields[idx]);
+  }
+
+  if (type_ == AGGREGATE) {
+    return aggregate(fields, records);
+  } else if (type_ == GREP) {
+    return grep(off, fields, records);
+  } else if (type_ == FILTER) {
+    return filter(off, fields, records);
+  } else {
+    return 0;
+  }
+}
+
+int LuaFunction::process(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records,
+                         ReadChunk *chunk)
+{
+  if (mutex_) pthread_mutex_lock(mutex_);
+  int n = processLine(off, line, nline, records, chunk);
+  if (mutex_) pthread_mutex_unlock(mutex_);
+
+  if (n > 0 && ctx_->keyidx() != 0) setKey(records->back(), line, nline);
+  return n;
+}
+
+/* the key is a field of the raw line, a line without it gets an empty key */
+void LuaFunction::setKey(FileRecord *record, const char *line, size_t nline)
+{
+  const char *field = line;
+  size_t len = 0;
+  splitField(line, nline, ctx_->keyidx(), &field, &len);
+
+  record->keyBuffer()->assign(field, len);
+  record->keyHash = util::hash(field, len);
+}
+
+int LuaFunction::processLine(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records,
+                             ReadChunk *chunk)
 {
   if (matchFun_) {
     int cnt = matchFun_->match(line, nline);
@@ -382,29 +533,186 @@ int LuaFunction::process(off_t off, const char *line, size_t nline, std::vector<
   } else if (type_ == INDEXDOC) {
     return indexdoc(off, line, nline, records);
   } else if (type_ == AGGREGATE || type_ == GREP || type_ == FILTER) {
-    std::vector<std::string> fields;
-    split(line, nline, &fields);
-
-    if (ctx_->timeidx() >= 0) {
-      int idx = absidx(ctx_->timeidx(), fields.size());
-      if (idx < 0 || (size_t) idx >= fields.size()) return false;
-      timeLocalToIso8601(fields[idx], &fields[idx]);
-    }
-
-    if (type_ == AGGREGATE) {
-      return aggregate(fields, records);
-    } else if (type_ == GREP) {
-      return grep(off, fields, records);
-    } else if (type_ == FILTER) {
-      return filter(off, fields, records);
-    } else {
-      return 0;
-    }
+    return processFields(off, line, nline, records);
   } else if (type_ == KAFKAPLAIN) {
-    return kafkaPlain(off, line, nline, records);
+    return kafkaPlain(off, line, nline, chunk, records);
   } else if (type_ == ESPLAIN) {
     return esPlain(off, line, nline, records);
   } else {
     return 0;
   }
 }
+
+/* the type is dispatched once per batch, empty lines are ignored
+ * lines [first, last) of data, line i ends at ends[i]
+ */
+#define FOREACH_LINE(call) do {                                        \
+  size_t start = (first == 0) ? 0 : ends[first-1] + 1;                 \
+  for (size_t i = first; i < last; start = ends[i] + 1, ++i) {         \
+    const char *line = data + start;                                   \
+    size_t nline = ends[i] - start;                                    \
+    if (nline == 0) continue;                                          \
+                                                                       \
+    ++(*nread);                                                        \
+    if (matchFun_ && matchFun_->match(line, nline) <= 0) continue;     \
+                                                                       \
+    off_t loff = (off == (off_t) -1) ? (off_t) -1 : off + start;       \
+    if (call > 0) {                                                    \
+      ++n;                                                             \
+      if (keyidx) setKey(records->back(), line, nline);                \
+    }                                                                  \
+  }                                                                    \
+} while (0)
+
+int LuaFunction::processBatch(off_t off, const char *data, const uint32_t *ends, size_t first, size_t last,
+                              ReadChunk *chunk, std::vector<FileRecord *> *records, int *nread)
+{
+  int n = 0;
+  int keyidx = ctx_->keyidx();
+
+  switch (type_) {
+  case KAFKAPLAIN:
+    FOREACH_LINE(kafkaPlain(loff, line, nline, chunk, records));
+    break;
+  case TRANSFORM:
+    FOREACH_LINE(transform(loff, line, nline, records));
+    break;
+  case INDEXDOC:
+    FOREACH_LINE(indexdoc(loff, line, nline, records));
+    break;
+  case ESPLAIN:
+    FOREACH_LINE(esPlain(loff, line, nline, records));
+    break;
+  case AGGREGATE:
+  case GREP:
+  case FILTER:
+    FOREACH_LINE(processFields(loff, line, nline, records));
+    break;
+  default:
+    assert(0);
+    break;
+  }
+  return n;
+}
+
+#undef FOREACH_LINE
+
+/* one contiguous part of a batch, run by a worker of the pool */
+struct LuaBatch {
+  off_t            off;
+  const char      *data;
+  const uint32_t  *ends;
+  ReadChunk       *chunk;
+
+  std::vector<size_t>                      bounds;   // part k is [bounds[k], bounds[k+1])
+  std::vector<std::vector<FileRecord *> *>  records;
+  std::vector<int>                         n;
+  std::vector<int>                         nread;
+
+  int              pending;
+  pthread_mutex_t  mutex;
+  pthread_cond_t   cond;
+};
+
+class LuaBatchTask : public util::TaskQueue::Task {
+public:
+  LuaBatchTask(LuaFunction *function, LuaBatch *batch, size_t k)
+    : function_(function), batch_(batch), k_(k) {}
+
+  bool doIt() {
+    LuaBatch *b = batch_;
+    b->n[k_] = function_->processBatch(b->off, b->data, b->ends, b->bounds[k_], b->bounds[k_+1],
+                                       b->chunk, b->records[k_], &b->nread[k_]);
+
+    pthread_mutex_lock(&b->mutex);
+    if (--b->pending == 0) pthread_cond_signal(&b->cond);
+    pthread_mutex_unlock(&b->mutex);
+    return true;
+  }
+
+private:
+  LuaFunction *function_;
+  LuaBatch    *batch_;
+  size_t       k_;
+};
+
+/* the pool starts on first use, tail2kafka may fork after the config is loaded */
+bool LuaFunction::startPool()
+{
+  if (poolStarted_) return true;
+  if (!pool_) return false;
+
+  char errbuf[1024];
+  if (!pool_->start(errbuf, workers_.size())) {
+    log_fatal(0, "%s start lua workers error, %s", helper_->file(), errbuf);
+    delete pool_;
+    pool_ = 0;
+    return false;
+  }
+
+  poolStarted_ = true;
+  return true;
+}
+
+/* part 0 runs in the caller with this lua_State, the others in the pool,
+ * the records are appended in line order so the offsets stay monotonic
+ */
+int LuaFunction::processParallel(off_t off, const char *data, const uint32_t *ends, size_t nend, ReadChunk *chunk,
+                                 std::vector<FileRecord *> *records, int *nread)
+{
+  size_t parts = workers_.size() + 1;
+  size_t per = (nend + parts - 1) / parts;
+
+  LuaBatch batch;
+  batch.off  = off;
+  batch.data = data;
+  batch.ends = ends;
+  batch.chunk = chunk;
+  for (size_t k = 0; k < parts; ++k) batch.bounds.push_back(std::min(k * per, nend));
+  batch.bounds.push_back(nend);
+  batch.records.push_back(records);
+  for (size_t k = 1; k < parts; ++k) batch.records.push_back(FileRecord::createVector());
+  batch.n.resize(parts, 0);
+  batch.nread.resize(parts, 0);
+
+  batch.pending = parts - 1;
+  pthread_mutex_init(&batch.mutex, 0);
+  pthread_cond_init(&batch.cond, 0);
+
+  for (size_t k = 1; k < parts; ++k) pool_->submit(new LuaBatchTask(workers_[k-1], &batch, k));
+  batch.n[0] = processBatch(off, data, ends, batch.bounds[0], batch.bounds[1], chunk, records, &batch.nread[0]);
+
+  pthread_mutex_lock(&batch.mutex);
+  while (batch.pending > 0) pthread_cond_wait(&batch.cond, &batch.mutex);
+  pthread_mutex_unlock(&batch.mutex);
+
+  pthread_mutex_destroy(&batch.mutex);
+  pthread_cond_destroy(&batch.cond);
+
+  int n = batch.n[0];
+  *nread += batch.nread[0];
+  for (size_t k = 1; k < parts; ++k) {
+    records->insert(records->end(), batch.records[k]->begin(), batch.records[k]->end());
+    FileRecord::destroyVector(batch.records[k]);
+    n += batch.n[k];
+    *nread += batch.nread[k];
+  }
+  return n;
+}
+
+int LuaFunction::process(off_t off, const char *data, const uint32_t *ends, size_t nend,
+                         std::vector<FileRecord *> *records, ReadChunk *chunk)
+{
+  int n, nread = 0;
+
+  if (!workers_.empty() && nend >= MIN_PARALLEL_LINES * (workers_.size() + 1) && startPool()) {
+    n = processParallel(off, data, ends, nend, chunk, records, &nread);
+  } else {
+    if (mutex_) pthread_mutex_lock(mutex_);
+    n = processBatch(off, data, ends, 0, nend, chunk, records, &nread);
+    if (mutex_) pthread_mutex_unlock(mutex_);
+  }
+
+  ctx_->cnf()->stats()->logReadInc(nread);
+  return n;
+}
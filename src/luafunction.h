@@ -3,21 +3,38 @@
 
 #include <string>
 #include <vector>
+#include <stdint.h>
 #include <sys/types.h>
+#include <pthread.h>
 
 #include "luahelper.h"
 #include "luactx.h"
 #include "filerecord.h"
 
+/* digits of the offset after *host@ and &host@ */
+#define PADDING_LEN 13
+
 class RegexFun;
+class LuaBatchTask;
+namespace util { class TaskQueue; }
 
 class LuaFunction {
   template<class T> friend class UNITTEST_HELPER;
+  friend class LuaBatchTask;
 public:
   enum Type { FILTER, GREP, TRANSFORM, AGGREGATE, INDEXDOC, KAFKAPLAIN, ESPLAIN, NIL };
 
   static LuaFunction *create(LuaCtx *ctx, LuaHelper *helper, Type defType);
-  int process(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records);
+  ~LuaFunction();
+  /* line is in chunk if it is not 0, the kafkaplain records refer to it */
+  int process(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records,
+              ReadChunk *chunk = 0);
+
+  /* lines in data end at ends[0..nend), as util::scanLines returns
+   * return the number of lines which produce records
+   */
+  int process(off_t off, const char *data, const uint32_t *ends, size_t nend,
+              std::vector<FileRecord *> *records, ReadChunk *chunk = 0);
   int serializeCache(std::vector<FileRecord *> *records);
 
   Type getType() const { return type_; }
@@ -26,18 +43,33 @@ public:
 private:
   static const char *typeToString(Type type);
 
-  LuaFunction(LuaCtx *ctx) : ctx_(ctx), helper_(0), type_(NIL) {}
-  void init(LuaHelper *helper, const std::string &funName, Type type) {
+  LuaFunction(LuaCtx *ctx) : ctx_(ctx), helper_(0), ownHelper_(false), type_(NIL), mutex_(0),
+                             matchFun_(0), pool_(0), poolStarted_(false) {}
+  void init(LuaHelper *helper, const std::string &funName, Type type, pthread_mutex_t *mutex = 0) {
     helper_  = helper;
     funName_ = funName;
     type_    = type;
+    mutex_   = mutex;
   }
 
+  /* a copy with its own lua_State loaded from the same file */
+  LuaFunction *clone(char *errbuf) const;
+
+  int processLine(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records,
+                  ReadChunk *chunk);
+  int processBatch(off_t off, const char *data, const uint32_t *ends, size_t first, size_t last,
+                   ReadChunk *chunk, std::vector<FileRecord *> *records, int *nread);
+  int processParallel(off_t off, const char *data, const uint32_t *ends, size_t nend, ReadChunk *chunk,
+                      std::vector<FileRecord *> *records, int *nread);
+  bool startPool();
+  void setKey(FileRecord *record, const char *line, size_t nline);
+
+  int processFields(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records);
   int filter(off_t off, const std::vector<std::string> &fields, std::vector<FileRecord *> *records);
   int grep(off_t off, const std::vector<std::string> &fields, std::vector<FileRecord *> *records);
   int transform(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records);
   int aggregate(const std::vector<std::string> &fields, std::vector<FileRecord *> *records);
-  int kafkaPlain(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records);
+  int kafkaPlain(off_t off, const char *line, size_t nline, ReadChunk *chunk, std::vector<FileRecord *> *records);
 
   int indexdoc(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records);
   int esPlain(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records);
@@ -48,13 +80,20 @@ private:
 private:
   LuaCtx      *ctx_;
   LuaHelper   *helper_;
+  bool         ownHelper_;  // helper_ of the clones
   std::string funName_;
   Type        type_;
+  pthread_mutex_t *mutex_;   // helper_ is shared by the tail threads
   size_t      extraSize_;
 
   std::vector<int> filters_;
   RegexFun *matchFun_;
 
+  /* luaworkers > 1, the batches are split between this and the clones */
+  std::vector<LuaFunction *> workers_;
+  util::TaskQueue           *pool_;
+  bool                       poolStarted_;
+
   std::string                                        lasttime_;
   std::map<std::string, std::map<std::string, int> > aggregateCache_;
 };
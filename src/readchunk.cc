@@ -0,0 +1,65 @@
+#include <pthread.h>
+
+#include "readchunk.h"
+
+struct PooledBuffer {
+  char   *data;
+  size_t  capacity;
+};
+
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static PooledBuffer    pool[CHUNK_POOL_SIZE];
+static size_t          npool = 0;
+static int64_t         pinned = 0;
+
+ReadChunk *ReadChunk::create(size_t capacity)
+{
+  char *data = 0;
+
+  pthread_mutex_lock(&poolMutex);
+  for (size_t i = npool; i > 0; --i) {
+    if (pool[i-1].capacity == capacity) {
+      data = pool[i-1].data;
+      pool[i-1] = pool[--npool];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&poolMutex);
+
+  if (!data) data = new char[capacity];
+  return new ReadChunk(data, capacity, false);
+}
+
+void ReadChunk::release()
+{
+  if (!mmap_ && shared()) {
+    pinned_ = true;
+    util::atomic_inc(&pinned, (int) capacity_);
+  }
+  unref();
+}
+
+int64_t ReadChunk::pinnedBytes()
+{
+  return util::atomic_get(&pinned);
+}
+
+ReadChunk::~ReadChunk()
+{
+  if (pinned_) util::atomic_dec(&pinned, (int) capacity_);
+  if (mmap_) {
+    munmap(data_, capacity_);
+    return;
+  }
+
+  pthread_mutex_lock(&poolMutex);
+  if (npool < CHUNK_POOL_SIZE) {
+    pool[npool].data = data_;
+    pool[npool].capacity = capacity_;
+    ++npool;
+    data_ = 0;
+  }
+  pthread_mutex_unlock(&poolMutex);
+
+  if (data_) delete[] data_;
+}
@@ -0,0 +1,62 @@
+#ifndef _READ_CHUNK_H_
+#define _READ_CHUNK_H_
+
+#include <cstddef>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "gnuatomic.h"
+
+#define CHUNK_POOL_SIZE 8
+
+/* file content read once and shared by all the readers of one file,
+ * the memory is unmapped or kept for reuse when the last reference is
+ * released. a reader gets a new chunk each time records still hold the
+ * old one, the pool keeps up to CHUNK_POOL_SIZE released buffers so that
+ * does not allocate and fault in a new 8M buffer on every read. the
+ * buffers left by their reader and held only by records are pinned, see
+ * CnfCtx::flowControlOn
+ */
+class ReadChunk {
+public:
+  static ReadChunk *create(size_t capacity);
+
+  static ReadChunk *createMmap(void *addr, size_t length) {
+    return new ReadChunk((char *) addr, length, true);
+  }
+
+  ReadChunk *ref() {
+    util::atomic_inc(&refs_);
+    return this;
+  }
+
+  void unref() {
+    if (util::atomic_dec(&refs_) == 0) delete this;
+  }
+
+  /* the reader drops the chunk, the records may still hold it */
+  void release();
+
+  /* bytes of the buffers held only by records */
+  static int64_t pinnedBytes();
+
+  /* someone else holds the chunk, it must not be written */
+  bool shared() { return util::atomic_get(&refs_) > 1; }
+
+  char *data() { return data_; }
+  size_t capacity() const { return capacity_; }
+
+private:
+  ReadChunk(char *data, size_t capacity, bool mmaped)
+    : data_(data), capacity_(capacity), mmap_(mmaped), pinned_(false), refs_(1) {}
+
+  ~ReadChunk();
+
+  char   *data_;
+  size_t  capacity_;
+  bool    mmap_;
+  bool    pinned_;
+  int     refs_;
+};
+
+#endif
@@ -0,0 +1,95 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+#include "logger.h"
+#include "common.h"
+#include "cnfctx.h"
+#include "luactx.h"
+#include "filereader.h"
+#include "sink.h"
+
+static void ackRecords(std::vector<FileRecord *> *records)
+{
+  for (std::vector<FileRecord *>::iterator ite = records->begin(); ite != records->end(); ++ite) {
+    (*ite)->ctx->getFileReader()->updateFileOffRecord(*ite);
+    FileRecord::destroy(*ite);
+  }
+}
+
+bool NullSink::produce(std::vector<FileRecord *> *records)
+{
+  cnf_->stats()->logRecvInc(records->size());
+  ackRecords(records);
+  return true;
+}
+
+FileSink::~FileSink()
+{
+  if (fd_ != -1) close(fd_);
+}
+
+bool FileSink::init(const std::string &file, char *errbuf)
+{
+  fd_ = open(file.c_str(), O_CREAT | O_WRONLY | O_APPEND, 0644);
+  if (fd_ == -1) {
+    snprintf(errbuf, MAX_ERR_LEN, "open sinkfile %s error, %s", file.c_str(), strerror(errno));
+    return false;
+  }
+  file_ = file;
+  return true;
+}
+
+void FileSink::dropRecord(FileRecord *record)
+{
+  cnf_->stats()->queueSizeDec();
+  cnf_->stats()->logErrorInc();
+  record->ctx->getFileReader()->dropFileRecord(record);
+  FileRecord::destroy(record);
+}
+
+/* on a failed write the records written before it are acked, the rest
+ * are dropped, as kafka does with a message it can not deliver
+ */
+bool FileSink::produce(std::vector<FileRecord *> *records)
+{
+  cnf_->stats()->logRecvInc(records->size());
+
+  struct iovec iovs[IOV_MAX];
+  for (size_t start = 0; start < records->size(); start += IOV_MAX) {
+    size_t iovcnt = std::min(records->size() - start, (size_t) IOV_MAX);
+
+    ssize_t wantn = 0;
+    for (size_t i = 0; i < iovcnt; ++i) {
+      FileRecord *record = (*records)[start + i];
+      iovs[i].iov_base = (void *) record->ptr();
+      iovs[i].iov_len  = record->len();
+      wantn += record->len();
+    }
+
+    ssize_t n = writev(fd_, iovs, iovcnt);
+    if (n != wantn) {
+      log_fatal(errno, "writev %s error, %ld of %ld bytes", file_.c_str(), (long) n, (long) wantn);
+
+      /* the records written in whole by the short write */
+      size_t written = start;
+      for (ssize_t left = std::max(n, (ssize_t) 0); written < start + iovcnt; ++written) {
+        left -= (*records)[written]->len();
+        if (left < 0) break;
+      }
+
+      std::vector<FileRecord *> acked(records->begin(), records->begin() + written);
+      ackRecords(&acked);
+      for (size_t i = written; i < records->size(); ++i) dropRecord((*records)[i]);
+      return false;
+    }
+  }
+
+  ackRecords(records);
+  return true;
+}
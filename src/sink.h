@@ -0,0 +1,60 @@
+#ifndef _SINK_H_
+#define _SINK_H_
+
+#include <string>
+#include <vector>
+
+#include "filerecord.h"
+class CnfCtx;
+
+/* where routine sends the records to, kafka, es or a local one for
+ * benchmarks. the sink owns the records it gets, every record goes
+ * through FileReader::updateFileOffRecord when it is acked
+ */
+class Sink {
+public:
+  virtual ~Sink() {}
+
+  /* false if the sink is unavailable, tail2kafka exits */
+  virtual bool produce(std::vector<FileRecord *> *records) = 0;
+
+  /* serve the acks, at most timeout ms */
+  virtual void poll(int /*timeout*/) {}
+
+  /* send what waits to be retried or in the spool, false as produce() */
+  virtual bool drain() { return true; }
+  virtual bool backlog() const { return false; }
+
+  virtual const char *name() const = 0;
+};
+
+/* acks at once, the throughput of the tail path alone */
+class NullSink : public Sink {
+public:
+  NullSink(CnfCtx *cnf) : cnf_(cnf) {}
+  bool produce(std::vector<FileRecord *> *records);
+  const char *name() const { return "null"; }
+
+private:
+  CnfCtx *cnf_;
+};
+
+/* appends the payloads to a file and acks after write() */
+class FileSink : public Sink {
+public:
+  FileSink(CnfCtx *cnf) : cnf_(cnf), fd_(-1) {}
+  ~FileSink();
+
+  bool init(const std::string &file, char *errbuf);
+  bool produce(std::vector<FileRecord *> *records);
+  const char *name() const { return "file"; }
+
+private:
+  void dropRecord(FileRecord *record);
+
+  CnfCtx      *cnf_;
+  std::string  file_;
+  int          fd_;
+};
+
+#endif
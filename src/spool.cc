@@ -0,0 +1,206 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "logger.h"
+#include "common.h"
+#include "sys.h"
+#include "spool.h"
+
+#define FRAME_HEADER_SIZE sizeof(Frame)
+
+Spool::~Spool()
+{
+  /* the records left are not acked, they are read again after the restart */
+  if (front_) FileRecord::destroy(front_);
+  while (!segments_.empty()) closeSegment();
+}
+
+bool Spool::init(const std::string &dir, size_t maxSize, char *errbuf)
+{
+  if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    snprintf(errbuf, MAX_ERR_LEN, "mkdir %s error, %s", dir.c_str(), strerror(errno));
+    return false;
+  }
+
+  std::vector<std::string> files;
+  if (!sys::readdir(dir.c_str(), ".spool", &files, errbuf)) return false;
+  for (std::vector<std::string>::iterator ite = files.begin(); ite != files.end(); ++ite) {
+    if (unlink(ite->c_str()) != 0) {
+      snprintf(errbuf, MAX_ERR_LEN, "unlink %s error, %s", ite->c_str(), strerror(errno));
+      return false;
+    }
+  }
+
+  dir_ = dir;
+  maxSize_ = maxSize;
+  return true;
+}
+
+bool Spool::openSegment()
+{
+  char file[1024];
+  snprintf(file, 1024, "%s/%lu.spool", dir_.c_str(), (unsigned long) seq_);
+
+  int fd = open(file, O_CREAT | O_RDWR | O_TRUNC, 0644);
+  if (fd == -1) {
+    log_fatal(errno, "open spool %s error", file);
+    return false;
+  }
+  ++seq_;
+
+  Segment segment = {file, fd, 0};
+  segments_.push_back(segment);
+  return true;
+}
+
+void Spool::closeSegment()
+{
+  Segment &segment = segments_.front();
+  close(segment.fd);
+  unlink(segment.file.c_str());
+
+  if (segments_.size() == 1) buffer_.clear();
+  segments_.pop_front();
+  readOff_ = 0;
+}
+
+/* the buffer is kept on error, the next flush writes it at the same place */
+bool Spool::flush()
+{
+  if (buffer_.empty()) return true;
+
+  Segment &segment = segments_.back();
+  off_t off = segment.size - buffer_.size();
+
+  size_t n = 0;
+  while (n < buffer_.size()) {
+    ssize_t nn = pwrite(segment.fd, buffer_.data() + n, buffer_.size() - n, off + n);
+    if (nn == -1) {
+      if (errno == EINTR) continue;
+      log_fatal(errno, "write spool %s error", segment.file.c_str());
+      return false;
+    }
+    n += nn;
+  }
+
+  buffer_.clear();
+  return true;
+}
+
+bool Spool::push(FileRecord *record)
+{
+  Frame header;
+  memset(&header, 0, sizeof(header));
+  header.len     = record->len();
+  header.keyLen  = record->key ? record->key->size() : 0;
+  header.ctx     = (uint64_t) (uintptr_t) record->ctx;
+  header.inode   = record->inode;
+  header.off     = record->off;
+  header.seq     = record->seq;
+  header.time    = record->time;
+  header.keyHash = record->keyHash;
+  header.hasKey  = record->key != 0;
+
+  size_t frame = FRAME_HEADER_SIZE + header.keyLen + header.len;
+  if (size_ + frame > maxSize_) return false;
+
+  if (buffer_.size() + frame > SPOOL_BUFFER_SIZE && !flush()) return false;
+  if (segments_.empty() ||
+      (segments_.back().size > 0 && segments_.back().size + (off_t) frame > SPOOL_SEGMENT_SIZE)) {
+    if (!flush() || !openSegment()) return false;
+  }
+
+  buffer_.append((const char *) &header, FRAME_HEADER_SIZE);
+  if (record->key) buffer_.append(*record->key);
+  buffer_.append(record->ptr(), header.len);
+  segments_.back().size += frame;
+
+  if (records_ == 0) log_info(0, "spool starts at %s", segments_.back().file.c_str());
+
+  ++records_;
+  size_ += frame;
+
+  FileRecord::destroy(record);
+  return true;
+}
+
+static bool preadAll(int fd, char *buf, size_t len, off_t off)
+{
+  size_t n = 0;
+  while (n < len) {
+    ssize_t nn = pread(fd, buf + n, len - n, off + n);
+    if (nn == -1 && errno == EINTR) continue;
+    if (nn <= 0) return false;
+    n += nn;
+  }
+  return true;
+}
+
+bool Spool::front(FileRecord **record)
+{
+  assert(records_ > 0);
+
+  if (front_) {
+    *record = front_;
+    return true;
+  }
+
+  if (segments_.size() == 1 && !flush()) return false;
+  const Segment &segment = segments_.front();
+
+  Frame header;
+  if (!preadAll(segment.fd, (char *) &header, FRAME_HEADER_SIZE, readOff_)) {
+    log_fatal(errno, "read spool %s at %ld error", segment.file.c_str(), (long) readOff_);
+    return false;
+  }
+  off_t off = readOff_ + FRAME_HEADER_SIZE;
+
+  FileRecord *frame = FileRecord::create(header.inode, header.off);
+  frame->ctx     = (LuaCtx *) (uintptr_t) header.ctx;
+  frame->seq     = header.seq;
+  frame->time    = header.time;
+  frame->keyHash = header.keyHash;
+
+  bool rc = true;
+  if (header.hasKey) {
+    std::string *key = frame->keyBuffer();
+    key->resize(header.keyLen);
+    if (header.keyLen > 0) rc = preadAll(segment.fd, &(*key)[0], header.keyLen, off);
+    off += header.keyLen;
+  }
+
+  std::string *payload = frame->payload();
+  payload->resize(header.len);
+  if (rc && header.len > 0) rc = preadAll(segment.fd, &(*payload)[0], header.len, off);
+
+  if (!rc) {
+    log_fatal(errno, "read spool %s at %ld error", segment.file.c_str(), (long) readOff_);
+    FileRecord::destroy(frame);
+    return false;
+  }
+
+  front_ = frame;
+  frontSize_ = FRAME_HEADER_SIZE + header.keyLen + header.len;
+  *record = front_;
+  return true;
+}
+
+void Spool::pop()
+{
+  assert(front_);
+
+  front_ = 0;
+  --records_;
+  size_ -= frontSize_;
+  readOff_ += frontSize_;
+
+  if (readOff_ == segments_.front().size && (segments_.size() > 1 || records_ == 0)) {
+    closeSegment();
+  }
+  if (records_ == 0) log_info(0, "spool is drained");
+}
@@ -0,0 +1,85 @@
+#ifndef _SPOOL_H_
+#define _SPOOL_H_
+
+#include <string>
+#include <deque>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "filerecord.h"
+
+#define SPOOL_SEGMENT_SIZE  64 * 1024 * 1024
+#define SPOOL_BUFFER_SIZE   256 * 1024
+
+/* records the sink can not take now wait here in order. a record is
+ * written to the segment files as a frame with everything needed to
+ * build it again and ack it, and is destroyed, nothing is kept in memory
+ * for it. a segment is removed when all of its frames are read back.
+ * only the routine thread uses it
+ */
+class Spool {
+  template<class T> friend class UNITTEST_HELPER;
+public:
+  Spool() : maxSize_(0), size_(0), records_(0), seq_(0), readOff_(0), front_(0), frontSize_(0) {}
+  ~Spool();
+
+  /* the segments left by the last run are removed, their records were
+   * never acked, so they are read from the files again
+   */
+  bool init(const std::string &dir, size_t maxSize, char *errbuf);
+
+  bool empty() const { return records_ == 0; }
+  size_t records() const { return records_; }
+  size_t size() const { return size_; }
+
+  /* false if the spool is full or the write fails, the record is
+   * destroyed if it is spooled
+   */
+  bool push(FileRecord *record);
+
+  /* the first record built from its frame, the same one until pop(),
+   * false if it can not be read
+   */
+  bool front(FileRecord **record);
+
+  /* the caller owns the record given by front() */
+  void pop();
+
+private:
+  /* the ctx is a pointer, the spool is never read by another process */
+  struct Frame {
+    uint32_t len;       // of the payload
+    uint32_t keyLen;    // the key is before the payload
+    uint64_t ctx;
+    uint64_t inode;
+    int64_t  off;
+    uint64_t seq;
+    int64_t  time;
+    uint32_t keyHash;
+    uint32_t hasKey;
+  };
+
+  struct Segment {
+    std::string file;
+    int         fd;
+    off_t       size;   // with the buffer
+  };
+
+  std::string dir_;
+  size_t      maxSize_;
+  size_t      size_;
+  size_t      records_;
+
+  uint64_t             seq_;
+  std::deque<Segment>  segments_;
+  std::string          buffer_;   // not written to the last segment yet
+  off_t                readOff_;  // in the first segment
+  FileRecord          *front_;
+  size_t               frontSize_;
+
+  bool openSegment();
+  void closeSegment();
+  bool flush();
+};
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef _SPSC_RING_H_
+#define _SPSC_RING_H_
+
+#include <cstdio>
+#include <cstring>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+namespace util {
+
+/* bounded single producer single consumer ring of pointers, without lock.
+ * the consumer sleeps on an eventfd only when the ring is empty, the
+ * producer only when it is full, and each side signals the other only
+ * when it was found sleeping
+ */
+class SpscRing {
+public:
+  SpscRing() : slots_(0), mask_(0), head_(0), consumerIdle_(0),
+               tail_(0), producerIdle_(0), dataFd_(-1), spaceFd_(-1) {}
+  ~SpscRing() { destroy(); }
+
+  /* capacity is rounded up to power of 2, init again resets the ring */
+  bool init(size_t capacity, char *errbuf) {
+    destroy();
+
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+
+    dataFd_  = eventfd(0, EFD_CLOEXEC);
+    spaceFd_ = eventfd(0, EFD_CLOEXEC);
+    if (dataFd_ == -1 || spaceFd_ == -1) {
+      snprintf(errbuf, 1024, "eventfd error %d:%s", errno, strerror(errno));
+      destroy();
+      return false;
+    }
+
+    slots_ = new void *[size];
+    mask_  = size - 1;
+    head_  = tail_ = 0;
+    consumerIdle_ = producerIdle_ = 0;
+    return true;
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+  size_t size() const {
+    size_t head = head_;
+    __sync_synchronize();
+    return tail_ - head;
+  }
+
+  /* block while the ring is full */
+  bool push(void *ptr) {
+    size_t tail = tail_;
+    while (tail - head_ == capacity()) {
+      producerIdle_ = 1;
+      __sync_synchronize();
+      bool full = (tail - head_ == capacity());
+      if (full && !wait(spaceFd_)) {
+        producerIdle_ = 0;
+        return false;
+      }
+      producerIdle_ = 0;
+    }
+
+    slots_[tail & mask_] = ptr;
+    __sync_synchronize();
+    tail_ = tail + 1;
+
+    __sync_synchronize();
+    if (consumerIdle_) return notify(dataFd_);
+    return true;
+  }
+
+  /* take up to max pointers, block while the ring is empty if block is set
+   * return 0 if nothing was taken or eventfd failed
+   */
+  size_t pop(void **ptrs, size_t max, bool block = true) {
+    size_t head = head_;
+    size_t avail;
+    while ((avail = tail_ - head) == 0) {
+      if (!block) return 0;
+
+      consumerIdle_ = 1;
+      __sync_synchronize();
+      bool empty = (tail_ == head);
+      if (empty && !wait(dataFd_)) {
+        consumerIdle_ = 0;
+        return 0;
+      }
+      consumerIdle_ = 0;
+    }
+    __sync_synchronize();
+
+    size_t n = avail < max ? avail : max;
+    for (size_t i = 0; i < n; ++i) ptrs[i] = slots_[(head + i) & mask_];
+
+    __sync_synchronize();
+    head_ = head + n;
+
+    __sync_synchronize();
+    if (producerIdle_) notify(spaceFd_);
+    return n;
+  }
+
+  /* the consumer of several rings blocks until one of them has data */
+  static bool wait(SpscRing **rings, size_t n) {
+    bool empty = true;
+    for (size_t i = 0; i < n; ++i) rings[i]->consumerIdle_ = 1;
+    __sync_synchronize();
+    for (size_t i = 0; i < n && empty; ++i) empty = (rings[i]->tail_ == rings[i]->head_);
+
+    int rc = 0;
+    if (empty) {
+      struct pollfd *fds = new struct pollfd[n];
+      for (size_t i = 0; i < n; ++i) {
+        fds[i].fd = rings[i]->dataFd_;
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+      }
+
+      while ((rc = poll(fds, n, -1)) == -1 && errno == EINTR) {}
+      for (size_t i = 0; rc > 0 && i < n; ++i) {
+        if (fds[i].revents & POLLIN) wait(fds[i].fd);
+      }
+      delete[] fds;
+    }
+
+    for (size_t i = 0; i < n; ++i) rings[i]->consumerIdle_ = 0;
+    return rc != -1;
+  }
+
+private:
+  SpscRing(const SpscRing &);
+  SpscRing &operator=(const SpscRing &);
+
+  static bool wait(int fd) {
+    uint64_t value;
+    ssize_t nn;
+    while ((nn = read(fd, &value, sizeof(value))) == -1 && errno == EINTR) {}
+    return nn == sizeof(value);
+  }
+
+  static bool notify(int fd) {
+    uint64_t value = 1;
+    ssize_t nn;
+    while ((nn = write(fd, &value, sizeof(value))) == -1 && errno == EINTR) {}
+    return nn == sizeof(value);
+  }
+
+  void destroy() {
+    if (slots_) delete[] slots_;
+    slots_ = 0;
+
+    if (dataFd_ != -1) close(dataFd_);
+    if (spaceFd_ != -1) close(spaceFd_);
+    dataFd_ = spaceFd_ = -1;
+  }
+
+  void   **slots_;
+  size_t   mask_;
+
+  /* the two sides write on separate cache lines */
+  char pad0_[64];
+  volatile size_t head_;   // written by the consumer only
+  volatile int    consumerIdle_;
+
+  char pad1_[64];
+  volatile size_t tail_;   // written by the producer only
+  volatile int    producerIdle_;
+
+  char pad2_[64];
+  int dataFd_;
+  int spaceFd_;
+};
+
+}  // namespace util
+
+#endif
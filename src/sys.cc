@@ -169,6 +169,33 @@ bool isdir(const char *dir, char *errbuf)
   }
 }
 
+/* a format of months is looked at again every day */
+time_t nextTimeFormat(time_t time, const char *format, int len)
+{
+  std::string name = timeFormat(time, format, len);
+
+  struct tm ltm;
+  localtime_r(&time, &ltm);
+  ltm.tm_sec = 0;
+  ltm.tm_min += 1;
+  ltm.tm_isdst = -1;
+  time_t next = mktime(&ltm);
+  if (timeFormat(next, format, len) != name) return next;
+
+  localtime_r(&time, &ltm);
+  ltm.tm_sec = ltm.tm_min = 0;
+  ltm.tm_hour += 1;
+  ltm.tm_isdst = -1;
+  next = mktime(&ltm);
+  if (timeFormat(next, format, len) != name) return next;
+
+  localtime_r(&time, &ltm);
+  ltm.tm_sec = ltm.tm_min = ltm.tm_hour = 0;
+  ltm.tm_mday += 1;
+  ltm.tm_isdst = -1;
+  return mktime(&ltm);
+}
+
 bool file2vector(const char *file, std::vector<std::string> *lines, size_t start, size_t size)
 {
   FILE *fp = fopen(file, "r");
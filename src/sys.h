@@ -14,6 +14,9 @@ inline void millisleep(int ms)
   nanosleep(&spec, 0);
 }
 
+/* the next minute, hour or day when timeFormat gives an other name */
+time_t nextTimeFormat(time_t time, const char *format, int len = -1);
+
 inline std::string timeFormat(time_t time, const char *format, int len = -1)
 {
   struct tm ltm;
@@ -22,6 +22,8 @@
 #include "filereader.h"
 #include "common.h"
 
+#define ROUTINE_BATCH 64
+
 LOGGER_INIT();
 
 pid_t spawn(CnfCtx *ctx, CnfCtx *octx);
@@ -159,34 +161,54 @@ void *routine(void *data)
 {
   CnfCtx *cnf = (CnfCtx *) data;
 
-  KafkaCtx *kafka = cnf->getKafka();
-  EsCtx *es = cnf->getEs();
+  Sink *sink = cnf->getSink();
 
   RunStatus *runStatus = cnf->getRunStatus();
 
-  uintptr_t ptr;
-  while (runStatus->get() == RunStatus::WAIT) {
-    ssize_t nn = read(cnf->accept, &ptr, sizeof(ptr));
-    if (nn == -1) {
-      if (errno != EINTR) break;
-      else continue;
-    } else if (nn == 0) {
-      break;
-    }
+  std::vector<util::SpscRing *> &queues = cnf->queues();
+
+  void *ptrs[ROUTINE_BATCH];
+  bool quit = false;
+  size_t idle = 0;
+  for (size_t q = 0; !quit && runStatus->get() == RunStatus::WAIT; q = (q + 1) % queues.size()) {
+    /* sleep when every tail thread's queue is empty */
+    size_t n = queues[q]->pop(ptrs, ROUTINE_BATCH, false);
+    if (n == 0) {
+      if (++idle < queues.size()) continue;
+      idle = 0;
+
+      /* the retried and spooled records go out as the sink frees up */
+      if (sink->backlog()) {
+        sink->poll(100);
+        if (!sink->drain()) {
+          log_fatal(0, "%s sink drain error, the service may be unavailable, exit", sink->name());
+          break;
+        }
+        continue;
+      }
 
-    assert(nn == sizeof(ptr));
+      if (!util::SpscRing::wait(&queues[0], queues.size())) {
+        log_fatal(errno, "wait records queue error");
+        break;
+      }
+      continue;
+    }
+    idle = 0;
 
-    if (!ptr) break;  // terminate task
+    for (size_t i = 0; i < n && runStatus->get() == RunStatus::WAIT; ++i) {
+      std::vector<FileRecord*> *records = (std::vector<FileRecord*>*) ptrs[i];
+      if (!records) {  // terminate task
+        quit = true;
+        break;
+      }
 
-    if (kafka && !kafka->produce((std::vector<FileRecord*>*) ptr)) {
-      log_fatal(0, "rd_kafka_poll timeout, librdkafka may have bug or kafka service is unavailable, exit");
-      runStatus->set(RunStatus::STOP);
-      kafka->poll(10);  // poll kafka
-    } else if (es && !es->produce((std::vector<FileRecord*>*) ptr)) {
-      log_fatal(0, "es_poll timeout, es service may unavailable, exit");
-      runStatus->set(RunStatus::STOP);
+      if (!sink->produce(records)) {
+        log_fatal(0, "%s sink produce error, the service may be unavailable, exit", sink->name());
+        runStatus->set(RunStatus::STOP);
+        sink->poll(10);
+      }
+      FileRecord::destroyVector(records);
     }
-    delete (std::vector<FileRecord*>*)ptr;
   }
 
   runStatus->set(RunStatus::STOP);
@@ -196,8 +218,7 @@ void *routine(void *data)
 
 inline void terminateRoutine(CnfCtx *ctx)
 {
-  uintptr_t ptr = 0;
-  write(ctx->server, &ptr, sizeof(ptr));
+  ctx->queue(0)->push(0);
 }
 
 void run(InotifyCtx *inotify, CnfCtx *cnf)
@@ -225,22 +246,29 @@ void run(InotifyCtx *inotify, CnfCtx *cnf)
     exit(EXIT_FAILURE);
   }
 
-  if (cnf->enableKafka()) {
-    /* initKafka startup librdkafka thread */
-    if (!cnf->initKafka()) {
-      log_fatal(0, "init kafka error %s", cnf->errbuf());
-      exit(EXIT_FAILURE);
-    }
-  } else if (cnf->enableEs()) {
-    if (!cnf->initEs()) {
-      log_fatal(0, "init es error %s", cnf->errbuf());
-      exit(EXIT_FAILURE);
-    }
+  /* the last checkpoint is written when cnf is deleted, after kafka */
+  if (!cnf->getFileOff()->start(cnf->errbuf())) {
+    log_fatal(0, "start fileoff error %s", cnf->errbuf());
+    exit(EXIT_FAILURE);
+  }
+
+  /* the kafka sink starts the librdkafka threads */
+  if (!cnf->initSink()) {
+    log_fatal(0, "init %s sink error %s", cnf->sinkType().c_str(), cnf->errbuf());
+    exit(EXIT_FAILURE);
+  }
+
+  if (!inotify->startWorkers(cnf->errbuf())) {
+    log_fatal(0, "start tail threads error %s", cnf->errbuf());
+    exit(EXIT_FAILURE);
   }
 
   pthread_t tid;
   pthread_create(&tid, NULL, routine, cnf);
   inotify->loop();
+
+  /* the tail threads are the producers of the queues, stop them first */
+  inotify->stopWorkers();
   terminateRoutine(cnf);
   pthread_join(tid, NULL);
 }
@@ -1,20 +1,32 @@
 #include <cstdio>
 #include <cstring>
 #include <string>
+#include <algorithm>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/inotify.h>
 
 #include "logger.h"
 #include "unittesthelper.h"
 #include "runstatus.h"
 #include "sys.h"
 #include "util.h"
+#include "linescanner.h"
 #include "luactx.h"
 #include "cnfctx.h"
 #include "filereader.h"
+#include "readchunk.h"
+#include "spscring.h"
+#include "timerwheel.h"
+#include "taskqueue.h"
+#include "iouring.h"
 #include "inotifyctx.h"
+#include "globsource.h"
+#include "sink.h"
+#include "spool.h"
 
 #define PADDING_LEN 13
 
@@ -64,6 +76,24 @@ DEFINE(split_n)
   check(list[2] == "!", "%s", list[2].c_str());
 }
 
+DEFINE(splitField)
+{
+  const char *s = "127.0.0.1 - [28/Feb/2015:12:30:23 +0800] \"GET / HTTP/1.1\" uid42";
+  const char *field;
+  size_t len;
+
+  check(splitField(s, strlen(s), 3, &field, &len), "field 3 not found");
+  check(std::string(field, len) == "28/Feb/2015:12:30:23 +0800", "%.*s", (int) len, field);
+  check(splitField(s, strlen(s), -1, &field, &len), "field -1 not found");
+  check(std::string(field, len) == "uid42", "%.*s", (int) len, field);
+  check(!splitField(s, strlen(s), 6, &field, &len), "field 6 found");
+  check(!splitField(s, strlen(s), -6, &field, &len), "field -6 found");
+
+  check(util::hash("", 0) == 0, "%u", util::hash("", 0));
+  check(util::hash("uid42", 5) == util::hash("uid42", 5) && util::hash("uid42", 5) != util::hash("uid43", 5),
+        "hash not stable");
+}
+
 DEFINE(iso8601)
 {
   std::string iso;
@@ -90,6 +120,196 @@ DEFINE(iso8601)
   check(timestamp == 1519292433, "%ld", timestamp);
 }
 
+DEFINE(scanLines)
+{
+  std::string data;
+  for (int i = 0; i < 300; ++i) {
+    data.append(i % 7, 'a' + i % 26);
+    data.append(1, '\n');
+  }
+  data.append("partial");
+
+  std::vector<uint32_t> expect;
+  for (size_t i = 0; i < data.size(); ++i) {
+    if (data[i] == '\n') expect.push_back(i);
+  }
+
+  const char *impls[] = {"scalar", "sse2", "avx2", 0};
+  for (int i = 0; impls[i]; ++i) {
+    util::ScanLinesFun fun = util::getScanLinesFun(impls[i]);
+    if (!fun) continue;
+
+    /* every alignment, batch limits hit inside and at the end of a block */
+    size_t maxs[] = {1, 3, 17, 64, 4096};
+    for (size_t off = 0; off < 64; ++off) {
+      for (size_t j = 0; j < sizeof(maxs)/sizeof(maxs[0]); ++j) {
+        std::vector<uint32_t> ends(maxs[j]);
+        size_t n = off, idx = 0;
+        while (idx < expect.size() && expect[idx] < off) ++idx;
+
+        while (n < data.size()) {
+          size_t scanned;
+          size_t nend = fun(data.data() + n, data.size() - n, &ends[0], maxs[j], &scanned);
+          for (size_t k = 0; k < nend; ++k, ++idx) {
+            check(n + ends[k] == expect[idx], "%s %d %d", impls[i], (int) (n + ends[k]), (int) expect[idx]);
+          }
+          if (nend < maxs[j]) {
+            check(scanned == data.size() - n, "%s scanned %d", impls[i], (int) scanned);
+            break;
+          }
+          check(scanned == ends[nend-1] + 1, "%s scanned %d", impls[i], (int) scanned);
+          n += scanned;
+        }
+        check(idx == expect.size(), "%s found %d, expect %d", impls[i], (int) idx, (int) expect.size());
+      }
+    }
+  }
+
+  check(util::getScanLinesFun(util::scanLinesImpl()) != 0, "%s", util::scanLinesImpl());
+}
+
+#define RING_TEST_COUNT 100000
+
+static void *ringProducer(void *data)
+{
+  util::SpscRing *ring = (util::SpscRing *) data;
+  for (uintptr_t i = 1; i <= RING_TEST_COUNT; ++i) ring->push((void *) i);
+  return 0;
+}
+
+DEFINE(spscRing)
+{
+  util::SpscRing ring;
+  char errbuf[1024];
+  check(ring.init(3, errbuf), "%s", errbuf);
+  check(ring.capacity() == 4, "%d", (int) ring.capacity());
+
+  void *ptrs[8];
+  check(ring.pop(ptrs, 8, false) == 0, "empty ring");
+  for (uintptr_t i = 1; i <= 4; ++i) ring.push((void *) i);
+  check(ring.size() == 4, "%d", (int) ring.size());
+
+  check(ring.pop(ptrs, 3) == 3, "batch pop");
+  check(ptrs[0] == (void *) 1 && ptrs[2] == (void *) 3, "%p %p", ptrs[0], ptrs[2]);
+  check(ring.pop(ptrs, 8) == 1 && ptrs[0] == (void *) 4, "%p", ptrs[0]);
+
+  /* producer blocks on full ring, consumer blocks on empty ring */
+  pthread_t tid;
+  pthread_create(&tid, 0, ringProducer, &ring);
+  uintptr_t expect = 1;
+  while (expect <= RING_TEST_COUNT) {
+    size_t n = ring.pop(ptrs, 8);
+    check(n > 0, "pop error %d", errno);
+    for (size_t i = 0; i < n; ++i, ++expect) {
+      check(ptrs[i] == (void *) expect, "%p != %lu", ptrs[i], (unsigned long) expect);
+    }
+  }
+  pthread_join(tid, 0);
+  check(ring.size() == 0, "%d", (int) ring.size());
+}
+
+class CountTask : public util::TaskQueue::Task {
+public:
+  CountTask(int *count) : count_(count) {}
+  bool doIt() {
+    util::atomic_inc(count_);
+    return true;
+  }
+private:
+  int *count_;
+};
+
+DEFINE(taskQueue)
+{
+  int count = 0;
+  util::TaskQueue tq("test");
+  check(tq.start(cnf->errbuf(), 4), "%s", cnf->errbuf());
+  for (int i = 0; i < 1000; ++i) tq.submit(new CountTask(&count));
+
+  /* every thread quits, the queued tasks are done first */
+  tq.stop();
+  check(count == 1000, "count %d", count);
+
+  check(tq.start(cnf->errbuf(), 3), "%s", cnf->errbuf());
+  tq.stop(true);
+}
+
+DEFINE(timerWheel)
+{
+  util::TimerWheel wheel(1000);
+  util::TimerWheel::Timer t1(1), t2(2), t3(3), t4(4);
+  wheel.add(&t1, 1003);
+  wheel.add(&t2, 1000 + 100);    // level 1
+  wheel.add(&t3, 1000 + 5000);   // level 2
+  wheel.add(&t4, 999);           // past, the next tick
+  check(wheel.size() == 4, "%d", (int) wheel.size());
+
+  std::vector<util::TimerWheel::Timer *> expired;
+  wheel.expire(1002, &expired);
+  check(expired.size() == 1 && expired[0] == &t4, "%d", (int) expired.size());
+
+  expired.clear();
+  wheel.expire(1099, &expired);
+  check(expired.size() == 1 && expired[0] == &t1, "%d", (int) expired.size());
+
+  /* moved, not added twice */
+  wheel.add(&t3, 1200);
+  wheel.remove(&t2);
+  check(wheel.size() == 1 && !t2.pending(), "%d", (int) wheel.size());
+
+  expired.clear();
+  wheel.expire(1199, &expired);
+  check(expired.empty(), "%d", (int) expired.size());
+  wheel.expire(1200, &expired);
+  check(expired.size() == 1 && expired[0]->type() == 3 && wheel.size() == 0, "%d", (int) expired.size());
+
+  /* a deadline on a level 1 slot boundary expires at its tick */
+  wheel.expire(1216, &expired);
+  wheel.add(&t1, 1216 + 64);
+  expired.clear();
+  wheel.expire(1279, &expired);
+  check(expired.empty(), "%d", (int) expired.size());
+  wheel.expire(1280, &expired);
+  check(expired.size() == 1 && expired[0] == &t1 && wheel.size() == 0, "%d", (int) expired.size());
+
+  time_t now = 1700000000 + 1800;   // the middle of an hour
+  time_t next = sys::nextTimeFormat(now, "%Y%m%d%H");
+  check(next > now && next - now <= 3600 && sys::timeFormat(next - 1, "%Y%m%d%H") == sys::timeFormat(now, "%Y%m%d%H"),
+        "%ld", (long) (next - now));
+}
+
+DEFINE(ioUring)
+{
+  char errbuf[1024];
+  util::IoUring *ring = util::IoUring::create(4, errbuf);
+  if (!ring) {
+    printf("skip ioUring, %s\n", errbuf);
+    return;
+  }
+
+  int fd = open("/etc/passwd", O_RDONLY);
+  char buf1[4], buf2[4];
+  check(ring->prepRead(fd, buf1, 4, 1), "prepRead");
+  check(ring->submit() == 1, "submit");
+
+  uint64_t userData;
+  int res;
+  check(ring->wait(&userData, &res) && userData == 1 && res == 4, "%d %d", (int) userData, res);
+
+  /* reads follow the file position */
+  check(lseek(fd, 0, SEEK_CUR) == 4, "%ld", (long) lseek(fd, 0, SEEK_CUR));
+  ring->prepRead(fd, buf2, 4, 2);
+  ring->submit();
+  check(ring->wait(&userData, &res) && userData == 2 && res == 4, "%d %d", (int) userData, res);
+
+  char expect[8];
+  check(pread(fd, expect, 8, 0) == 8, "pread");
+  check(memcmp(buf1, expect, 4) == 0 && memcmp(buf2, expect + 4, 4) == 0, "read content");
+
+  close(fd);
+  delete ring;
+}
+
 DEFINE(hostshell)
 {
   std::string s = " \tHello World\n";
@@ -129,6 +349,7 @@ DEFINE(loadCnf)
   check(cnf->host() == hostname, "cnf host %s", cnf->host().c_str());
   check(cnf->partition() == 0, "cnf partition %d", cnf->partition());
   check(cnf->getPollLimit() == 50, "cnf polllimit %d", cnf->getPollLimit());
+  check(cnf->tailWorkers() == 0 && cnf->queues().size() == 1, "cnf tailworkers %d", cnf->tailWorkers());
 
   check(cnf->getKafkaGlobalConf().count("client.id"), "kafkaGlobalConf client.id notfound");
   check(cnf->getKafkaGlobalConf().find("client.id")->second == "tail2kafka", "kafkaGlobalConf client.id = %s", PTRS(cnf->getKafkaGlobalConf().find("client.id")->second));
@@ -138,6 +359,13 @@ DEFINE(loadCnf)
 
   check(cnf->pingbackUrl_ == "http://localhost/pingback/tail2kafka", "pingbackUrl %s", cnf->pingbackUrl_.c_str());
 
+  /* backfill_rate is off by default, the budget is shared within one second */
+  check(cnf->backfillQuota(3 << 20) == 3 << 20, "backfill without limit");
+  cnf->backfillRate_ = 1;
+  off_t quota = cnf->backfillQuota(3 << 20);
+  check(quota == 1 << 20 && cnf->backfillQuota(1) == 0, "backfill quota %ld", (long) quota);
+  cnf->backfillRate_ = 0;
+
   check(cnf->getLuaCtxSize() == LUACNF_SIZE, "%d", (int) cnf->getLuaCtxSize());
   for (std::vector<LuaCtx *>::iterator ite = cnf->getLuaCtxs().begin(); ite != cnf->getLuaCtxs().end(); ++ite) {
     LuaCtx *ctx = (*ite);
@@ -255,6 +483,81 @@ DEFINE(transform)
   check(datas.empty(), "data size %d", (int) datas.size());
 }
 
+DEFINE(luaWorkers)
+{
+  LuaCtx *ctx = getLuaCtx("transform");
+  LuaFunction *function = ctx->function();
+  ctx->withhost_ = false;
+
+  LuaFunction *worker = function->clone(cnf->errbuf());
+  check(worker, "%s", cnf->errbuf());
+  check(worker->helper_ != function->helper_ && worker->ownHelper_, "clone has its own lua_State");
+  function->workers_.push_back(worker);
+  function->pool_ = new util::TaskQueue("lua");
+
+  std::string data;
+  std::vector<uint32_t> ends;
+  for (int i = 0; i < 1000; ++i) {
+    data.append(i % 3 == 0 ? "[debug] " : "[error] ").append(util::toStr(i)).append(1, '\n');
+    ends.push_back(data.size() - 1);
+  }
+
+  std::vector<FileRecord *> records;
+  int n = function->process(0, data.data(), &ends[0], ends.size(), &records);
+  check(function->poolStarted_, "batch runs in the pool");
+  check(n == 666 && records.size() == 666, "%d %d", n, (int) records.size());
+
+  /* records keep the line order */
+  for (size_t i = 0, j = 1; i < records.size(); ++i, ++j) {
+    if (j % 3 == 0) ++j;
+    std::string expect = "[error] " + util::toStr(j);
+    check(*records[i]->data == expect, "%s != %s", PTRS(*records[i]->data), PTRS(expect));
+    check(i == 0 || records[i]->off > records[i-1]->off, "off %ld", (long) records[i]->off);
+    FileRecord::destroy(records[i]);
+  }
+
+  delete function->pool_;
+  function->pool_ = 0;
+  function->poolStarted_ = false;
+  function->workers_.clear();
+  delete worker;
+  ctx->withhost_ = true;
+}
+
+/* luaworkers = 4, the destructor stops the pool of three threads */
+DEFINE(luaWorkersDestroy)
+{
+  LuaCtx *ctx = getLuaCtx("transform");
+  ctx->withhost_ = false;
+
+  LuaFunction *function = ctx->function()->clone(cnf->errbuf());
+  check(function, "%s", cnf->errbuf());
+  for (int i = 1; i < 4; ++i) {
+    LuaFunction *worker = function->clone(cnf->errbuf());
+    check(worker, "%s", cnf->errbuf());
+    function->workers_.push_back(worker);
+  }
+  function->pool_ = new util::TaskQueue("lua");
+
+  std::string data;
+  std::vector<uint32_t> ends;
+  for (int i = 0; i < 1000; ++i) {
+    data.append(i % 3 == 0 ? "[debug] " : "[error] ").append(util::toStr(i)).append(1, '\n');
+    ends.push_back(data.size() - 1);
+  }
+
+  for (int round = 0; round < 3; ++round) {
+    std::vector<FileRecord *> records;
+    int n = function->process(0, data.data(), &ends[0], ends.size(), &records);
+    check(function->poolStarted_, "batch runs in the pool");
+    check(n == 666 && records.size() == 666, "%d %d", n, (int) records.size());
+    for (size_t i = 0; i < records.size(); ++i) FileRecord::destroy(records[i]);
+  }
+
+  delete function;
+  ctx->withhost_ = true;
+}
+
 DEFINE(aggregate)
 {
   std::vector<FileRecord *> datas;
@@ -301,10 +604,212 @@ DEFINE(initKafka)
 {
   check(cnf->initKafka(), "%s", cnf->errbuf());
 
-  check(cnf->kafka_->rk_, "rk_ == 0");
+  check(cnf->kafka_->producers_.size() == 1 && cnf->kafka_->producers_[0].rk, "rk == 0");
+  check(cnf->kafka_->rktProducer_.size() == cnf->kafka_->nrkt_, "rktProducer size %d", (int) cnf->kafka_->rktProducer_.size());
   check(cnf->kafka_->nrkt_ == cnf->getLuaCtxSize(), "rkts size %d", (int) cnf->getLuaCtxSize());
 }
 
+/* a key keeps its partition, whether or not the partition has a leader */
+DEFINE(keyPartitioner)
+{
+  FileRecord *record = FileRecord::create(1, 10);
+  const char *uids[] = {"uid42", "uid43", "uid44", "uid45"};
+  for (size_t i = 0; i < sizeof(uids)/sizeof(uids[0]); ++i) {
+    record->keyHash = util::hash(uids[i], strlen(uids[i]));
+    int32_t partition = KafkaCtx::key_partitioner_cb(0, uids[i], strlen(uids[i]), 8, 0, record);
+    check(partition == (int32_t) (record->keyHash % 8), "%s partition %d", uids[i], partition);
+    check(KafkaCtx::key_partitioner_cb(0, uids[i], strlen(uids[i]), 8, 0, record) == partition,
+          "%s partition is not stable", uids[i]);
+  }
+  FileRecord::destroy(record);
+}
+
+DEFINE(kafkaStats)
+{
+  const char *json =
+    "{\"name\": \"rdkafka#producer-1\", \"time\": 1500000000, \"msg_cnt\": 12, \"msg_size\": 1200,"
+    " \"txmsgs\": 100, \"txmsg_bytes\": 10000,"
+    " \"brokers\": {"
+    "  \"localhost:9092/bootstrap\": {\"name\": \"localhost:9092/bootstrap\", \"nodeid\": -1},"
+    "  \"localhost:9092/1\": {\"name\": \"localhost:9092/1\", \"nodeid\": 1, \"outbuf_cnt\": 2,"
+    "   \"waitresp_cnt\": 1, \"tx\": 50, \"txretries\": 3, \"txerrs\": 0, \"rtt\": {\"avg\": 1500}}},"
+    " \"topics\": {\"basic\": {\"topic\": \"basic\", \"batchsize\": {\"avg\": 4096}, \"batchcnt\": {\"avg\": 40},"
+    "  \"partitions\": {"
+    "   \"0\": {\"partition\": 0, \"leader\": 1, \"msgq_cnt\": 5, \"xmit_msgq_cnt\": 3, \"txmsgs\": 60},"
+    "   \"1\": {\"partition\": 1, \"leader\": 1, \"msgq_cnt\": 4, \"xmit_msgq_cnt\": 0, \"txmsgs\": 40},"
+    "   \"-1\": {\"partition\": -1, \"leader\": -1, \"msgq_cnt\": 0}}}}}";
+
+  KafkaStats stats;
+  check(stats.parse(json, strlen(json)), "kafka stats parse error");
+  check(stats.name == "rdkafka#producer-1" && stats.msgCnt == 12 && stats.txmsgs == 100, "%s", PTRS(stats.name));
+  check(stats.brokers.size() == 1 && stats.brokers[0].rtt == 1500 && stats.brokers[0].txretries == 3,
+        "brokers %d", (int) stats.brokers.size());
+  check(stats.topics.size() == 1 && stats.topics[0].batchsize == 4096, "topics %d", (int) stats.topics.size());
+  check(stats.partitions.size() == 2 && stats.partitions[0].msgq == 8, "partitions %d", (int) stats.partitions.size());
+
+  std::vector<std::string> lines;
+  stats.format(false, &lines);
+  check(lines.size() == 3, "lines %d", (int) lines.size());
+  check(lines[2] == "kafka stats rdkafka#producer-1 topic basic msgq=12,maxq=8,batchsize=4096,batchcnt=40", "%s", PTRS(lines[2]));
+
+  check(!stats.parse("{", 1), "kafka stats should be invalid");
+}
+
+static std::vector<FileRecord *> retryRecords(LuaCtx *ctx, int start, int n)
+{
+  std::vector<FileRecord *> records;
+  for (int i = start; i < start + n; ++i) {
+    FileRecord *record = FileRecord::create(9, i * 10);
+    record->ctx = ctx;
+    record->payload()->assign("retry\n");
+    records.push_back(record);
+  }
+  cnf->stats()->queueSizeInc(n);
+  return records;
+}
+
+/* a producer which never reaches a broker and takes two messages, the
+ * rest of a batch waits in the retry queue
+ */
+DEFINE(kafkaRetry)
+{
+  KafkaCtx *kafka = new KafkaCtx;
+  kafka->cnf_ = cnf;
+
+  std::map<std::string, std::string> gcnf;
+  gcnf["queue.buffering.max.messages"] = "2";
+  kafka->producers_.resize(1);
+  kafka->producers_[0].rk = kafka->initKafka("127.0.0.1:1", gcnf, cnf->errbuf());
+  check(kafka->producers_[0].rk, "%s", cnf->errbuf());
+
+  kafka->nrkt_ = cnf->kafka_->nrkt_;
+  kafka->rkts_ = new rd_kafka_topic_t*[kafka->nrkt_];
+  kafka->errors_ = new int[kafka->nrkt_];
+  for (size_t i = 0; i < kafka->nrkt_; ++i) {
+    kafka->rkts_[i] = rd_kafka_topic_new(kafka->producers_[0].rk, rd_kafka_topic_name(cnf->kafka_->rkts_[i]), 0);
+    kafka->errors_[i] = 0;
+    kafka->rktProducer_.push_back(0);
+  }
+  kafka->retries_.resize(kafka->nrkt_);
+  kafka->partitions_.resize(kafka->nrkt_);
+
+  LuaCtx *ctx = getLuaCtx("basic");
+  size_t id = ctx->rktId();
+  KafkaRetry *retry = &kafka->retries_[id];
+
+  std::vector<FileRecord *> records = retryRecords(ctx, 0, 5);
+  check(kafka->produce(&records), "kafka produce error");
+  check(kafka->nretry_ == 1 && retry->records.size() == 3 && kafka->backlog(),
+        "retry %d", (int) retry->records.size());
+  check(retry->backoff == RETRY_BACKOFF_MIN, "backoff %d", retry->backoff);
+
+  /* the next records of the topic wait behind the failed ones */
+  records = retryRecords(ctx, 5, 1);
+  check(kafka->produce(&records), "kafka produce error");
+  check(retry->records.size() == 4 && util::atomic_get(&retry->depth) == 4, "retry %d", (int) retry->records.size());
+  for (int i = 0; i < 4; ++i) {
+    check(retry->records[i].first->off == (i + 2) * 10, "retry %d off %d", i, (int) retry->records[i].first->off);
+  }
+
+  check(kafka->drainRetry(id) && retry->backoff == RETRY_BACKOFF_MIN, "retry before backoff %d", retry->backoff);
+
+  int backoff = RETRY_BACKOFF_MIN;
+  for (int i = 0; i < 8; ++i) {
+    retry->nextTry = 0;
+    check(kafka->drainRetry(id), "drain retry #%d error", i);
+    backoff = std::min(backoff * 2, RETRY_BACKOFF_MAX);
+    check(retry->backoff == backoff, "backoff #%d %d != %d", i, retry->backoff, backoff);
+    check(retry->records.size() == 4 && retry->records.front().first->off == 20, "retry order changed");
+  }
+
+  /* no record went out for too long */
+  int64_t now = cnf->fasttime(TIMEUNIT_MILLI);
+  retry->nextTry = 0;
+  retry->progress = now - (QUEUE_ERROR_TIMEOUT + 3) * 1000;
+  check(!kafka->drainRetry(id), "drain retry should time out");
+
+  /* the spool takes the records in order, and the new ones after them */
+  Spool *spool = new Spool;
+  check(spool->init(LOG("retryspool"), 1024 * 1024, cnf->errbuf()), "%s", cnf->errbuf());
+  kafka->spool_ = spool;
+
+  retry->nextTry = 0;
+  retry->progress = now;
+  check(kafka->drainRetry(id), "drain retry to spool error");
+  check(kafka->nretry_ == 0 && retry->records.empty() && retry->depth == 0, "retry %d", (int) retry->records.size());
+  check(spool->records() == 4, "spool %d", (int) spool->records());
+
+  records = retryRecords(ctx, 6, 1);
+  check(kafka->produce(&records), "kafka produce error");
+  check(spool->records() == 5 && kafka->backlog(), "spool %d", (int) spool->records());
+
+  FileRecord *record;
+  for (int i = 2; i <= 6; ++i) {
+    check(spool->front(&record) && record->off == i * 10, "spool %d off %d", i, (int) record->off);
+    spool->pop();
+    FileRecord::destroy(record);
+  }
+
+  /* the two in librdkafka are never acked */
+  cnf->stats()->queueSizeDec(2);
+  delete kafka;
+}
+
+/* the weight of a partition is LATENCY_WEIGHT / (latency + LATENCY_BASE),
+ * an unknown latency is 0
+ */
+DEFINE(choosePartition)
+{
+  KafkaCtx kafka;
+  kafka.partitions_.resize(1);
+  KafkaPartitions *parts = &kafka.partitions_[0];
+  check(kafka.choosePartition(0) == RD_KAFKA_PARTITION_UA, "no metadata should be UA");
+
+  std::vector<int32_t> available;
+  available.push_back(2);
+  available.push_back(0);
+  available.push_back(1);
+  kafka.updatePartitions(parts, &available);
+  check(parts->available.size() == 3 && parts->available[0] == 0 && parts->available[2] == 2,
+        "available %d", (int) parts->available.size());
+
+  /* weights 50000, 10000 and 100000 */
+  parts->latency[0] = 10;
+  parts->latency[1] = 90;
+  parts->latency[2] = 0;
+  parts->latency[3] = 5;
+
+  srand(42);
+  int count[3] = {0, 0, 0};
+  const int n = 16000;
+  for (int i = 0; i < n; ++i) {
+    int32_t partition = kafka.choosePartition(0);
+    check(partition >= 0 && partition < 3, "partition %d", partition);
+    count[partition]++;
+  }
+  int expect[3] = {n * 5 / 16, n * 1 / 16, n * 10 / 16};
+  for (int i = 0; i < 3; ++i) {
+    check(abs(count[i] - expect[i]) < n / 50, "partition %d count %d expect %d", i, count[i], expect[i]);
+  }
+
+  /* partition 1 loses its leader and keeps its latency until it is back */
+  available.clear();
+  available.push_back(0);
+  available.push_back(2);
+  kafka.updatePartitions(parts, &available);
+  check(parts->available.size() == 2 && parts->latency[1] == 90, "latency %d", (int) parts->latency[1]);
+  for (int i = 0; i < 100; ++i) check(kafka.choosePartition(0) != 1, "partition 1 has no leader");
+
+  available.clear();
+  available.push_back(0);
+  available.push_back(1);
+  available.push_back(2);
+  available.push_back(3);
+  kafka.updatePartitions(parts, &available);
+  check(parts->latency[1] == 0 && parts->latency[3] == 0, "latency %d %d", (int) parts->latency[1], (int) parts->latency[3]);
+  check(parts->latency[0] == 10 && parts->latency[2] == 0, "latency %d", (int) parts->latency[0]);
+}
+
 DEFINE(initFileOff)
 {
   check(cnf->initFileOff(), "%s", cnf->errbuf());
@@ -314,17 +819,55 @@ DEFINE(initFileOff)
 DEFINE(reinitFileOff)
 {
   check(cnf->getFileOff()->reinit(), "%s", cnf->errbuf());
-  check(cnf->fileOff_->length_ == cnf->getLuaCtxSize() * sizeof(FileOffRecord), "%d", (int) cnf->fileOff_->length_);
+  check(cnf->fileOff_->slots_ >= cnf->getLuaCtxSize(), "%d", (int) cnf->fileOff_->slots_);
+
+  std::vector<FileOffCheckpoint> written;
+  check(FileOff::read(cnf->fileOff_->file_, &written, cnf->errbuf()), "%s", cnf->errbuf());
+  check(written.size() == 2 && written[0].valid && written[1].valid &&
+        written[0].seq + written[1].seq == 2 * cnf->fileOff_->seq_ - 1, "reinit should write both copies");
 
   LuaCtx *ctx = getLuaCtx("basic");
   ino_t inode = ctx->fileReader_->fileOffRecord_->inode;
   off_t off = ctx->fileReader_->fileOffRecord_->off;
-  ctx->fileReader_->fileOffRecord_->off += 100;
+  ctx->fileReader_->fileOffRecord_->set(inode, off + 100);
 
+  check(cnf->getFileOff()->checkpoint(false, cnf->errbuf()), "%s", cnf->errbuf());
   check(cnf->getFileOff()->loadFromFile(cnf->errbuf()), "fileoff load");
-  check(cnf->getFileOff()->map_[inode] == off+100, "mmap not work");
+  check(cnf->getFileOff()->map_[inode] == off+100, "checkpoint not work");
+
+  ctx->fileReader_->fileOffRecord_->set(inode, off);
+
+  /* a torn record or copy falls back to the older copy */
+  std::string file = cnf->libdir() + "/fileoff.torn";
+  std::map<ino_t, off_t> offs;
+  offs[1] = 10;
+  offs[2] = 20;
+  check(FileOff::write(file, offs, 5, cnf->errbuf()), "%s", cnf->errbuf());
+
+  struct stat st;
+  stat(file.c_str(), &st);
+  int fd = open(file.c_str(), O_WRONLY);
+  pwrite(fd, "xx", 2, 32 + 24);     // the second record of seq 6 in copy 0
+  close(fd);
 
-  ctx->fileReader_->fileOffRecord_->off = off;
+  uint64_t seq;
+  std::vector<FileOffCheckpoint> copies;
+  offs.clear();
+  check(FileOff::read(file, &copies, cnf->errbuf()), "%s", cnf->errbuf());
+  FileOff::merge(copies, &offs, &seq);
+  check(copies.size() == 2 && copies[0].bad == 1 && copies[1].valid, "%d", (int) copies.size());
+  check(seq == 6 && offs[1] == 10 && offs[2] == 20, "%d %d %d", (int) seq, (int) offs[1], (int) offs[2]);
+
+  fd = open(file.c_str(), O_WRONLY);
+  pwrite(fd, "xx", 2, st.st_size / 2 + 8);     // the header of copy 1
+  close(fd);
+
+  copies.clear();
+  offs.clear();
+  check(FileOff::read(file, &copies, cnf->errbuf()), "%s", cnf->errbuf());
+  FileOff::merge(copies, &offs, &seq);
+  check(!copies[1].valid && offs.size() == 1, "%d", (int) offs.size());
+  unlink(file.c_str());
 }
 
 DEFINE(initFileReader)
@@ -341,7 +884,7 @@ DEFINE(initFileReader)
   ctx->startPosition_ = "LOG_END";
 
   check(ctx->initFileReader(0, cnf->errbuf()), "%s", cnf->errbuf());
-  check(ctx->fileReader_->buffer_, "buffer init ok");
+  check(ctx->fileReader_->chunk_, "chunk init ok");
   check(ctx->fileReader_->npos_ == 0, "%d", (int) ctx->fileReader_->npos_);
   check(ctx->fileReader_->size_ == 7, "%d", (int) ctx->fileReader_->size_);
   SAFE_DELETE(ctx->fileReader_);
@@ -392,6 +935,65 @@ DEFINE(initFileReader)
   }
 }
 
+static void writeEvent(int fd, int wd, uint32_t mask)
+{
+  struct inotify_event event;
+  memset(&event, 0, sizeof(event));
+  event.wd = wd;
+  event.mask = mask;
+  write(fd, &event, sizeof(event));
+}
+
+/* the events are read from a pipe instead of inotify */
+DEFINE(inotifyCoalesce)
+{
+  InotifyCtx inotify(cnf);
+  int fds[2];
+  check(pipe(fds) == 0, "pipe error %s", strerror(errno));
+  inotify.wfd_ = fds[0];
+
+  LuaCtx *basic = getLuaCtx("basic"), *transform = getLuaCtx("transform");
+  inotify.fdToCtx_[1] = basic;
+  inotify.fdToCtx_[2] = transform;
+
+  char buffer[64 * sizeof(struct inotify_event)];
+  bool overflow = false;
+
+  for (int i = 0; i < 3; ++i) writeEvent(fds[1], 1, IN_MODIFY);
+  writeEvent(fds[1], 2, IN_MODIFY);
+  writeEvent(fds[1], 1, IN_MODIFY);
+  inotify.readEvents(buffer, sizeof(buffer), &overflow);
+  check(!overflow, "no overflow");
+
+  /* the window of coalesceMs reads again, the file is still tailed once */
+  writeEvent(fds[1], 1, IN_MODIFY);
+  inotify.readEvents(buffer, sizeof(buffer), &overflow);
+  check(inotify.modified_.size() == 2, "%d", (int) inotify.modified_.size());
+  check(inotify.modified_[0] == basic && inotify.modified_[1] == transform, "modified order error");
+
+  inotify.modified_.clear();
+  inotify.modifiedSet_.clear();
+
+  /* the events were lost, every file is tailed once */
+  writeEvent(fds[1], 1, IN_MODIFY);
+  writeEvent(fds[1], -1, IN_Q_OVERFLOW);
+  inotify.readEvents(buffer, sizeof(buffer), &overflow);
+  check(overflow, "overflow should be reported");
+  inotify.rescan();
+
+  size_t files = 0;
+  for (std::vector<LuaCtx *>::iterator ite = cnf->getLuaCtxs().begin(); ite != cnf->getLuaCtxs().end(); ++ite) {
+    if (!(*ite)->glob()) ++files;
+  }
+  check(inotify.modified_.size() == files && inotify.modifiedSet_.size() == files,
+        "%d %d", (int) inotify.modified_.size(), (int) files);
+  check(inotify.modified_[0] == basic, "the file of the event goes first");
+
+  inotify.modified_.clear();
+  inotify.modifiedSet_.clear();
+  close(fds[1]);
+}
+
 void *watchLoop(void *data)
 {
   InotifyCtx *inotify = (InotifyCtx *) data;
@@ -399,6 +1001,460 @@ void *watchLoop(void *data)
   return 0;
 }
 
+DEFINE(recordPool)
+{
+  FileRecordStats before, after;
+  FileRecord::stats(&before);
+
+  FileRecord *record = FileRecord::create(1, 10);
+  record->payload()->assign(1024, 'x');
+  check(record->data->size() == 1024 && record->esIndex == 0, "%d", (int) record->data->size());
+  FileRecord::destroy(record);
+
+  FileRecord *again = FileRecord::create(2, 20);
+  check(again == record, "record should be recycled");
+  check(again->inode == 2 && again->off == 20, "%d %d", (int) again->inode, (int) again->off);
+  check(again->data->empty() && again->payload()->capacity() >= 1024, "%d", (int) again->payload()->capacity());
+  FileRecord::destroy(again);
+
+  FileRecord::stats(&after);
+  check(after.live == before.live, "%ld %ld", after.live, before.live);
+  check(after.recycled == before.recycled + 2, "%ld %ld", after.recycled, before.recycled);
+
+  std::vector<FileRecord *> *records = FileRecord::createVector();
+  records->push_back(0);
+  FileRecord::destroyVector(records);
+  check(FileRecord::createVector() == records && records->empty(), "vector should be recycled");
+  FileRecord::destroyVector(records);
+}
+
+DEFINE(ackWindow)
+{
+  AckWindow acks;
+  uint64_t a = acks.issue(1, 10, 10);
+  uint64_t b = acks.issue(1, 20, 10);
+  uint64_t c = acks.issue(2, 5, 5);
+
+  AckSlot slot;
+  acks.ack(c);
+  acks.ack(b);
+  check(!acks.release(&slot), "released past an unacked record");
+
+  acks.ack(a);
+  check(acks.release(&slot) && slot.off == 10, "%d", (int) slot.off);
+  check(acks.release(&slot) && slot.off == 20, "%d", (int) slot.off);
+  check(acks.release(&slot) && slot.inode == 2 && slot.off == 5, "%d %d", (int) slot.inode, (int) slot.off);
+  check(!acks.release(&slot) && acks.size() == 0, "%d", (int) acks.size());
+
+  check(acks.issue(2, 10, 5) == c + 1, "seq is not continuous");
+}
+
+/* the latency of a partition is from the handoff, not from the read */
+DEFINE(partitionLatency)
+{
+  KafkaCtx kafka;
+  kafka.cnf_ = cnf;
+  kafka.partitions_.resize(cnf->kafka_->nrkt_);
+
+  LuaCtx *ctx = getLuaCtx("basic2");
+  check(ctx->getPartitioner() == PARTITIONER_RANDOM, "partitioner %d", ctx->getPartitioner());
+  int64_t *latency = kafka.partitions_[ctx->rktId()].latency;
+
+  int64_t now = cnf->fasttime(true, TIMEUNIT_MILLI);
+  for (int i = 0; i < 2; ++i) {
+    FileRecord *record = FileRecord::create(0, -1);
+    record->ctx = ctx;
+    record->time = now - 5000;
+    record->handoff = i == 0 ? now - 20 : 0;   // the second never reached librdkafka
+
+    rd_kafka_message_t rkm;
+    memset(&rkm, 0, sizeof(rkm));
+    rkm.err = RD_KAFKA_RESP_ERR__MSG_TIMED_OUT;
+    rkm.partition = 1;
+    rkm._private = record;
+
+    util::atomic_inc(&ctx->fileReader_->pending_);
+    cnf->stats()->queueSizeInc();
+    KafkaCtx::dr_msg_cb(0, &rkm, &kafka);
+    check(latency[1] == 20, "#%d latency %d", i, (int) latency[1]);
+  }
+}
+
+DEFINE(packLines)
+{
+  LuaCtx *ctx = getLuaCtx("basic");
+  int packlines = ctx->packlines_;
+  ctx->packlines_ = 2;
+
+  FileReader reader(ctx);
+  std::vector<FileRecord *> records;
+  const char *lines[] = {"abc", "defg", "hi"};
+  for (int i = 0; i < 3; ++i) {
+    FileRecord *record = FileRecord::create(77, i * 5);
+    record->payload()->assign(lines[i]);
+    records.push_back(record);
+  }
+  reader.packLines(77, &records);
+  check(records.size() == 2, "%d", (int) records.size());
+
+  std::string header = "&" + cnf->host() + "@77@" + std::string(PADDING_LEN, '0') + " ";
+  check(records[0]->data->compare(0, header.size(), header) == 0, "%s", PTRS(*records[0]->data));
+  header = "&" + cnf->host() + "@77@" + util::toStr(10, PADDING_LEN) + " ";
+  check(records[1]->data->compare(0, header.size(), header) == 0, "%s", PTRS(*records[1]->data));
+  check(records[0]->off == 5 && records[1]->off == 10, "%d %d", (int) records[0]->off, (int) records[1]->off);
+  check(records[1]->seq == records[0]->seq + 1 && reader.acks_.size() == 2, "%d", (int) reader.acks_.size());
+
+  for (size_t i = 0; i < records.size(); ++i) FileRecord::destroy(records[i]);
+  ctx->packlines_ = packlines;
+}
+
+DEFINE(shareChunk)
+{
+  FileReader reader(getLuaCtx("basic"));
+  reader.chunk_ = ReadChunk::create(64);
+  memcpy(reader.chunk_->data(), "12\n45", 5);
+  reader.npos_ = 5;
+
+  int64_t pinned = ReadChunk::pinnedBytes();
+  ReadChunk *held = reader.chunk_->ref();
+  reader.shiftChunk(3);
+  check(reader.chunk_ != held, "shared chunk was written");
+  check(memcmp(held->data(), "12\n45", 5) == 0, "%.*s", 5, held->data());
+  check(reader.npos_ == 2, "%d", (int) reader.npos_);
+  check(memcmp(reader.chunk_->data(), "45", 2) == 0, "%.*s", 2, reader.chunk_->data());
+
+  /* the chunk left to the records is pinned until they release it */
+  check(ReadChunk::pinnedBytes() == pinned + 64, "pinned %ld", (long) ReadChunk::pinnedBytes());
+  held->unref();
+  check(ReadChunk::pinnedBytes() == pinned, "pinned %ld", (long) ReadChunk::pinnedBytes());
+
+  ReadChunk *chunk = reader.chunk_;
+  reader.shiftChunk(1);
+  check(reader.chunk_ == chunk, "chunk not shared should be reused");
+  check(reader.npos_ == 1 && reader.chunk_->data()[0] == '5', "%d", (int) reader.npos_);
+
+  FileRecord *record = FileRecord::create(1, 0);
+  record->reference(chunk, chunk->data(), 1);
+  check(record->ptr() == chunk->data() && record->len() == 1, "%d", (int) record->len());
+  check(chunk->shared(), "record should hold the chunk");
+  FileRecord::destroy(record);
+  check(!chunk->shared(), "record should release the chunk");
+
+  /* a released buffer is reused by the next chunk of the same capacity */
+  ReadChunk *released = ReadChunk::create(64);
+  char *data = released->data();
+  released->unref();
+  ReadChunk *reused = ReadChunk::create(64);
+  check(reused->data() == data, "released buffer should be reused");
+  reused->unref();
+}
+
+DEFINE(fileSink)
+{
+  FileSink sink(cnf);
+  check(sink.init(LOG("sink.out"), cnf->errbuf()), "%s", cnf->errbuf());
+
+  FileReader *reader = getLuaCtx("basic")->getFileReader();
+  FileRecord *record = FileRecord::create(0, -1);
+  record->ctx = getLuaCtx("basic");
+  record->payload()->assign("abc\n");
+  util::atomic_inc(&reader->pending_);
+
+  std::vector<FileRecord *> records(1, record);
+  check(sink.produce(&records), "file sink produce error");
+  check(reader->pending() == 0, "record should be acked, pending %d", reader->pending());
+
+  std::vector<std::string> lines;
+  sys::file2vector(LOG("sink.out"), &lines);
+  check(lines.size() == 1 && lines[0] == "abc", "%d", (int) lines.size());
+  unlink(LOG("sink.out"));
+
+  /* a failed write drops the records, they are not left pending */
+  FileSink full(cnf);
+  check(full.init("/dev/full", cnf->errbuf()), "%s", cnf->errbuf());
+
+  records.clear();
+  for (int i = 0; i < 2; ++i) {
+    record = FileRecord::create(0, -1);
+    record->ctx = getLuaCtx("basic");
+    record->payload()->assign("abc\n");
+    util::atomic_inc(&reader->pending_);
+    records.push_back(record);
+  }
+
+  long errors = cnf->stats()->logError();
+  check(!full.produce(&records), "write to /dev/full should fail");
+  check(reader->pending() == 0, "records should be dropped, pending %d", reader->pending());
+  check(cnf->stats()->logError() == errors + 2, "%ld", (long) cnf->stats()->logError());
+}
+
+DEFINE(spool)
+{
+  Spool spool;
+  /* two frames of 56 bytes header, abc\n and k1 defg\n */
+  check(spool.init(LOG("spool"), 130, cnf->errbuf()), "%s", cnf->errbuf());
+
+  LuaCtx *ctx = getLuaCtx("basic");
+  const char *lines[] = {"abc\n", "defg\n", "hijkl\n"};
+  FileRecord *records[3];
+  for (int i = 0; i < 3; ++i) {
+    records[i] = FileRecord::create(7, i * 10);
+    records[i]->ctx = ctx;
+    records[i]->seq = i + 100;
+    records[i]->payload()->assign(lines[i]);
+  }
+  records[1]->keyBuffer()->assign("k1");
+  records[1]->keyHash = 42;
+
+  check(spool.push(records[0]) && spool.push(records[1]), "spool push error");
+  check(!spool.push(records[2]), "spool should be full, size %d", (int) spool.size());
+  check(spool.records() == 2 && spool.size() == 123, "%d %d", (int) spool.records(), (int) spool.size());
+
+  FileRecord *record, *again;
+  check(spool.front(&record) && spool.front(&again) && record == again, "spool front error");
+  check(*record->payload() == "abc\n" && record->key == 0, "%s", PTRS(*record->payload()));
+  check(record->ctx == ctx && record->inode == 7 && record->off == 0 && record->seq == 100,
+        "%d %d %d", (int) record->inode, (int) record->off, (int) record->seq);
+  spool.pop();
+  FileRecord::destroy(record);
+
+  check(spool.push(records[2]), "spool push error");
+  for (int i = 1; i < 3; ++i) {
+    check(spool.front(&record), "spool front %d error", i);
+    check(*record->payload() == lines[i], "%s", PTRS(*record->payload()));
+    check(record->off == i * 10 && record->seq == (uint64_t) i + 100, "%d %d", (int) record->off, (int) record->seq);
+    if (i == 1) check(record->key && *record->key == "k1" && record->keyHash == 42, "key error");
+    spool.pop();
+    FileRecord::destroy(record);
+  }
+  check(spool.empty() && spool.size() == 0 && spool.segments_.empty(), "spool should be empty");
+}
+
+DEFINE(drrLimit)
+{
+  const off_t quantum = 32 * 1024 * 1024;
+
+  LuaCtx *ctx = getLuaCtx("basic");
+  FileReader *reader = ctx->getFileReader();
+  off_t size = reader->size_;
+  bool eof = reader->eof_;
+
+  reader->deficit_ = 0;
+  reader->limitTail(0, 3 * quantum, true);
+  check(reader->size_ == quantum && reader->backlog(), "%ld", (long) reader->size_);
+  check(reader->deficit_ == 0 && !reader->eof_, "deficit %ld", (long) reader->deficit_);
+
+  /* weight 2 reads twice as much in one round, and catches up */
+  ctx->weight_ = 2;
+  reader->limitTail(quantum, 3 * quantum, true);
+  check(reader->size_ == 3 * quantum && !reader->backlog(), "%ld", (long) reader->size_);
+  check(reader->deficit_ == 0 && reader->eof_, "deficit %ld", (long) reader->deficit_);
+
+  /* the START/END of a rotation are not scheduled */
+  reader->limitTail(0, 3 * quantum, false);
+  check(reader->size_ == 3 * quantum && reader->deficit_ == 0, "%ld", (long) reader->size_);
+
+  int64_t rounds, total, max;
+  reader->markReady();
+  reader->served();
+  check(reader->waitStats(&rounds, &total, &max) && rounds == 1, "%ld", (long) rounds);
+  check(!reader->waitStats(&rounds, &total, &max), "wait stats reset");
+
+  ctx->weight_ = 1;
+  reader->size_ = size;
+  reader->eof_ = eof;
+}
+
+/* a history file cut by backfill_rate is tailed again in the next
+ * second, it reaches the end at the rate, not at the check interval
+ */
+DEFINE(backfillRate)
+{
+  LuaCtx *ctx = getLuaCtx("basic");
+  FileReader *reader = ctx->getFileReader();
+  off_t size = reader->size_;
+  bool eof = reader->eof_;
+
+  int64_t now = cnf->fasttime(true, TIMEUNIT_SECONDS) + 100;
+  cnf->timeval_.tv_sec = now;
+  InotifyCtx inotify(cnf);
+
+  reader->backfill_ = true;
+  cnf->backfillRate_ = 1;
+  const off_t fileSize = (3 << 20) + (512 << 10);
+
+  off_t off = 0;
+  int seconds = 0;
+  while (true) {
+    reader->limitTail(off, fileSize, false);
+    ++seconds;
+    if (reader->eof_) break;
+
+    check(reader->size_ - off == 1 << 20, "second %d read %ld", seconds, (long) (reader->size_ - off));
+    check(reader->throttled() && reader->backlog(), "second %d should be throttled", seconds);
+
+    /* the quota is spent, the file waits for the next second, not for the check */
+    std::vector<LuaCtx *> ctxs(1, ctx);
+    inotify.addBacklog(ctxs);
+    check(inotify.backlog_.empty() && inotify.getFileTimer(ctx)->backfill.expire() == now + 1,
+          "second %d not requeued at the next second", seconds);
+
+    off = reader->size_;
+    reader->limitTail(off, fileSize, false);
+    check(reader->size_ == off && reader->throttled(), "second %d read after the quota", seconds);
+
+    inotify.expireTimers();
+    check(inotify.modified_.empty(), "tailed before the next second");
+    cnf->timeval_.tv_sec = ++now;
+    inotify.expireTimers();
+    check(inotify.modified_.size() == 1 && inotify.modified_[0] == ctx, "second %d not tailed", seconds);
+    inotify.modified_.clear();
+    inotify.modifiedSet_.clear();
+  }
+  check(seconds == 4 && reader->size_ == fileSize && !reader->throttled() && !reader->backlog(),
+        "%d seconds, size %ld", seconds, (long) reader->size_);
+
+  cnf->backfillRate_ = 0;
+  reader->backfill_ = false;
+  reader->size_ = size;
+  reader->eof_ = eof;
+  cnf->fasttime(true, TIMEUNIT_SECONDS);
+}
+
+static std::vector<FileRecord *> *popRecords(LuaCtx *ctx)
+{
+  void *nptr;
+  if (cnf->queue(ctx->shard())->pop(&nptr, 1, false) != 1) return 0;
+  return (std::vector<FileRecord *> *) nptr;
+}
+
+static void ackRecords(std::vector<FileRecord *> *records)
+{
+  for (std::vector<FileRecord *>::iterator ite = records->begin(); ite != records->end(); ++ite) {
+    (*ite)->ctx->getFileReader()->updateFileOffRecord(*ite);
+    FileRecord::destroy(*ite);
+  }
+  FileRecord::destroyVector(records);
+}
+
+DEFINE(mmapTail)
+{
+  LuaCtx *ctx = getLuaCtx("basic");
+  FileReader *reader = ctx->getFileReader();
+  off_t size = reader->size_;
+  const off_t pagesize = sysconf(_SC_PAGESIZE);
+
+  int fd = open(LOG("basic.log"), O_WRONLY | O_TRUNC);
+  write(fd, "abc\ndef\ngh", 10);
+  lseek(reader->fd_, 0, SEEK_SET);
+
+  off_t off = 0;
+  reader->size_ = 10;
+  check(reader->tailMmap(&off), "tailMmap error");
+  check(off == 10 && lseek(reader->fd_, 0, SEEK_CUR) == 8, "off %ld", (long) off);
+
+  std::vector<FileRecord *> *records = popRecords(ctx);
+  check(records && records->size() == 2, "%d", records ? (int) records->size() : -1);
+  check(records->at(1)->off == 4 && records->at(1)->data->find("def") != std::string::npos,
+        "%s", PTRS(*records->at(1)->data));
+  ackRecords(records);
+
+  /* the file is truncated after the stat, the pages past the end raise SIGBUS */
+  ftruncate(fd, 0);
+  write(fd, "ijk\nlm", 6);
+  lseek(reader->fd_, 0, SEEK_SET);
+
+  off = 0;
+  reader->size_ = 3 * pagesize;
+  check(reader->tailMmap(&off), "tailMmap error");
+  check(off == 4 && lseek(reader->fd_, 0, SEEK_CUR) == 4, "truncated, off %ld", (long) off);
+
+  records = popRecords(ctx);
+  check(records && records->size() == 1, "%d", records ? (int) records->size() : -1);
+  check(records->at(0)->data->find("ijk") != std::string::npos, "%s", PTRS(*records->at(0)->data));
+  ackRecords(records);
+  check(!popRecords(ctx), "no line from the zero pages");
+
+  ftruncate(fd, 0);
+  close(fd);
+  lseek(reader->fd_, 0, SEEK_SET);
+  reader->size_ = size;
+}
+
+/* the io_uring fallback reads what prepareTail() charged, no new stat */
+DEFINE(finishTail)
+{
+  LuaCtx *ctx = getLuaCtx("basic");
+  FileReader *reader = ctx->getFileReader();
+  off_t size = reader->size_;
+
+  int fd = open(LOG("basic.log"), O_WRONLY | O_TRUNC);
+  write(fd, "abc\ndef\n", 8);
+  lseek(reader->fd_, 0, SEEK_SET);
+
+  check(reader->prepareTail(), "prepareTail should have data");
+  check(reader->roff_ == 0 && reader->size_ == 8, "%ld %ld", (long) reader->roff_, (long) reader->size_);
+
+  /* the file grows after the prepare, the rest waits for the next tail */
+  write(fd, "ghi\n", 4);
+  reader->deficit_ = 12345;
+  reader->finishTail();
+  check(reader->deficit_ == 12345, "deficit charged again %ld", (long) reader->deficit_);
+  check(lseek(reader->fd_, 0, SEEK_CUR) == 8, "%ld", (long) lseek(reader->fd_, 0, SEEK_CUR));
+
+  int lines = 0;
+  std::vector<FileRecord *> *records;
+  while ((records = popRecords(ctx))) {
+    for (size_t i = 0; i < records->size(); ++i) {
+      if (records->at(i)->off != (off_t) -1) ++lines;
+    }
+    ackRecords(records);
+  }
+  check(lines == 2, "%d", lines);
+
+  ftruncate(fd, 0);
+  close(fd);
+  lseek(reader->fd_, 0, SEEK_SET);
+  reader->deficit_ = 0;
+  reader->size_ = size;
+}
+
+DEFINE(globSource)
+{
+  check(GlobSource::isGlob("/data/logs/app-*.log"), "wildcard in basename");
+  check(!GlobSource::isGlob("/data/logs-1/app.log"), "no wildcard");
+
+  char errbuf[MAX_ERR_LEN];
+  check(GlobSource::create(cnf, "logs*/app-*.log", errbuf) == 0, "wildcard in directory");
+
+  GlobSource *glob = GlobSource::create(cnf, LOG("app-*.log"), errbuf);
+  check(glob != 0, "%s", errbuf);
+  check(glob->path("app-1.log") == LOG("app-1.log"), "%s", glob->path("app-1.log").c_str());
+  check(glob->match("app-1.log") && !glob->match("app-1.log.1") && !glob->match("basic.log"), "match");
+
+  /* a rotated file which matches the pattern is not a new file */
+  glob->ignore("app-1.log", true);
+  check(glob->ignored("app-1.log"), "ignored");
+  glob->ignore("app-1.log", false);
+  check(!glob->ignored("app-1.log") && glob->find("app-1.log") == 0, "not ignored");
+
+  /* after an overflow, an untracked file is new, an ignored one is not */
+  FILE *fp = fopen(LOG("app-9.log"), "w");
+  fclose(fp);
+  fp = fopen(LOG("app-8.log"), "w");
+  fclose(fp);
+  glob->ignore("app-8.log", true);
+
+  std::vector<std::string> changed, gone;
+  check(glob->rescan(&changed, &gone, errbuf), "%s", errbuf);
+  check(std::find(changed.begin(), changed.end(), "app-9.log") != changed.end(), "rescan new file");
+  check(std::find(changed.begin(), changed.end(), "app-8.log") == changed.end(), "rescan ignored file");
+  check(gone.empty(), "rescan gone %d", (int) gone.size());
+  unlink(LOG("app-9.log"));
+  unlink(LOG("app-8.log"));
+  delete glob;
+}
+
 DEFINE(watchLoop)
 {
   RunStatus *runStatus = RunStatus::create();
@@ -432,8 +1488,8 @@ DEFINE(watchLoop)
 
   rename(LOG("basic.log"), LOG("basic.log.1"));
 
-  uintptr_t nptr;
-  read(cnf->accept, &nptr, sizeof(nptr));
+  void *nptr;
+  cnf->queue(0)->pop(&nptr, 1);
 
   // ignore memory leak
   std::vector<FileRecord *> *records = (std::vector<FileRecord*>*) nptr;
@@ -444,7 +1500,7 @@ DEFINE(watchLoop)
   ptr = records->at(0)->data;
   check(ptr->find("\"event\":\"START\"") != std::string::npos, "%s", PTRS(*ptr));
 
-  read(cnf->accept, &nptr, sizeof(nptr));
+  cnf->queue(0)->pop(&nptr, 1);
   records = (std::vector<FileRecord*>*) nptr;
 
   check(records->size() == 2, "%d", (int) records->size());
@@ -454,7 +1510,7 @@ DEFINE(watchLoop)
   ptr = records->at(1)->data;
   check(*ptr == "*" + cnf->host() + "@" + util::toStr(sizeof("456\n"), PADDING_LEN) + " 789\n", "%s", PTRS(*ptr));
 
-  read(cnf->accept, &nptr, sizeof(nptr));
+  cnf->queue(0)->pop(&nptr, 1);
   records = (std::vector<FileRecord*>*) nptr;
 
   check(records->size() == 1, "%d", (int) records->size());
@@ -470,7 +1526,7 @@ DEFINE(watchLoop)
   write(fd, "abcd\nefg\n", sizeof("abcd\nefg\n")-1);
   close(fd);
 
-  read(cnf->accept, &nptr, sizeof(nptr));
+  cnf->queue(0)->pop(&nptr, 1);
   records = (std::vector<FileRecord *>*) nptr;
 
   check(records->size() == 1, "%d", (int) records->size());
@@ -478,7 +1534,7 @@ DEFINE(watchLoop)
   ptr = records->at(0)->data;
   check(ptr->find("\"event\":\"START\"") != std::string::npos, "%s", PTRS(*ptr));
 
-  read(cnf->accept, &nptr, sizeof(nptr));
+  cnf->queue(0)->pop(&nptr, 1);
   records = (std::vector<FileRecord*>*) nptr;
 
   check(records->size() == 1, "%d", (int) records->size());
@@ -489,7 +1545,7 @@ DEFINE(watchLoop)
   sleep(10);
   rename(LOG("basic.log"), LOG("basic.log.2"));  // rename here to avoid rotate too frequent
 
-  read(cnf->accept, &nptr, sizeof(nptr));
+  cnf->queue(0)->pop(&nptr, 1);
   records = (std::vector<FileRecord*>*) nptr;
 
   check(records->size() == 1, "%d", (int) records->size());
@@ -534,19 +1590,44 @@ int main()
 
   TEST(split);
   TEST(split_n);
+  TEST(splitField);
   TEST(iso8601);
+  TEST(scanLines);
+  TEST(spscRing);
+  TEST(timerWheel);
+  TEST(taskQueue);
+  TEST(ioUring);
 
   TEST(loadCnf);
   TEST(loadLuaCtx);
   TEST(filter);
   TEST(grep);
   TEST(transform);
+  TEST(luaWorkers);
+  TEST(luaWorkersDestroy);
   TEST(aggregate);
 
   TEST(initKafka);
+  TEST(keyPartitioner);
+  TEST(kafkaStats);
+  TEST(kafkaRetry);
+  TEST(choosePartition);
   TEST(initFileOff);
   TEST(initFileReader);
   TEST(reinitFileOff);
+  TEST(recordPool);
+  TEST(ackWindow);
+  TEST(partitionLatency);
+  TEST(packLines);
+  TEST(shareChunk);
+  TEST(fileSink);
+  TEST(spool);
+  TEST(drrLimit);
+  TEST(backfillRate);
+  TEST(mmapTail);
+  TEST(finishTail);
+  TEST(globSource);
+  TEST(inotifyCoalesce);
   TEST(watchLoop);
 
   DO(clean);
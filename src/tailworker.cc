@@ -0,0 +1,208 @@
+#include "util.h"
+#include "gnuatomic.h"
+#include "logger.h"
+#include "common.h"
+#include "luactx.h"
+#include "filereader.h"
+#include "tailworker.h"
+
+/* a file which spent its deficit goes to the end of the queue,
+ * behind the files which were waiting
+ */
+class TailTask : public util::TaskQueue::Task {
+public:
+  TailTask(TailWorker *worker, LuaCtx *ctx) : worker_(worker), ctx_(ctx) {}
+
+  bool doIt() {
+    util::atomic_set(ctx_->tailPending(), 0);
+    ctx_->getFileReader()->tail2kafka();
+    worker_->requeue(ctx_);
+    return true;
+  }
+
+private:
+  TailWorker *worker_;
+  LuaCtx     *ctx_;
+};
+
+class CheckTask : public util::TaskQueue::Task {
+public:
+  CheckTask(TailWorker *worker, UringTail *uringTail, const std::vector<LuaCtx *> &ctxs)
+    : worker_(worker), uringTail_(uringTail), ctxs_(ctxs) {}
+
+  bool doIt() {
+    uringTail_->checkFiles(ctxs_);
+    for (std::vector<LuaCtx *>::iterator ite = ctxs_.begin(); ite != ctxs_.end(); ++ite) {
+      worker_->requeue(*ite);
+    }
+    return true;
+  }
+
+private:
+  TailWorker            *worker_;
+  UringTail             *uringTail_;
+  std::vector<LuaCtx *>  ctxs_;
+};
+
+class TagRotateTask : public util::TaskQueue::Task {
+public:
+  TagRotateTask(LuaCtx *ctx, const std::string &newFile) : ctx_(ctx), newFile_(newFile) {}
+
+  bool doIt() {
+    ctx_->getFileReader()->tagRotate(FILE_MOVED, newFile_.c_str());
+    return true;
+  }
+
+private:
+  LuaCtx      *ctx_;
+  std::string  newFile_;
+};
+
+class RemoveTask : public util::TaskQueue::Task {
+public:
+  RemoveTask(TailWorker *worker, LuaCtx *ctx, int wd) : worker_(worker), ctx_(ctx), wd_(wd) {}
+
+  bool doIt() {
+    util::atomic_set(ctx_->removePending(), 0);
+    if (ctx_->getFileReader()->remove()) worker_->addRemoved(wd_);
+    return true;
+  }
+
+private:
+  TailWorker *worker_;
+  LuaCtx     *ctx_;
+  int         wd_;
+};
+
+/* a new file of a glob pattern, or a removed one reused for the name */
+class InitGlobTask : public util::TaskQueue::Task {
+public:
+  InitGlobTask(LuaCtx *ctx, const std::string &file) : ctx_(ctx), file_(file) {}
+
+  bool doIt() {
+    char errbuf[MAX_ERR_LEN];
+    if (!ctx_->initGlobFile(file_, true, errbuf)) {
+      log_error(0, "glob add %s error %s", file_.c_str(), errbuf);
+    }
+    return true;
+  }
+
+private:
+  LuaCtx      *ctx_;
+  std::string  file_;
+};
+
+class SuspendTask : public util::TaskQueue::Task {
+public:
+  SuspendTask(LuaCtx *ctx) : ctx_(ctx) {}
+
+  bool doIt() {
+    ctx_->getFileReader()->suspend();
+    return true;
+  }
+
+private:
+  LuaCtx *ctx_;
+};
+
+/* the rest of a deleted file may take more than one quantum */
+class RetireTask : public util::TaskQueue::Task {
+public:
+  RetireTask(TailWorker *worker, LuaCtx *ctx) : worker_(worker), ctx_(ctx) {}
+
+  bool doIt() {
+    ctx_->getFileReader()->retire();
+    worker_->requeue(ctx_);
+    return true;
+  }
+
+private:
+  TailWorker *worker_;
+  LuaCtx     *ctx_;
+};
+
+TailWorker::TailWorker(int id, bool iouring)
+  : tq_("tail" + util::toStr(id)), uringTail_(iouring)
+{
+  pthread_mutex_init(&mutex_, 0);
+}
+
+TailWorker::~TailWorker()
+{
+  pthread_mutex_destroy(&mutex_);
+}
+
+void TailWorker::tail(LuaCtx *ctx)
+{
+  if (util::atomic_set(ctx->tailPending(), 1) == 0) {
+    ctx->getFileReader()->markReady();
+    tq_.submit(new TailTask(this, ctx));
+  }
+}
+
+void TailWorker::checkFiles(const std::vector<LuaCtx *> &ctxs)
+{
+  tq_.submit(new CheckTask(this, &uringTail_, ctxs));
+}
+
+void TailWorker::tagRotate(LuaCtx *ctx, const std::string &newFile)
+{
+  tq_.submit(new TagRotateTask(ctx, newFile));
+}
+
+void TailWorker::remove(LuaCtx *ctx, int wd)
+{
+  if (util::atomic_set(ctx->removePending(), 1) == 0) tq_.submit(new RemoveTask(this, ctx, wd));
+}
+
+void TailWorker::initGlob(LuaCtx *ctx, const std::string &file)
+{
+  tq_.submit(new InitGlobTask(ctx, file));
+}
+
+void TailWorker::suspend(LuaCtx *ctx)
+{
+  tq_.submit(new SuspendTask(ctx));
+}
+
+void TailWorker::retire(LuaCtx *ctx)
+{
+  tq_.submit(new RetireTask(this, ctx));
+}
+
+void TailWorker::addRemoved(int wd)
+{
+  pthread_mutex_lock(&mutex_);
+  removed_.push_back(wd);
+  pthread_mutex_unlock(&mutex_);
+}
+
+bool TailWorker::getRemoved(std::vector<int> *wds)
+{
+  pthread_mutex_lock(&mutex_);
+  wds->insert(wds->end(), removed_.begin(), removed_.end());
+  removed_.clear();
+  pthread_mutex_unlock(&mutex_);
+  return !wds->empty();
+}
+
+void TailWorker::requeue(LuaCtx *ctx)
+{
+  FileReader *reader = ctx->getFileReader();
+  if (reader->throttled()) {
+    pthread_mutex_lock(&mutex_);
+    throttled_.push_back(ctx);
+    pthread_mutex_unlock(&mutex_);
+  } else if (reader->backlog()) {
+    tail(ctx);
+  }
+}
+
+bool TailWorker::getThrottled(std::vector<LuaCtx *> *ctxs)
+{
+  pthread_mutex_lock(&mutex_);
+  ctxs->insert(ctxs->end(), throttled_.begin(), throttled_.end());
+  throttled_.clear();
+  pthread_mutex_unlock(&mutex_);
+  return !ctxs->empty();
+}
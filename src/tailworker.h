@@ -0,0 +1,54 @@
+#ifndef _TAIL_WORKER_H_
+#define _TAIL_WORKER_H_
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "taskqueue.h"
+#include "uringtail.h"
+
+class LuaCtx;
+
+/* a tail thread owns a shard of the files, every operation on the readers
+ * of a file runs on the thread of its shard, in the order it was dispatched,
+ * so the reads, the batches and the checkpoint of a file keep their order
+ */
+class TailWorker {
+public:
+  TailWorker(int id, bool iouring);
+  ~TailWorker();
+
+  bool start(char *errbuf) { return tq_.start(errbuf, 1); }
+  void stop() { tq_.stop(); }
+
+  void tail(LuaCtx *ctx);
+  void checkFiles(const std::vector<LuaCtx *> &ctxs);
+  void tagRotate(LuaCtx *ctx, const std::string &newFile);
+  void remove(LuaCtx *ctx, int wd);
+
+  /* the files of a glob pattern, see FileReader::suspend and retire */
+  void initGlob(LuaCtx *ctx, const std::string &file);
+  void suspend(LuaCtx *ctx);
+  void retire(LuaCtx *ctx);
+
+  /* watch descriptors whose file was reopened by remove() */
+  void addRemoved(int wd);
+  bool getRemoved(std::vector<int> *wds);
+
+  /* a file with a backlog is tailed again now, one cut by backfill_rate
+   * waits for the inotify thread to tail it in the next second
+   */
+  void requeue(LuaCtx *ctx);
+  bool getThrottled(std::vector<LuaCtx *> *ctxs);
+
+private:
+  util::TaskQueue   tq_;
+  UringTail         uringTail_;  // used by the tail thread only
+
+  pthread_mutex_t        mutex_;
+  std::vector<int>       removed_;
+  std::vector<LuaCtx *>  throttled_;
+};
+
+#endif
@@ -5,7 +5,7 @@ using namespace util;
 TaskQueue::Task::~Task() {}
 
 TaskQueue::TaskQueue(const std::string &nam)
-  : name_(nam), quit_(true)
+  : name_(nam), quit_(true), force_(false)
 {
   pthread_mutex_init(&mutex_, 0);
   pthread_cond_init(&cond_, 0);
@@ -26,33 +26,23 @@ void *TaskQueue::run(void *ctx)
   return 0;
 }
 
+/* after stop() the queued tasks are still done, unless it is forced */
 void TaskQueue::run()
 {
-  quit_ = false;
-
   while (true) {
     pthread_mutex_lock(&mutex_);
-    if (tasks_.empty()) {
-      if (!quit_) {
-        pthread_cond_wait(&cond_, &mutex_);
-      } else {
-        pthread_mutex_unlock(&mutex_);
-        break;
-      }
+    while (tasks_.empty() && !quit_) {
+      pthread_cond_wait(&cond_, &mutex_);
+    }
+    if (tasks_.empty() || force_) {
+      pthread_mutex_unlock(&mutex_);
+      break;
     }
 
     Task *task = tasks_.front();
     tasks_.pop();
     pthread_mutex_unlock(&mutex_);
 
-    if (task == (Task *) 0) {
-      quit_ = true;
-      break;
-    } else if (task == (Task *) 0x01) {
-      quit_ = true;
-      continue;
-    }
-
     if (task->doIt()) {
       delete task;
     } else {
@@ -59,6 +59,11 @@ public:
   static void* run(void *ctx);
 
   bool start(char *errbuf, size_t nthread = 1) {
+    pthread_mutex_lock(&mutex_);
+    quit_  = false;
+    force_ = false;
+    pthread_mutex_unlock(&mutex_);
+
     bool ret = true;
     for (size_t i = 0; ret && i < nthread; ++i) {
       pthread_t tid;
@@ -72,15 +77,18 @@ public:
     }
 
     if (!ret) stop(true);
-    else quit_ = false;
-
     return ret;
   }
 
   void run();
 
+  /* every thread wakes up, quits when the queue is empty, or at once if forced */
   void stop(bool force = false) {
-    submit(static_cast<Task *>(force ? 0 : (void *) 0x01));
+    pthread_mutex_lock(&mutex_);
+    quit_  = true;
+    force_ = force;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
 
     for (std::vector<pthread_t>::iterator ite = tids_.begin(); ite != tids_.end(); ++ite) {
       pthread_join(*ite, 0);
@@ -93,6 +101,7 @@ public:
 private:
   std::string name_;
   bool quit_;
+  bool force_;
   std::queue<Task *> tasks_;
   std::vector<pthread_t> tids_;
 
@@ -0,0 +1,149 @@
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+
+namespace util {
+
+/* hierarchical timer wheel with one second ticks, add and remove are
+ * O(1) and a tick costs only the timers which expire in it, so a
+ * thousand idle files cost nothing between their deadlines.
+ * level 0 has one slot per second, a slot of level n covers 64^n seconds
+ * and is spread into the lower levels when the wheel gets there
+ */
+class TimerWheel {
+public:
+  class Timer {
+  public:
+    Timer(int type = 0, void *data = 0)
+      : type_(type), data_(data), expire_(0), prev_(0), next_(0) {}
+    ~Timer() { assert(!pending()); }
+
+    int type() const { return type_; }
+    void *data() const { return data_; }
+    int64_t expire() const { return expire_; }
+    bool pending() const { return prev_ != 0; }
+
+  private:
+    Timer(const Timer &);
+    Timer &operator=(const Timer &);
+
+    friend class TimerWheel;
+    int      type_;
+    void    *data_;
+    int64_t  expire_;
+    Timer   *prev_;
+    Timer   *next_;
+  };
+
+  static const int BITS   = 6;
+  static const int SLOTS  = 1 << BITS;
+  static const int LEVELS = 4;   // 64^4 seconds, longer deadlines are clamped
+
+  TimerWheel(int64_t now) : now_(now), size_(0) {
+    for (int l = 0; l < LEVELS; ++l) {
+      for (int i = 0; i < SLOTS; ++i) {
+        slots_[l][i].prev_ = slots_[l][i].next_ = &slots_[l][i];
+      }
+    }
+  }
+
+  /* the slots are sentinels, the timers stay with their owners */
+  ~TimerWheel() {
+    for (int l = 0; l < LEVELS; ++l) {
+      for (int i = 0; i < SLOTS; ++i) {
+        Timer *head = &slots_[l][i];
+        while (head->next_ != head) remove(head->next_);
+        head->prev_ = head->next_ = 0;
+      }
+    }
+  }
+
+  int64_t now() const { return now_; }
+  size_t size() const { return size_; }
+
+  /* a pending timer is moved, a deadline in the past expires at the next tick */
+  void add(Timer *timer, int64_t expire) {
+    if (timer->pending()) remove(timer);
+    timer->expire_ = expire;
+    link(timer);
+    ++size_;
+  }
+
+  void remove(Timer *timer) {
+    if (!timer->pending()) return;
+    timer->prev_->next_ = timer->next_;
+    timer->next_->prev_ = timer->prev_;
+    timer->prev_ = timer->next_ = 0;
+    --size_;
+  }
+
+  /* tick up to now, the expired timers are removed and appended tick
+   * by tick, a clock which goes back waits for the wheel
+   */
+  void expire(int64_t now, std::vector<Timer *> *timers) {
+    while (now_ < now) {
+      ++now_;
+
+      /* the slot of the level above is due when the level below wraps */
+      for (int l = 1; l < LEVELS && (now_ & ((1LL << (BITS * l)) - 1)) == 0; ++l) {
+        cascade(&slots_[l][(now_ >> (BITS * l)) & (SLOTS - 1)], timers);
+      }
+
+      Timer *head = &slots_[0][now_ & (SLOTS - 1)];
+      while (head->next_ != head) {
+        Timer *timer = head->next_;
+        remove(timer);
+        timers->push_back(timer);
+      }
+    }
+  }
+
+private:
+  TimerWheel(const TimerWheel &);
+  TimerWheel &operator=(const TimerWheel &);
+
+  void link(Timer *timer) {
+    int64_t expire = timer->expire_ > now_ ? timer->expire_ : now_ + 1;
+    int64_t delta = expire - now_;
+
+    int l = 0;
+    while (l < LEVELS - 1 && delta >= (1LL << (BITS * (l + 1)))) ++l;
+    if (delta >= (1LL << (BITS * LEVELS))) expire = now_ + (1LL << (BITS * LEVELS)) - 1;
+
+    Timer *head = &slots_[l][(expire >> (BITS * l)) & (SLOTS - 1)];
+    timer->prev_ = head->prev_;
+    timer->next_ = head;
+    head->prev_->next_ = timer;
+    head->prev_ = timer;
+  }
+
+  /* a timer due at this tick expires here, link() would put it at the next */
+  void cascade(Timer *head, std::vector<Timer *> *timers) {
+    Timer *timer = head->next_;
+    head->prev_ = head->next_ = head;
+    while (timer != head) {
+      Timer *next = timer->next_;
+      if (timer->expire_ <= now_) {
+        timer->prev_ = timer->next_ = 0;
+        --size_;
+        timers->push_back(timer);
+      } else {
+        link(timer);
+      }
+      timer = next;
+    }
+  }
+
+private:
+  int64_t now_;     // the last tick, every deadline up to it has expired
+  size_t  size_;
+  Timer   slots_[LEVELS][SLOTS];
+};
+
+}  // namespace util
+
+#endif
@@ -9,6 +9,7 @@
 #include "logger.h"
 #include "util.h"
 #include "sys.h"
+#include "common.h"
 #include "transform.h"
 
 Transform::~Transform() {}
@@ -97,10 +98,13 @@ bool MessageInfo::extract(const char *payload, size_t len, MessageInfo *info, bo
   char flag = payload[0];
   if (flag == '*') info->type = NMSG;
   else if (flag == '#') info->type = META;
+  else if (flag == '&') info->type = PACK;
   else info->type = MSG;
 
+  info->nonl = nonl;
+
   char *spacePos = 0;
-  if (info->type == META || info->type == NMSG) {
+  if (info->type == META || info->type == NMSG || info->type == PACK) {
     spacePos = (char *) memchr(payload, ' ', len);
     if (!spacePos) return false;
 
@@ -110,6 +114,15 @@ bool MessageInfo::extract(const char *payload, size_t len, MessageInfo *info, bo
       char *atPos = (char *) memchr(payload, '@', spacePos - payload);
       if (!atPos) return false;
       info->host.assign(payload+1, atPos - (payload+1));
+
+      /* a PACK has the inode before the offset */
+      info->inode = 0;
+      if (info->type == PACK) {
+        char *inodePos = atPos + 1;
+        atPos = (char *) memchr(inodePos, '@', spacePos - inodePos);
+        if (!atPos) return false;
+        info->inode = util::toLong(inodePos, atPos - inodePos);
+      }
       info->pos = util::toLong(atPos+1, spacePos - (atPos+1));
     }
   }
@@ -129,6 +142,18 @@ bool MessageInfo::extract(const char *payload, size_t len, MessageInfo *info, bo
 
     Json::Value &val = root["md5"];
     if (!val.isNull()) info->md5  = val.asString();
+  } else if (info->type == PACK) {
+    info->ptr = spacePos + 1;
+    info->len = payload + len - info->ptr;
+
+    /* check the frames once, nextLine trusts them */
+    const char *ptr = info->ptr, *end = payload + len;
+    uint64_t delta, n;
+    for (info->lines = 0; ptr < end; ++info->lines) {
+      if (!util::readVarint(&ptr, end, &delta) || !util::readVarint(&ptr, end, &n)) return false;
+      if (n > (uint64_t) (end - ptr)) return false;
+      ptr += n;
+    }
   } else if (info->type == NMSG) {
     info->ptr = spacePos + 1;
     if (nonl && payload[len-1] == '\n') {
@@ -148,6 +173,68 @@ bool MessageInfo::extract(const char *payload, size_t len, MessageInfo *info, bo
   return true;
 }
 
+#if RD_KAFKA_VERSION >= KAFKA_HEADERS_VERSION
+static bool getHeader(const rd_kafka_headers_t *hdrs, const char *name, const char **value, size_t *size)
+{
+  const void *ptr;
+  if (rd_kafka_header_get_last(hdrs, name, &ptr, size) != RD_KAFKA_RESP_ERR_NO_ERROR || !ptr) return false;
+  *value = (const char *) ptr;
+  return true;
+}
+
+/* a line with the offset header, the payload is the line as it is */
+bool MessageInfo::extract(const rd_kafka_headers_t *hdrs, const char *payload, size_t len,
+                          MessageInfo *info, bool nonl)
+{
+  const char *host, *offset;
+  size_t nhost, noffset;
+  if (!getHeader(hdrs, KAFKA_HEADER_OFFSET, &offset, &noffset) || noffset != 8 ||
+      !getHeader(hdrs, KAFKA_HEADER_HOST, &host, &nhost)) return false;
+
+  info->type = NMSG;
+  info->nonl = nonl;
+  info->host.assign(host, nhost);
+  info->pos  = util::decodeUint64(offset);
+  info->ptr  = payload;
+  info->len  = (nonl && len > 0 && payload[len-1] == '\n') ? len - 1 : len;
+  return true;
+}
+#endif
+
+bool MessageInfo::extract(const rd_kafka_message_t *rkm, MessageInfo *info, bool nonl)
+{
+  const char *payload = (const char *) rkm->payload;
+  size_t len = rkm->len;
+
+#if RD_KAFKA_VERSION >= KAFKA_HEADERS_VERSION
+  rd_kafka_headers_t *hdrs;
+  if (rd_kafka_message_headers(rkm, &hdrs) == RD_KAFKA_RESP_ERR_NO_ERROR &&
+      extract(hdrs, payload, len, info, nonl)) return true;
+#endif
+
+  if (len == 0) return false;
+  return extract(payload, len, info, nonl);
+}
+
+bool MessageInfo::nextLine(const char **line, int *nline)
+{
+  if (len <= 0) return false;
+
+  const char *end = ptr + len;
+  uint64_t delta, n;
+  util::readVarint(&ptr, end, &delta);
+  util::readVarint(&ptr, end, &n);
+
+  pos += delta;
+  *line = ptr;
+  *nline = n;
+  if (nonl && n > 0 && ptr[n-1] == '\n') --*nline;
+
+  ptr += n;
+  len = end - ptr;
+  return true;
+}
+
 void MirrorTransform::addToCache(rd_kafka_message_t *rkm, const MessageInfo &info)
 {
   FdCache &fdCache = fdCache_[info.host];
@@ -169,12 +256,46 @@ void MirrorTransform::addToCache(rd_kafka_message_t *rkm, const MessageInfo &inf
   fdCache.rkms[fdCache.rkmSize++] = rkm;
 }
 
+/* the lines up to the last written offset of the host are duplicates of
+ * a pack resent after a restart
+ */
+void MirrorTransform::addPackToCache(rd_kafka_message_t *rkm, MessageInfo *info)
+{
+  FdCache &fdCache = fdCache_[info->host];
+
+  const char *line;
+  int nline;
+  size_t dup = 0, n = 0;
+  while (info->nextLine(&line, &nline)) {
+    if (info->pos <= fdCache.pos) {
+      ++dup;
+      continue;
+    }
+
+    fdCache.pos = info->pos;
+    struct iovec iov = { (void *) line, static_cast<size_t>(nline) };
+    fdCache.iovs.push_back(iov);
+    ++n;
+  }
+
+  if (dup > 0) {
+    log_error(0, "%s:%d %ld pack has %d duplicate lines", topic_, partition_, rkm->offset, (int) dup);
+  }
+
+  if (n == 0) {
+    rd_kafka_message_destroy(rkm);
+  } else {
+    if (!fdCache.rkms) fdCache.rkms = new rd_kafka_message_t*[IOV_MAX];
+    fdCache.rkms[fdCache.rkmSize++] = rkm;
+  }
+}
+
 bool MirrorTransform::flushCache(bool eof, const std::string &host)
 {
   bool flush = false;
   for (std::map<std::string, FdCache>::iterator ite = fdCache_.begin(); ite != fdCache_.end(); ++ite) {
     FdCache &fdCache = ite->second;
-    if (!(fdCache.rkmSize == IOV_MAX || (eof && host == ite->first))) continue;
+    if (!(fdCache.full() || (eof && host == ite->first))) continue;
 
     flush = true;
     if (fdCache.fd < 0) {
@@ -188,11 +309,15 @@ bool MirrorTransform::flushCache(bool eof, const std::string &host)
       fdCache.fd = fd;
     }
 
-    ssize_t wantn = 0;
-    for (size_t i = 0; i < fdCache.iovs.size(); ++i) wantn += fdCache.iovs[i].iov_len;
+    /* the lines of packs may be more than IOV_MAX */
+    for (size_t start = 0; start < fdCache.iovs.size(); start += IOV_MAX) {
+      size_t iovcnt = std::min(fdCache.iovs.size() - start, (size_t) IOV_MAX);
+
+      ssize_t wantn = 0;
+      for (size_t i = start; i < start + iovcnt; ++i) wantn += fdCache.iovs[i].iov_len;
+      if (wantn == 0) continue;
 
-    if (wantn > 0) {
-      ssize_t n = writev(fdCache.fd, &(fdCache.iovs[0]), fdCache.iovs.size());
+      ssize_t n = writev(fdCache.fd, &(fdCache.iovs[start]), iovcnt);
       if (n != wantn) {
         log_fatal(errno, "%s:%d %s writev error", topic_, partition_, ite->first.c_str());
         exit(EXIT_FAILURE);
@@ -210,13 +335,15 @@ uint32_t MirrorTransform::write(rd_kafka_message_t *rkm, uint64_t *offsetPtr)
   uint64_t offset = rkm->offset;
 
   MessageInfo info;
-  if (!MessageInfo::extract((char *) rkm->payload, rkm->len, &info, false) || info.type == MessageInfo::MSG) {
+  if (!MessageInfo::extract(rkm, &info, false) || info.type == MessageInfo::MSG) {
     log_error(0, "%s:%d unknow message %.*s", topic_, partition_, (int) rkm->len, (char *) rkm->payload);
     return IGNORE | RKMFREE;
   }
 
   if (info.type == MessageInfo::NMSG) {
     addToCache(rkm, info);
+  } else if (info.type == MessageInfo::PACK) {
+    addPackToCache(rkm, &info);
   } else {
     log_info(0, "%s:%d META %ld %.*s", topic_, partition_, rkm->offset, (int) rkm->len, (char *) rkm->payload);
   }
@@ -592,7 +719,7 @@ uint32_t LuaTransform::write(rd_kafka_message_t *rkm, uint64_t *offsetPtr)
   uint64_t offset = rkm->offset;
 
   MessageInfo info;
-  if (!MessageInfo::extract((char *) rkm->payload, rkm->len, &info, true) || info.type == MessageInfo::MSG) {
+  if (!MessageInfo::extract(rkm, &info, true) || info.type == MessageInfo::MSG) {
     log_error(0, "%s:%d unknow message %.*s", topic_, partition_, (int) rkm->len, (char *) rkm->payload);
     return IGNORE | RKMFREE;
   }
@@ -601,16 +728,28 @@ uint32_t LuaTransform::write(rd_kafka_message_t *rkm, uint64_t *offsetPtr)
     return IGNORE | RKMFREE;
   }
 
+  if (info.type != MessageInfo::PACK) return writeLine(info.ptr, info.len, offset, offsetPtr) | RKMFREE;
+
+  /* a rotate in the middle of a pack commits the offset of the pack */
+  uint32_t flags = IGNORE;
+  const char *line;
+  int nline;
+  while (info.nextLine(&line, &nline)) flags |= writeLine(line, nline, offset, offsetPtr);
+  return flags | RKMFREE;
+}
+
+uint32_t LuaTransform::writeLine(const char *ptr, int len, uint64_t offset, uint64_t *offsetPtr)
+{
   std::vector<std::string> fields;
   time_t timestamp;
-  if (!parseFields(info.ptr, info.len, &fields, &timestamp)) return IGNORE | RKMFREE;
+  if (!parseFields(ptr, len, &fields, &timestamp)) return IGNORE;
 
   std::string method, path;
   std::map<std::string, std::string> query;
   if (requestIndex_ >= 0) {
     if (!parseRequest(fields[requestIndex_].c_str(), &method, &path, &query)) {
       log_error(0, "%s:%d invalid request %s", topic_, partition_, fields_[requestIndex_].c_str());
-      return IGNORE | RKMFREE;
+      return IGNORE;
     }
   }
 
@@ -619,8 +758,8 @@ uint32_t LuaTransform::write(rd_kafka_message_t *rkm, uint64_t *offsetPtr)
   uint32_t flags = rotate(intervalCnt, offset, offsetPtr);
 
   if (intervalCnt != currentIntervalCnt_ && intervalCnt != lastIntervalCnt_) {
-    log_info(0, "%s:%d message delay %.*s at %ld", topic_, partition_, info.len, info.ptr, currentTimestamp_);
-    return flags | RKMFREE;
+    log_info(0, "%s:%d message delay %.*s at %ld", topic_, partition_, len, ptr, currentTimestamp_);
+    return flags;
   }
 
   std::string json;
@@ -633,5 +772,5 @@ uint32_t LuaTransform::write(rd_kafka_message_t *rkm, uint64_t *offsetPtr)
     exit(EXIT_FAILURE);
   }
 
-  return flags | RKMFREE;
+  return flags;
 }
@@ -5,21 +5,34 @@
 #include <vector>
 #include <map>
 #include <unistd.h>
+#include <limits.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <librdkafka/rdkafka.h>
 #include <json/json.h>
 
+#include "common.h"
 #include "luahelper.h"
 #include "cmdnotify.h"
 
 struct MessageInfo {
-  enum InfoType { META, NMSG, MSG };
+  enum InfoType { META, NMSG, MSG, PACK };
   static bool extract(const char *payload, size_t len, MessageInfo *info, bool nonl);
+  /* the headers of a kafkaheaders topic, or the payload prefix */
+  static bool extract(const rd_kafka_message_t *rkm, MessageInfo *info, bool nonl);
+#if RD_KAFKA_VERSION >= KAFKA_HEADERS_VERSION
+  static bool extract(const rd_kafka_headers_t *hdrs, const char *payload, size_t len,
+                      MessageInfo *info, bool nonl);
+#endif
+
+  /* the lines of a PACK one by one, pos is the offset of the line */
+  bool nextLine(const char **line, int *nline);
 
   InfoType type;
 
   std::string host;
   long pos;
+  uint64_t inode;   // of a PACK, 0 for the others
 
   std::string file;
   size_t size;
@@ -27,6 +40,9 @@ struct MessageInfo {
 
   const char *ptr;
   int len;
+
+  bool   nonl;
+  size_t lines;   // of a PACK
 };
 
 class Transform {
@@ -77,6 +93,8 @@ public:
       if (rkms) delete[] rkms;
     }
 
+    bool full() const { return rkmSize == IOV_MAX || iovs.size() >= IOV_MAX; }
+
     void clear() {
       for (size_t i = 0; i < rkmSize; ++i) rd_kafka_message_destroy(rkms[i]);
       pos = -1;
@@ -91,6 +109,7 @@ public:
 
 private:
   void addToCache(rd_kafka_message_t *rkm, const MessageInfo &info);
+  void addPackToCache(rd_kafka_message_t *rkm, MessageInfo *info);
   bool flushCache(bool eof, const std::string &host);
 
   std::map<std::string, FdCache> fdCache_;
@@ -138,6 +157,8 @@ public:
   uint32_t timeout(uint64_t *offsetPtr);
 
 private:
+  uint32_t writeLine(const char *ptr, int len, uint64_t offset, uint64_t *offsetPtr);
+
   void updateTimestamp(time_t timestamp) {
     if (currentTimestamp_ == -1 || timestamp > currentTimestamp_) currentTimestamp_ = timestamp;
   }
@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <cstdlib>
+#include <errno.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "iouring.h"
+#include "luactx.h"
+#include "filereader.h"
+#include "uringtail.h"
+
+#define URING_ENTRIES 256
+#define MAX_ERR_LEN   512
+
+UringTail::~UringTail()
+{
+  if (ring_) delete ring_;
+}
+
+bool UringTail::ready()
+{
+  if (!enable_) return false;
+  if (ring_) return true;
+
+  char errbuf[MAX_ERR_LEN];
+  ring_ = util::IoUring::create(URING_ENTRIES, errbuf);
+  if (!ring_) {
+    log_error(0, "%s, fallback to read", errbuf);
+    enable_ = false;
+    return false;
+  }
+
+  log_info(0, "io_uring tail with %u entries", ring_->entries());
+  return true;
+}
+
+void UringTail::disable()
+{
+  delete ring_;
+  ring_ = 0;
+  enable_ = false;
+}
+
+void UringTail::checkFiles(const std::vector<LuaCtx *> &ctxs)
+{
+  for (std::vector<LuaCtx *>::const_iterator ite = ctxs.begin(); ite != ctxs.end(); ++ite) {
+    (*ite)->getFileReader()->checkCache();
+  }
+  tail(ctxs);
+}
+
+void UringTail::tail(const std::vector<LuaCtx *> &ctxs)
+{
+  if (!ready()) {
+    for (std::vector<LuaCtx *>::const_iterator ite = ctxs.begin(); ite != ctxs.end(); ++ite) {
+      (*ite)->getFileReader()->tail2kafka();
+    }
+    return;
+  }
+
+  std::vector<FileReader *> readers, more;
+  for (std::vector<LuaCtx *>::const_iterator ite = ctxs.begin(); ite != ctxs.end(); ++ite) {
+    FileReader *reader = (*ite)->getFileReader();
+    if (reader->prepareTail()) readers.push_back(reader);
+  }
+
+  /* every round reads the next block of every file which is behind,
+   * the lines are processed as the completions arrive
+   */
+  while (!readers.empty()) {
+    size_t n = std::min(readers.size(), (size_t) ring_->entries());
+    for (size_t i = 0; i < n; ++i) {
+      size_t len;
+      char *buf = readers[i]->readBuffer(&len);
+      ring_->prepRead(readers[i]->fd(), buf, len, i);
+    }
+
+    /* the requests not submitted stay in the ring and never run */
+    int submitted = ring_->submit();
+    if (submitted < 0) {
+      log_fatal(-submitted, "io_uring submit error, fallback to read");
+      submitted = 0;
+    } else if ((size_t) submitted < n) {
+      log_fatal(0, "io_uring submit %d of %d, fallback to read", submitted, (int) n);
+    }
+
+    /* a submitted read moves the file position and fills the buffer of
+     * its file whenever it completes, so every one is reaped before the
+     * ring goes away. a ring which can not be waited on is broken, exit,
+     * the unacked lines are read again after the restart
+     */
+    std::vector<bool> done(n, false);
+    for (int i = 0; i < submitted; ++i) {
+      uint64_t idx;
+      int res;
+      if (!ring_->wait(&idx, &res)) {
+        log_fatal(errno, "io_uring wait error, %d reads in flight, exit", submitted - i);
+        _exit(EXIT_FAILURE);
+      }
+      done[idx] = true;
+      if (readers[idx]->completeTail(res)) more.push_back(readers[idx]);
+    }
+
+    /* the files not read are already prepared, they finish with read */
+    if (std::find(done.begin(), done.end(), false) != done.end()) {
+      disable();
+      for (size_t i = 0; i < n; ++i) {
+        if (!done[i]) readers[i]->finishTail();
+      }
+      for (size_t i = n; i < readers.size(); ++i) readers[i]->finishTail();
+      for (size_t i = 0; i < more.size(); ++i) more[i]->finishTail();
+      return;
+    }
+
+    /* the files left out of this round go first in the next one */
+    readers.erase(readers.begin(), readers.begin() + n);
+    readers.insert(readers.end(), more.begin(), more.end());
+    more.clear();
+  }
+}
@@ -0,0 +1,36 @@
+#ifndef _URING_TAIL_H_
+#define _URING_TAIL_H_
+
+#include <vector>
+
+class LuaCtx;
+namespace util { class IoUring; }
+
+/* tail many files with one io_uring submission per round instead of one
+ * read syscall per file, useful when hundreds of files are behind after
+ * an outage. one instance per thread, the ring is created on first use,
+ * if the kernel has no io_uring it falls back to FileReader::tail2kafka
+ */
+class UringTail {
+public:
+  UringTail(bool enable) : enable_(enable), ring_(0) {}
+  ~UringTail();
+
+  void tail(const std::vector<LuaCtx *> &ctxs);
+
+  /* checkCache and tail, the periodic check of every file */
+  void checkFiles(const std::vector<LuaCtx *> &ctxs);
+
+private:
+  UringTail(const UringTail &);
+  UringTail &operator=(const UringTail &);
+
+  bool ready();
+  void disable();
+
+private:
+  bool enable_;
+  util::IoUring *ring_;
+};
+
+#endif
@@ -50,4 +50,50 @@ std::string &replace(std::string *s, char o, char n)
   return *s;
 }
 
+static inline uint32_t rotl32(uint32_t x, int r)
+{
+  return (x << r) | (x >> (32 - r));
+}
+
+uint32_t hash(const char *key, size_t len, uint32_t seed)
+{
+  const uint32_t c1 = 0xcc9e2d51;
+  const uint32_t c2 = 0x1b873593;
+  const unsigned char *data = (const unsigned char *) key;
+  size_t nblocks = len / 4;
+  uint32_t h = seed;
+
+  for (size_t i = 0; i < nblocks; ++i) {
+    uint32_t k;
+    memcpy(&k, data + i * 4, 4);
+    k *= c1;
+    k = rotl32(k, 15);
+    k *= c2;
+
+    h ^= k;
+    h = rotl32(h, 13);
+    h = h * 5 + 0xe6546b64;
+  }
+
+  const unsigned char *tail = data + nblocks * 4;
+  uint32_t k = 0;
+  switch (len & 3) {
+  case 3: k ^= tail[2] << 16;  // fall through
+  case 2: k ^= tail[1] << 8;   // fall through
+  case 1: k ^= tail[0];
+    k *= c1;
+    k = rotl32(k, 15);
+    k *= c2;
+    h ^= k;
+  }
+
+  h ^= len;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
 } // namespace util
@@ -5,6 +5,7 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <stdint.h>
 
 namespace util {
 
@@ -92,6 +93,43 @@ inline std::string toStr(IntType i, int len = -1, char padding = '0')
 std::string trim(const std::string &str, bool left = true, bool right = true, const char *space = " \t\n");
 std::string &replace(std::string *s, char o, char n);
 
+/* LEB128, 7 bits a byte, the lengths and offsets of packed lines */
+inline void appendVarint(std::string *s, uint64_t v)
+{
+  while (v >= 0x80) {
+    s->append(1, (char) (v | 0x80));
+    v >>= 7;
+  }
+  s->append(1, (char) v);
+}
+
+inline bool readVarint(const char **ptr, const char *end, uint64_t *v)
+{
+  *v = 0;
+  for (int shift = 0; *ptr < end && shift < 64; shift += 7) {
+    unsigned char c = *(*ptr)++;
+    *v |= (uint64_t) (c & 0x7f) << shift;
+    if (!(c & 0x80)) return true;
+  }
+  return false;
+}
+
+/* big endian, the integer kafka headers */
+inline void encodeUint64(uint64_t v, char *buf)
+{
+  for (int i = 7; i >= 0; --i, v >>= 8) buf[i] = (char) (v & 0xff);
+}
+
+inline uint64_t decodeUint64(const char *buf)
+{
+  uint64_t v = 0;
+  for (int i = 0; i < 8; ++i) v = (v << 8) | (unsigned char) buf[i];
+  return v;
+}
+
+/* murmur3 x86_32, the key of a message to its partition */
+uint32_t hash(const char *key, size_t len, uint32_t seed = 0);
+
 } // namespace util
 
 #endif
@@ -27,6 +27,7 @@ make
 mkdir -p $RPM_BUILD_ROOT/usr/local/bin
 cp build/tail2kafka  $RPM_BUILD_ROOT/usr/local/bin
 cp build/kafka2file  $RPM_BUILD_ROOT/usr/local/bin
+cp build/fileofftool $RPM_BUILD_ROOT/usr/local/bin/tail2kafka-fileofftool
 cp scripts/auto-upgrade.sh $RPM_BUILD_ROOT/usr/local/bin/tail2kafka-auto-upgrade.sh
 
 mkdir -p $RPM_BUILD_ROOT/etc/cron.d